@@ -0,0 +1,132 @@
+/**
+ * MessageU Client
+ * @file benchmarks.cpp
+ * @brief Micro benchmarks of the client's hot paths: symmetric & asymmetric encryption and received files writing.
+ * Usage: messageu_bench [iterations]. Prints throughput per benchmark. No server is required.
+ * @author Roman Koifman
+ * https://github.com/Romansko/MessageU/blob/main/client/bench/benchmarks.cpp
+ */
+#include "AESWrapper.h"
+#include "RSAWrapper.h"
+#include "CFileHandler.h"
+#include "CFileSink.h"
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+	typedef std::chrono::steady_clock clock_t;
+
+	constexpr size_t DEFAULT_ITERATIONS = 100;
+	const size_t     SIZES[]            = { 1 << 10, 64 << 10, 1 << 20 };  // bytes per operation.
+
+	/**
+	 * Run op iterations times. Print average duration, and throughput when bytes are processed per operation.
+	 */
+	void measure(const std::string& name, const size_t iterations, const size_t bytes, const std::function<void()>& op)
+	{
+		op();  // warm up.
+		const auto start = clock_t::now();
+		for (size_t i = 0; i < iterations; ++i)
+			op();
+		const double seconds = std::chrono::duration<double>(clock_t::now() - start).count();
+
+		std::cout << std::left << std::setw(32) << name << std::right << std::fixed << std::setprecision(2)
+			<< std::setw(12) << (seconds * 1000000 / iterations) << " us/op";
+		if (bytes != 0 && seconds > 0)
+			std::cout << std::setw(12) << (static_cast<double>(bytes) * iterations / seconds / (1 << 20)) << " MB/s";
+		std::cout << std::endl;
+	}
+
+	void benchSymmetric(const size_t iterations)
+	{
+		const AESWrapper aes;
+		for (const size_t size : SIZES)
+		{
+			const std::string plain(size, 'm');
+			const std::string cipher = aes.encrypt(plain);
+			const std::string sealed = aes.encryptAEAD(reinterpret_cast<const uint8_t*>(plain.c_str()), plain.size());
+			const std::string suffix = " " + std::to_string(size >> 10) + "KB";
+
+			measure("aes-cbc encrypt" + suffix, iterations, size, [&]() { (void)aes.encrypt(plain); });
+			measure("aes-cbc decrypt" + suffix, iterations, size,
+				[&]() { (void)aes.decrypt(reinterpret_cast<const uint8_t*>(cipher.c_str()), cipher.size()); });
+			measure("aes-gcm encrypt" + suffix, iterations, size,
+				[&]() { (void)aes.encryptAEAD(reinterpret_cast<const uint8_t*>(plain.c_str()), plain.size()); });
+			measure("aes-gcm decrypt" + suffix, iterations, size,
+				[&]() { (void)aes.decryptAEAD(reinterpret_cast<const uint8_t*>(sealed.c_str()), sealed.size()); });
+		}
+	}
+
+	void benchAsymmetric(const size_t iterations)
+	{
+		RSAPrivateWrapper rsaPrivate;
+		SPublicKey publicKey;
+		const std::string encodedKey = rsaPrivate.getPublicKey();
+		memcpy(publicKey.publicKey, encodedKey.c_str(), std::min(encodedKey.size(), sizeof(publicKey.publicKey)));
+		RSAPublicWrapper rsaPublic(publicKey);
+		SSymmetricKey key;
+		AESWrapper::GenerateKey(key.symmetricKey, sizeof(key.symmetricKey));
+		const std::string wrapped = rsaPublic.encrypt(key.symmetricKey, sizeof(key.symmetricKey));
+
+		measure("generate symmetric key", iterations, 0,
+			[&]() { AESWrapper::GenerateKey(key.symmetricKey, sizeof(key.symmetricKey)); });
+		measure("rsa wrap symmetric key", iterations, 0,
+			[&]() { (void)rsaPublic.encrypt(key.symmetricKey, sizeof(key.symmetricKey)); });
+		measure("rsa unwrap symmetric key", iterations, 0,
+			[&]() { (void)rsaPrivate.decrypt(reinterpret_cast<const uint8_t*>(wrapped.c_str()), wrapped.size()); });
+	}
+
+	void benchFiles(const size_t iterations)
+	{
+		const auto folder = boost::filesystem::path(CFileHandler().getTempFolder()) / "MessageU_bench";
+		const std::string filepath = (folder / "file").string();
+		for (const size_t size : SIZES)
+		{
+			const std::string data(size, 'f');
+			const std::string suffix = " " + std::to_string(size >> 10) + "KB";
+			CFileHandler fileHandler;
+			measure("file write" + suffix, iterations, size, [&]() { (void)fileHandler.writeAtOnce(filepath, data); });
+
+			// queued writes complete in the background. Timed until all were written.
+			CFileSink fileSink;
+			std::vector<std::future<bool>> written;
+			written.reserve(iterations + 1);
+			measure("file sink write" + suffix, iterations, size, [&]()
+				{
+					written.push_back(fileSink.write((folder / ("file" + std::to_string(written.size()))).string(), std::string(data)));
+					if (written.size() == iterations + 1)
+					{
+						for (auto& file : written)
+							(void)file.get();
+					}
+				});
+		}
+		boost::system::error_code error;
+		(void)boost::filesystem::remove_all(folder, error);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	const size_t iterations = (argc > 1) ? std::strtoul(argv[1], nullptr, 10) : DEFAULT_ITERATIONS;
+	if (iterations == 0)
+	{
+		std::cerr << "Usage: " << argv[0] << " [iterations]" << std::endl;
+		return 1;
+	}
+
+	benchSymmetric(iterations);
+	benchAsymmetric(iterations);
+	benchFiles(iterations);
+	return 0;
+}
@@ -29,6 +29,11 @@ public:
 	std::string encrypt(const uint8_t* plain,  size_t length) const;
 	std::string decrypt(const uint8_t* cipher, size_t length) const;
 
+	// AES-GCM. cipher = nonce + ciphertext + tag. A fresh random nonce is used per message.
+	// Associated data (aad) is authenticated along, but isn't part of the cipher.
+	std::string encryptAEAD(const uint8_t* plain,  size_t length, const uint8_t* aad = nullptr, size_t aadLength = 0) const;
+	std::string decryptAEAD(const uint8_t* cipher, size_t length, const uint8_t* aad = nullptr, size_t aadLength = 0) const;
+
 private:
 	SSymmetricKey _key;
 };
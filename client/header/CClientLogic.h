@@ -8,17 +8,44 @@
  */
 #pragma once
 #include "protocol.h"
+#include <chrono>
+#include <condition_variable>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
-constexpr auto CLIENT_INFO = "me.info";   // Should be located near exe file.
+constexpr auto CLIENT_INFO = "me.info";   // Should be located near exe file. Used by a standalone client.
 constexpr auto SERVER_INFO = "server.info";  // Should be located near exe file.
+constexpr auto TRANSFERS_INFO = "transfers.info";  // Uploaded blobs & unfinished transfers of a standalone client. Located near exe file.
+
+constexpr size_t COMPRESSION_MIN_SIZE  = 128;  // Smaller contents are not worth compressing.
+constexpr size_t COMPRESSION_MIN_RATIO = 8;    // Compressed content must save at least 1/COMPRESSION_MIN_RATIO of its size.
+
+constexpr size_t   OUTBOUND_MAX_ATTEMPTS   = 5;      // Send attempts of a queued message before reporting failure.
+constexpr uint32_t OUTBOUND_RETRY_DELAY_MS = 500;    // Delay before 1st retry. Doubled upon each retry.
+constexpr uint32_t OUTBOUND_MAX_DELAY_MS   = 30000;
 
 class CFileHandler;
 class CSocketHandler;
 class RSAPrivateWrapper;
+class CThreadPool;
+class CFileSink;
+class CClientsListView;
+class CClientRuntime;
+class CConnectionPool;
+namespace boost { namespace asio { class io_context; } }
 
+/**
+ * Operations may be invoked concurrently, except for parseServeInfo, parseClientInfo & registerClient which
+ * set up the client. Each calling thread has its own last error, socket & file handles.
+ */
 class CClientLogic
 {
 public:
@@ -29,6 +56,7 @@ public:
 		std::string   username;
 		SPublicKey    publicKey;
 		bool          publicKeySet    = false;
+		version_t     version         = DEF_VAL;  // Client's protocol version. Received along with public key.
 		SSymmetricKey symmetricKey;
 		bool          symmetricKeySet = false;
 	};
@@ -39,16 +67,39 @@ public:
 		std::string content;
 	};
 
+	struct SBlob  // file uploaded as a blob. Allows sending a file again without re-reading, re-encrypting and re-uploading it.
+	{
+		SBlobHash     hash;
+		SSymmetricKey contentKey;
+		messageType_t flags     = DEF_VAL;   // blob's encoding. EMessageFlag.
+		uint64_t      fileSize  = 0;
+		std::time_t   lastWrite = 0;
+		bool          uploaded  = false;     // Until uploaded, the encrypted blob is spooled on disk.
+	};
+
+	struct SDownload  // referenced blob which is downloaded until completed, even across client restarts.
+	{
+		SBlobHash     hash;
+		SSymmetricKey contentKey;
+		messageType_t messageType = DEF_VAL;   // EMessageType | blob's EMessageFlag.
+		std::string   username;                // source username
+		bool          claimed     = false;     // being downloaded by a thread. Not stored.
+	};
+
+	typedef uint64_t ticket_t;  // identifies a queued message.
+	typedef std::function<void(const ticket_t ticket, const bool sent, const std::string& error)> sentCallback_t;
+
 public:
 	CClientLogic();
+	CClientLogic(CClientRuntime& runtime, const std::string& clientInfo);
 	virtual ~CClientLogic();
 	CClientLogic(const CClientLogic& other) = delete;
 	CClientLogic(CClientLogic&& other) noexcept = delete;
 	CClientLogic& operator=(const CClientLogic& other) = delete;
 	CClientLogic& operator=(CClientLogic&& other) noexcept = delete;
 
-	// inline getters
-	std::string getLastError() const { return _lastError.str(); }
+	// getters
+	std::string getLastError() const { return operation().error.str(); }  // of the calling thread.
 	std::string getSelfUsername() const { return _self.username; }
 	SClientID   getSelfClientID() const { return _self.id; }
 	
@@ -58,24 +109,111 @@ public:
 	std::vector<std::string> getUsernames() const;
 	bool registerClient(const std::string& username);
 	bool requestClientsList();
+	bool requestClientsList(const std::function<void(const CClientsListView&)>& consumer);
 	bool requestClientPublicKey(const std::string& username);
 	bool requestPendingMessages(std::vector<SMessage>& messages);
 	bool sendMessage(const std::string& username, const EMessageType type, const std::string& data = "");
+	bool sendFanout(const std::vector<std::string>& usernames, const std::string& text);
+
+	static std::string receivedFilePath(const std::string& username);
+
+	// outbound queue. Messages are sent by a background sender thread.
+	ticket_t queueMessage(const std::string& username, const EMessageType type, const std::string& data = "", const sentCallback_t& onSent = nullptr);
+	size_t outboundSize() const;
+	void flushOutbound();
 
 private:
+	typedef std::vector<SClient> clients_t;
+
+	struct SOperation  // state of a calling thread. Destroyed upon thread's exit.
+	{
+		std::stringstream error;
+		CFileHandler*     fileHandler   = nullptr;
+		CSocketHandler*   socketHandler = nullptr;  // leased for the duration of an operation.
+		~SOperation();
+	};
+
+	struct SOutbound  // queued message.
+	{
+		ticket_t       ticket   = 0;
+		std::string    username;  // destination username
+		EMessageType   type     = MSG_TEXT;
+		std::string    data;
+		sentCallback_t onSent;
+		size_t         attempts = 0;
+		std::chrono::steady_clock::time_point due;  // earliest next attempt.
+	};
+
+	class CSocketLease
+	{
+	public:
+		explicit CSocketLease(CClientLogic& logic);
+		~CSocketLease();
+	private:
+		CClientLogic& _logic;
+		bool          _leased;
+	};
+
 	void clearLastError();
+	static SOperation& operation();
+	std::stringstream& lastError() const { return operation().error; }
+	CFileHandler* fileHandler() const;
+	CSocketHandler* socketHandler() const { return operation().socketHandler; }
+	std::shared_ptr<const clients_t> clients() const { return std::atomic_load(&_clients); }
+	bool updateClient(const SClientID& clientID, const std::function<void(SClient&)>& update);
 	bool storeClientInfo();
 	bool validateHeader(const SResponseHeader& header, const EResponseCode expectedCode);
 	bool receiveUnknownPayload(const uint8_t* const request, const size_t reqSize, const EResponseCode expectedCode, uint8_t*& payload, size_t& size);
-	bool setClientPublicKey(const SClientID& clientID, const SPublicKey& publicKey);
+	bool setClientPublicKey(const SClientID& clientID, const SPublicKey& publicKey, const version_t version);
 	bool setClientSymmetricKey(const SClientID& clientID, const SSymmetricKey& symmetricKey);
 	bool getClient(const std::string& username, SClient& client) const;
 	bool getClient(const SClientID& clientID, SClient& client) const;
+	static const SClient* findClient(const clients_t& clients, const SClientID& clientID);
+	bool encryptFileChunks(const SSymmetricKey& key, const uint8_t* const file, const size_t bytes, const std::string& compressedFirst, const bool stream,
+		const std::function<bool(const uint64_t)>& onContentSize, const std::function<bool(const void*, const size_t, const bool)>& sink);
+	static bool fileFits(const SClient& client, const uint64_t fileSize);
+	bool sendFileChunks(SRequestSendMessage& request, const SSymmetricKey& key, const uint8_t* const file, const size_t bytes, const bool stream, SResponseMessageSent& response);
+	bool getFileBlob(const std::string& filepath, const bool stream, SBlob& blob, bool& cached);
+	bool uploadBlob(const std::string& filepath, SBlob& blob);
+	bool queueDownload(const SSymmetricKey& key, const messageType_t messageType, const uint8_t* const content, const std::string& username);
+	bool resumeDownloads(std::vector<SMessage>& messages);
+	bool downloadBlob(const SDownload& download);
+	static const std::string& filesFolder();
+	bool storeReceivedFile(const std::string& username, const std::string& data, std::string& filepath);
+	bool storeReceivedChunks(const std::string& username, const SSymmetricKey& key, const messageType_t messageType, const uint8_t* const content, const size_t size, std::string& filepath);
+	std::string spoolPath(const SBlobHash& hash, const std::string& extension) const;
+	std::string spoolPath(const std::string& name, const std::string& extension) const;
+	bool storeTransfers();
+	bool loadTransfers();
+	std::string decryptContent(const SSymmetricKey& key, const messageType_t messageType, const uint8_t* const content, const size_t size) const;
+	std::string decryptFileChunks(const SSymmetricKey& key, const messageType_t messageType, const uint8_t* const content, const size_t size) const;
+	bool decryptFileChunks(const SSymmetricKey& key, const messageType_t messageType, const uint8_t* const content, const size_t size,
+		const std::function<bool(const std::string&)>& sink) const;
+	static bool tryCompress(const uint8_t* const plain, const size_t length, std::string& compressed);
+	void senderLoop();
+	void sendBatch(std::vector<SOutbound>& batch, std::vector<SOutbound>& retries);
+	bool isDeliverable(const SOutbound& message);
 
-	SClient              _self;           // self symmetric key invalid.
-	std::vector<SClient> _clients;
-	std::stringstream    _lastError;
-	CFileHandler*        _fileHandler;
-	CSocketHandler*      _socketHandler;
-	RSAPrivateWrapper*   _rsaDecryptor;
+	SClient                          _self;           // self symmetric key invalid.
+	std::shared_ptr<const clients_t> _clients;        // replaced as a whole upon update, hence readers never block.
+	std::mutex                       _clientsMutex;   // serializes updates.
+	std::map<std::string, SBlob>     _blobs;          // uploaded blobs by filepath.
+	std::vector<SDownload>           _downloads;
+	std::recursive_mutex             _transfersMutex; // guards _blobs, _downloads & transfers file.
+	const std::string                _clientInfo;     // credentials file.
+	const std::string                _transfersInfo;
+	boost::asio::io_context*         _ioContext;      // owned by a standalone client.
+	CConnectionPool*                 _connections;
+	RSAPrivateWrapper*               _rsaDecryptor;
+	std::mutex                       _rsaMutex;
+	CThreadPool*                     _threadPool;
+	CFileSink*                       _fileSink;       // writes received files.
+	CClientRuntime*                  _runtime;        // nullptr for a standalone client.
+	std::deque<SOutbound>            _outbound;
+	ticket_t                         _lastTicket;
+	size_t                           _sending;        // messages of the batch being sent.
+	bool                             _stopSender;
+	mutable std::mutex               _outboundMutex;
+	std::condition_variable          _outboundChanged;
+	std::thread                      _sender;         // started upon first queued message.
 };
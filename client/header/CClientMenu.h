@@ -10,17 +10,19 @@
 #include "CClientLogic.h"
 #include <string>       // std::to_string
 #include <iomanip>      // std::setw
+#include <mutex>
+#include <vector>
 
 class CClientMenu
 {
 public:
 	CClientMenu() : _registered(false) {}
 	void initialize();
-	void display() const;
+	void display();
 	void handleUserChoice();
 
-	void clear() const { system("cls"); }     // clear menu
-	void pause() const { system("pause"); }   // pause menu
+	void clear() const;   // clear menu
+	void pause() const;   // pause menu
 
 private:
 	
@@ -37,6 +39,7 @@ private:
 			MENU_REQ_SYM_KEY     = 51,
 			MENU_SEND_SYM_KEY    = 52,
 			MENU_SEND_FILE       = 53,
+			MENU_SEND_FANOUT     = 54,
 			MENU_EXIT            = 0
 		};
 
@@ -66,8 +69,11 @@ private:
 	void clientStop(const std::string& error) const;
 	std::string readUserInput(const std::string& description = "") const;
 	bool getMenuOption(CMenuOption& menuOption) const;
+	void queueMessage(const std::string& username, const EMessageType type, const std::string& data, const std::string& description);
 
 
+	std::vector<std::string>       _reports;        // outcomes of queued messages. Displayed along with menu.
+	std::mutex                     _reportsMutex;   // declared before _clientLogic, whose sender thread reports.
 	CClientLogic                   _clientLogic;
 	bool                           _registered;
 	const std::vector<CMenuOption> _menuOptions {
@@ -75,10 +81,11 @@ private:
 		{ CMenuOption::EOption::MENU_REQ_CLIENT_LIST, true,  "Request for client list",          ""},
 		{ CMenuOption::EOption::MENU_REQ_PUBLIC_KEY,  true,  "Request for public key",           "Public key was retrieved successfully."},
 		{ CMenuOption::EOption::MENU_REQ_PENDING_MSG, true,  "Request for waiting messages",     ""},
-		{ CMenuOption::EOption::MENU_SEND_MSG,        true,  "Send a text message",              "Message was sent successfully."},
+		{ CMenuOption::EOption::MENU_SEND_MSG,        true,  "Send a text message",              "Message was queued for sending."},
 		{ CMenuOption::EOption::MENU_REQ_SYM_KEY,     true,  "Send a request for symmetric key", "Symmetric key request was sent successfully."},
 		{ CMenuOption::EOption::MENU_SEND_SYM_KEY,    true,  "Send your symmetric key",          "Symmetric key was sent successfully."},
-		{ CMenuOption::EOption::MENU_SEND_FILE,       true,  "Send a file",                      "File was sent successfully."},
+		{ CMenuOption::EOption::MENU_SEND_FILE,       true,  "Send a file",                      "File was queued for sending."},
+		{ CMenuOption::EOption::MENU_SEND_FANOUT,     true,  "Send a text message to several users", "Message was sent successfully."},
 		{ CMenuOption::EOption::MENU_EXIT,            false, "Exit client",                      ""}
 	};
 };
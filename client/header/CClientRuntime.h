@@ -0,0 +1,64 @@
+/**
+ * MessageU Client
+ * @file CClientRuntime.h
+ * @brief Runtime of many client identities within one process.
+ * Identities share one I/O context, connection pool and thread pool. Each identity is a CClientLogic
+ * with its own credentials file, keys, clients list and transfers.
+ * @author Roman Koifman
+ * https://github.com/Romansko/MessageU/blob/main/client/header/CClientRuntime.h
+ */
+#pragma once
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio/io_context.hpp>
+
+using boost::asio::io_context;
+
+constexpr size_t RUNTIME_MAX_CONNECTIONS = 64;       // Default bound of concurrent connections to server.
+constexpr auto   IDENTITY_EXTENSION      = ".info";  // Credentials files within identities directory. Same format as CLIENT_INFO.
+
+class CClientLogic;
+class CConnectionPool;
+class CFileHandler;
+class CThreadPool;
+class CFileSink;
+
+class CClientRuntime
+{
+public:
+	explicit CClientRuntime(size_t maxConnections = RUNTIME_MAX_CONNECTIONS, size_t threads = std::thread::hardware_concurrency());
+	virtual ~CClientRuntime();
+
+	// do not allow
+	CClientRuntime(const CClientRuntime& other)                = delete;
+	CClientRuntime(CClientRuntime&& other) noexcept            = delete;
+	CClientRuntime& operator=(const CClientRuntime& other)     = delete;
+	CClientRuntime& operator=(CClientRuntime&& other) noexcept = delete;
+
+	// inline getters
+	std::string      getLastError() const { return _lastError.str(); }
+	CConnectionPool& connections() const  { return *_connections; }
+	CThreadPool&     threadPool() const   { return *_threadPool; }
+	CFileSink&       fileSink() const     { return *_fileSink; }
+
+	// runtime logic
+	bool parseServeInfo();
+	bool loadIdentities(const std::string& directory);
+	CClientLogic* registerIdentity(const std::string& directory, const std::string& username);
+	CClientLogic* getIdentity(const std::string& username) const;
+	std::vector<std::string> getIdentities() const;
+
+private:
+	void clearLastError();
+
+	io_context*                          _ioContext;
+	CConnectionPool*                     _connections;
+	CThreadPool*                         _threadPool;
+	CFileSink*                           _fileSink;
+	CFileHandler*                        _fileHandler;
+	std::map<std::string, CClientLogic*> _identities;  // by username.
+	std::stringstream                    _lastError;
+};
@@ -0,0 +1,46 @@
+/**
+ * MessageU Client
+ * @file CConnectionPool.h
+ * @brief Bounded pool of socket handlers sharing one I/O context.
+ * Protocol uses a connection per request, hence a socket handler is leased per operation.
+ * Leasing blocks while all handlers are leased, which bounds the concurrent connections to the server.
+ * @author Roman Koifman
+ * https://github.com/Romansko/MessageU/blob/main/client/header/CConnectionPool.h
+ */
+#pragma once
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <boost/asio/io_context.hpp>
+
+using boost::asio::io_context;
+
+class CSocketHandler;
+
+class CConnectionPool
+{
+public:
+	CConnectionPool(io_context& ioContext, size_t maxConnections);
+	virtual ~CConnectionPool();
+
+	// do not allow
+	CConnectionPool(const CConnectionPool& other)                = delete;
+	CConnectionPool(CConnectionPool&& other) noexcept            = delete;
+	CConnectionPool& operator=(const CConnectionPool& other)     = delete;
+	CConnectionPool& operator=(CConnectionPool&& other) noexcept = delete;
+
+	bool setServerInfo(const std::string& address, const std::string& port);
+	CSocketHandler* acquire();
+	void release(CSocketHandler* const socket);
+
+private:
+	io_context&                  _ioContext;
+	std::string                  _address;
+	std::string                  _port;
+	const size_t                 _maxConnections;
+	size_t                       _leased;
+	std::vector<CSocketHandler*> _idle;
+	std::mutex                   _mutex;
+	std::condition_variable      _available;
+};
@@ -7,8 +7,13 @@
  */
 
 #pragma once
+#include <cstdint>
 #include <string>
 #include <fstream>
+#include <ctime>
+#include <vector>
+
+namespace boost { namespace interprocess { class file_mapping; class mapped_region; } }
 
 class CFileHandler
 {
@@ -23,22 +28,33 @@ public:
     CFileHandler& operator=(CFileHandler&& other) noexcept = delete;
 
 	// file wrapper functions
-    bool open(const std::string& filepath, bool write = false);
+    bool open(const std::string& filepath, bool write = false, bool append = false);
     void close();
     bool read(uint8_t* const dest, const size_t bytes) const;
+    bool seek(const uint64_t offset) const;
     bool write(const uint8_t* const src, const size_t bytes) const;
     bool remove(const std::string& filepath) const;
+    bool rename(const std::string& from, const std::string& to) const;
     bool readLine(std::string& line) const;
     bool writeLine(const std::string& line) const;
-    size_t size() const;
+    uint64_t size() const;
+    bool fileInfo(const std::string& filepath, uint64_t& bytes, std::time_t& lastWrite) const;
+    std::vector<std::string> listFiles(const std::string& directory, const std::string& extension) const;
 
     bool readAtOnce(const std::string& filepath, uint8_t*& file, size_t& bytes);
     bool writeAtOnce(const std::string& filepath, const std::string& data);
 
+	// read only memory mapping. A single file is mapped at a time.
+    bool mapAtOnce(const std::string& filepath, const uint8_t*& file, size_t& bytes);
+    void unmap();
+
 	// Special folders
     std::string getTempFolder() const;
 
 private:
     std::fstream* _fileStream;
     bool          _open;  // indicates whether a file is open.
+    std::string   _folder;  // last folder created by open(). Created again only if opening fails.
+    boost::interprocess::file_mapping*  _mapping;
+    boost::interprocess::mapped_region* _region;   // mapped view of _mapping.
 };
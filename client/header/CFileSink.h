@@ -0,0 +1,52 @@
+/**
+ * MessageU Client
+ * @file CFileSink.h
+ * @brief Writes files on a background thread, so producers continue while files are written.
+ * @author Roman Koifman
+ * https://github.com/Romansko/MessageU/blob/main/client/header/CFileSink.h
+ */
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+
+class CFileHandler;
+
+class CFileSink
+{
+public:
+	CFileSink();
+	virtual ~CFileSink();
+
+	// do not allow
+	CFileSink(const CFileSink& other)                = delete;
+	CFileSink(CFileSink&& other) noexcept            = delete;
+	CFileSink& operator=(const CFileSink& other)     = delete;
+	CFileSink& operator=(CFileSink&& other) noexcept = delete;
+
+	/**
+	 * Queue data to be written to filepath. Files are written in queueing order.
+	 * The future is set once the file was written, to false upon failure.
+	 */
+	std::future<bool> write(const std::string& filepath, std::string&& data);
+
+private:
+	struct SFile
+	{
+		std::string        filepath;
+		std::string        data;
+		std::promise<bool> written;
+	};
+
+	void writeLoop();
+
+	CFileHandler*           _fileHandler;  // used by the writer thread only.
+	std::deque<SFile>       _files;
+	std::mutex              _mutex;
+	std::condition_variable _condition;
+	bool                    _stop;
+	std::thread             _writer;
+};
@@ -0,0 +1,129 @@
+/**
+ * MessageU Client
+ * @file CLatencyStats.h
+ * @brief Latency histograms of request phases, per request code.
+ * Phases are timed by the calling thread and attributed to the request code which the thread is currently handling.
+ * Disabled by default. When disabled, a timer costs a single relaxed atomic load.
+ * @author Roman Koifman
+ * https://github.com/Romansko/MessageU/blob/main/client/header/CLatencyStats.h
+ */
+#pragma once
+#include "protocol.h"
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <string>
+
+constexpr size_t LATENCY_BUCKETS = 32;   // Bucket i > 0 counts durations within [2^(i-1), 2^i) microseconds.
+constexpr size_t LATENCY_CODES   = REQUEST_OPTIONS + 1;   // Last slot counts phases outside of a request.
+
+enum ELatencyPhase
+{
+	PHASE_CONNECT = 0,  // resolve & connect.
+	PHASE_SERIALIZE,    // request composition.
+	PHASE_ENCRYPT,
+	PHASE_DECRYPT,
+	PHASE_SEND,
+	PHASE_FIRST_BYTE,   // last byte sent until first byte received.
+	PHASE_RECEIVE,      // full receive, including the wait for first byte.
+	PHASE_DISK_WRITE,
+	PHASE_REQUEST,      // whole request.
+	PHASE_COUNT
+};
+
+struct SLatencySummary
+{
+	uint64_t count   = 0;
+	uint64_t totalUs = 0;
+	uint64_t maxUs   = 0;
+	uint64_t p50Us   = 0;   // percentiles are upper bounds of histogram buckets.
+	uint64_t p90Us   = 0;
+	uint64_t p99Us   = 0;
+};
+
+class CLatencyStats
+{
+public:
+	typedef std::chrono::steady_clock clock_t;
+
+	/**
+	 * Time a phase from construction until stop() or destruction.
+	 */
+	class CTimer
+	{
+	public:
+		explicit CTimer(const ELatencyPhase phase) : _phase(phase), _code(DEF_VAL), _active(enabled()), _explicitCode(false)
+		{
+			if (_active)
+				_start = clock_t::now();
+		}
+		CTimer(const ELatencyPhase phase, const code_t code) : _phase(phase), _code(code), _active(enabled()), _explicitCode(true)
+		{
+			if (_active)
+				_start = clock_t::now();
+		}
+		~CTimer() { stop(); }
+		CTimer(const CTimer& other)            = delete;
+		CTimer& operator=(const CTimer& other) = delete;
+
+		void stop()
+		{
+			if (!_active)
+				return;
+			_active = false;
+			record(_explicitCode ? _code : currentCode(), _phase, clock_t::now() - _start);
+		}
+
+	private:
+		const ELatencyPhase _phase;
+		const code_t        _code;
+		bool                _active;
+		const bool          _explicitCode;  // otherwise, phase is attributed to the current request of calling thread.
+		clock_t::time_point _start;
+	};
+
+	/**
+	 * Attribute phases timed by the calling thread to a request code, and time the whole request.
+	 * Requests may nest. Upon destruction, the outer request code is restored.
+	 */
+	class CRequest
+	{
+	public:
+		explicit CRequest(const code_t code);
+		~CRequest();
+		CRequest(const CRequest& other)            = delete;
+		CRequest& operator=(const CRequest& other) = delete;
+
+	private:
+		code_t              _outer;
+		bool                _active;
+		clock_t::time_point _start;
+	};
+
+	static bool enabled() { return _enabled.load(std::memory_order_relaxed); }
+	static void enable(const bool enable) { _enabled.store(enable, std::memory_order_relaxed); }
+	static code_t currentCode();
+	static void record(const code_t code, const ELatencyPhase phase, const clock_t::duration elapsed);
+	static void reset();
+	static SLatencySummary summary(const code_t code, const ELatencyPhase phase);
+	static void dumpText(std::ostream& os);
+	static void dumpJson(std::ostream& os);
+	static bool startDump(const std::string& filepath, const uint32_t intervalSeconds);
+	static void stopDump();
+	static const char* phaseName(const ELatencyPhase phase);
+
+private:
+	struct SHistogram
+	{
+		std::atomic<uint64_t> buckets[LATENCY_BUCKETS];
+		std::atomic<uint64_t> count;
+		std::atomic<uint64_t> totalUs;
+		std::atomic<uint64_t> maxUs;
+	};
+
+	static size_t slot(const code_t code);
+	static void dumpLoop(const std::string filepath, const uint32_t intervalSeconds);
+
+	static std::atomic<bool> _enabled;
+	static SHistogram        _histograms[LATENCY_CODES][PHASE_COUNT];
+};
@@ -7,6 +7,7 @@
  */
 #pragma once
 #include <string>
+#include <chrono>
 #include <cstdint>
 #include <ostream>
 #include <boost/asio/ip/tcp.hpp>
@@ -20,6 +21,7 @@ class CSocketHandler
 {
 public:
 	CSocketHandler();
+	explicit CSocketHandler(io_context& ioContext);  // shared I/O context. Not owned.
 	virtual ~CSocketHandler();
 
 	// do not allow
@@ -56,9 +58,9 @@ private:
 	io_context*    _ioContext;
 	tcp::resolver* _resolver;
 	tcp::socket*   _socket;
-	bool           _bigEndian;
+	bool           _ownsContext;
 	bool           _connected;  // indicates that socket has been open and connected.
-
-	void swapBytes(uint8_t* const buffer, size_t size) const;
+	mutable bool   _awaitingResponse;  // 1st received byte since last send is timed.
+	mutable std::chrono::steady_clock::time_point _sentAt;
 
 };
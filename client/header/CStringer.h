@@ -18,5 +18,8 @@ public:
 
 	static void trim(std::string& stringToTrim);
 
+	static std::string compress(const uint8_t* buffer, const size_t size);
+	static std::string decompress(const uint8_t* buffer, const size_t size, const size_t maxSize);
+
 	static std::string getTimestamp();
 };
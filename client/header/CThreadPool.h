@@ -0,0 +1,58 @@
+/**
+ * MessageU Client
+ * @file CThreadPool.h
+ * @brief Fixed size pool of worker threads. Used for CPU bound work such as chunks encryption.
+ * @author Roman Koifman
+ * https://github.com/Romansko/MessageU/blob/main/client/header/CThreadPool.h
+ */
+#pragma once
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+class CThreadPool
+{
+public:
+	explicit CThreadPool(size_t threads = std::thread::hardware_concurrency());
+	virtual ~CThreadPool();
+
+	// do not allow
+	CThreadPool(const CThreadPool& other)                = delete;
+	CThreadPool(CThreadPool&& other) noexcept            = delete;
+	CThreadPool& operator=(const CThreadPool& other)     = delete;
+	CThreadPool& operator=(CThreadPool&& other) noexcept = delete;
+
+	size_t size() const { return _workers.size(); }
+
+	/**
+	 * Queue a task for execution. Exceptions thrown by task are rethrown by future's get().
+	 * Note: future's destructor does not wait. Caller must wait for tasks which use its stack.
+	 */
+	template <typename F>
+	auto submit(F&& task) -> std::future<decltype(task())>
+	{
+		using result_t = decltype(task());
+		const auto packaged = std::make_shared<std::packaged_task<result_t()>>(std::forward<F>(task));
+		std::future<result_t> result = packaged->get_future();
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_tasks.emplace([packaged]() { (*packaged)(); });
+		}
+		_condition.notify_one();
+		return result;
+	}
+
+private:
+	void work();
+
+	std::vector<std::thread>          _workers;
+	std::queue<std::function<void()>> _tasks;
+	std::mutex                        _mutex;
+	std::condition_variable           _condition;
+	bool                              _stop;
+};
@@ -9,6 +9,10 @@
 
 #pragma once
 #include <cstdint>
+#include <cstring>
+#ifdef _MSC_VER
+#include <stdlib.h>   // _byteswap_ushort, _byteswap_ulong, _byteswap_uint64
+#endif
 
 enum { DEF_VAL = 0 };  // Default value used to initialize protocol structures.
 
@@ -18,15 +22,32 @@ typedef uint16_t code_t;
 typedef uint8_t  messageType_t;
 typedef uint32_t messageID_t;
 typedef uint32_t csize_t;  // protocol's size type: Content's, payload's and message's size.
+typedef uint64_t bsize_t;  // blob's size & offsets within a blob. Large object extension of VERSION_LARGE.
 
 // Constants. All sizes are in BYTES.
-constexpr version_t CLIENT_VERSION         = 2;
+constexpr version_t CLIENT_VERSION         = 9;
+constexpr version_t VERSION_AEAD           = 3;    // First client version which supports AES-GCM messages.
+constexpr version_t VERSION_CHUNKED        = 4;    // First client version which supports chunked file messages.
+constexpr version_t VERSION_COMPRESSION    = 5;    // First client version which supports compressed messages.
+constexpr version_t VERSION_BLOB           = 6;    // First client version which supports messages referencing uploaded blobs.
+constexpr version_t VERSION_RESUMABLE      = 7;    // First client version which downloads referenced blobs by itself.
+constexpr version_t VERSION_LARGE          = 8;    // First client version which transfers blobs of 64 bit sizes.
+constexpr version_t VERSION_STREAM         = 9;    // First client version which authenticates chunks' order (MSG_FLAG_STREAM).
 constexpr size_t    CLIENT_ID_SIZE         = 16;
 constexpr size_t    CLIENT_NAME_SIZE       = 255;
 constexpr size_t    PUBLIC_KEY_SIZE        = 160;  // defined in protocol. 1024 bits.
 constexpr size_t    SYMMETRIC_KEY_SIZE     = 16;   // defined in protocol.  128 bits.
-constexpr size_t    REQUEST_OPTIONS        = 5;
-constexpr size_t    RESPONSE_OPTIONS       = 6;
+constexpr size_t    AEAD_NONCE_SIZE        = 12;   // AES-GCM per-message nonce.  96 bits.
+constexpr size_t    AEAD_TAG_SIZE          = 16;   // AES-GCM authentication tag. 128 bits.
+constexpr size_t    FILE_CHUNK_SIZE        = 1 << 20;  // Plain bytes per chunk of a chunked file message. 1 MiB.
+constexpr size_t    TEXT_MAX_SIZE          = 1 << 20;  // Plain bytes of a text message. 1 MiB.
+constexpr size_t    PAYLOAD_MAX_SIZE       = 1 << 30;  // Request payload accepted by the server. 1 GiB. Larger requests are refused.
+constexpr size_t    BLOB_HASH_SIZE         = 32;   // SHA-256 of an uploaded blob. 256 bits.
+constexpr size_t    WRAPPED_KEY_SIZE       = AEAD_NONCE_SIZE + SYMMETRIC_KEY_SIZE + AEAD_TAG_SIZE;  // AES-GCM encrypted content key.
+constexpr size_t    TRANSFER_CHUNK_SIZE    = 1 << 20;  // Maximal blob bytes per upload/download chunk request. 1 MiB.
+constexpr size_t    FANOUT_MAX_RECIPIENTS  = 256;  // Recipients of a single fan-out message.
+constexpr size_t    REQUEST_OPTIONS        = 9;
+constexpr size_t    RESPONSE_OPTIONS       = 10;
 
 enum ERequestCode
 {
@@ -34,7 +55,11 @@ enum ERequestCode
 	REQUEST_CLIENTS_LIST   = 1001,   // payload invalid. payloadSize = 0.
 	REQUEST_PUBLIC_KEY     = 1002,
 	REQUEST_SEND_MSG       = 1003,
-	REQUEST_PENDING_MSG    = 1004    // payload invalid. payloadSize = 0.
+	REQUEST_PENDING_MSG    = 1004,   // payload invalid. payloadSize = 0.
+	REQUEST_UPLOAD_BLOB    = 1005,
+	REQUEST_UPLOAD_CHUNK   = 1006,
+	REQUEST_DOWNLOAD_CHUNK = 1007,
+	REQUEST_SEND_FANOUT    = 1008
 };
 
 enum EResponseCode
@@ -44,6 +69,10 @@ enum EResponseCode
 	RESPONSE_PUBLIC_KEY    = 2002,
 	RESPONSE_MSG_SENT      = 2003,
 	RESPONSE_PENDING_MSG   = 2004,
+	RESPONSE_BLOB_STORED   = 2005,
+	RESPONSE_UPLOAD_ACK    = 2006,
+	RESPONSE_DOWNLOAD_CHUNK= 2007,
+	RESPONSE_FANOUT_SENT   = 2008,
 	RESPONSE_ERROR         = 9000    // payload invalid. payloadSize = 0.
 };
 
@@ -55,6 +84,90 @@ enum EMessageType
 	MSG_FILE                  = 4    // content = encrypted file by symmetric key.
 };
 
+/**
+ * Message type is stored in the low 3 bits of messageType_t. The other bits hold EMessageFlag bits,
+ * which describe how the content was encoded. Messages without flags are decoded as version 2 messages.
+ */
+constexpr messageType_t MSG_TYPE_MASK = 0x07;
+
+enum EMessageFlag
+{
+	MSG_FLAG_STREAM           = 0x08,  // each chunk's AES-GCM associated data is its SChunkAAD. Sent to clients of VERSION_STREAM.
+	MSG_FLAG_AEAD             = 0x10,  // content = nonce + AES-GCM ciphertext + tag. (AES-CBC otherwise).
+	MSG_FLAG_CHUNKED          = 0x20,  // content = sequence of SFileChunk, each independently AES-GCM encrypted.
+	MSG_FLAG_COMPRESSED       = 0x40,  // plain content (or each plain chunk) was Deflate compressed before encryption.
+	MSG_FLAG_BLOB             = 0x80   // content = SBlobReference. Other flags describe the blob's encoding by the content key.
+};
+
+// Protocol is little endian. Only integer fields are converted on big endian hosts. Opaque bytes are never touched.
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+constexpr bool HOST_BIG_ENDIAN = true;
+#else
+constexpr bool HOST_BIG_ENDIAN = false;   // Windows targets are little endian.
+#endif
+
+inline uint8_t byteSwap(const uint8_t value)
+{
+	return value;
+}
+
+inline uint16_t byteSwap(const uint16_t value)
+{
+#ifdef _MSC_VER
+	return _byteswap_ushort(value);
+#else
+	return __builtin_bswap16(value);
+#endif
+}
+
+inline uint32_t byteSwap(const uint32_t value)
+{
+#ifdef _MSC_VER
+	return _byteswap_ulong(value);
+#else
+	return __builtin_bswap32(value);
+#endif
+}
+
+inline uint64_t byteSwap(const uint64_t value)
+{
+#ifdef _MSC_VER
+	return _byteswap_uint64(value);
+#else
+	return __builtin_bswap64(value);
+#endif
+}
+
+/**
+ * An integer field in protocol's byte order. Converted upon store & load only.
+ * Held as bytes, hence safe to access within packed structs. On little endian hosts, store & load are plain moves.
+ */
+template <typename T>
+class CLittleEndian
+{
+public:
+	CLittleEndian(const T value = DEF_VAL) { store(value); }
+	CLittleEndian& operator=(const T value) { store(value); return *this; }
+
+	operator T() const
+	{
+		T value;
+		memcpy(&value, _bytes, sizeof(value));
+		return HOST_BIG_ENDIAN ? byteSwap(value) : value;
+	}
+
+private:
+	uint8_t _bytes[sizeof(T)];
+
+	void store(T value)
+	{
+		if (HOST_BIG_ENDIAN)
+			value = byteSwap(value);
+		memcpy(_bytes, &value, sizeof(value));
+	}
+};
+static_assert(sizeof(CLittleEndian<csize_t>) == sizeof(csize_t), "protocol fields must not be padded");
+
 #pragma pack(push, 1)
 
 struct SClientID
@@ -93,21 +206,38 @@ struct SSymmetricKey
 	SSymmetricKey() : symmetricKey{ DEF_VAL } {}
 };
 
+struct SBlobHash
+{
+	uint8_t hash[BLOB_HASH_SIZE];
+	SBlobHash() : hash{ DEF_VAL } {}
+
+	bool operator==(const SBlobHash& otherHash) const {
+		for (size_t i = 0; i < BLOB_HASH_SIZE; ++i)
+			if (hash[i] != otherHash.hash[i])
+				return false;
+		return true;
+	}
+
+	bool operator!=(const SBlobHash& otherHash) const {
+		return !(*this == otherHash);
+	}
+};
+
 struct SRequestHeader
 {
-	SClientID       clientId;
-	const version_t version;
-	const code_t    code;
-	csize_t         payloadSize;
+	SClientID                   clientId;
+	const version_t             version;
+	const CLittleEndian<code_t> code;
+	CLittleEndian<csize_t>      payloadSize;
 	SRequestHeader(const code_t reqCode) : version(CLIENT_VERSION), code(reqCode), payloadSize(DEF_VAL) {}
 	SRequestHeader(const SClientID& id, const code_t reqCode) : clientId(id), version(CLIENT_VERSION), code(reqCode), payloadSize(DEF_VAL) {}
 };
 
 struct SResponseHeader
 {
-	version_t version;
-	code_t    code;
-	csize_t   payloadSize;
+	version_t              version;
+	CLittleEndian<code_t>  code;
+	CLittleEndian<csize_t> payloadSize;
 	SResponseHeader() : version(DEF_VAL), code(DEF_VAL), payloadSize(DEF_VAL) {}
 };
 
@@ -137,7 +267,13 @@ struct SRequestClientsList
 struct SResponseClientsList
 {
 	SResponseHeader header;
-	/* variable { SClientID + SClientName } */
+	/* variable { SClientsListEntry } */
+};
+
+struct SClientsListEntry
+{
+	SClientID   clientId;
+	SClientName clientName;
 };
 
 struct SRequestPublicKey
@@ -150,10 +286,12 @@ struct SRequestPublicKey
 struct SResponsePublicKey
 {
 	SResponseHeader header;
-	struct
+	struct SPayload
 	{
 		SClientID   clientId;
 		SPublicKey  clientPublicKey;
+		version_t   clientVersion;   // Sent to clients of VERSION_AEAD and above.
+		SPayload() : clientVersion(DEF_VAL) {}
 	}payload;
 };
 
@@ -162,9 +300,9 @@ struct SRequestSendMessage
 	SRequestHeader header;
 	struct SPayloadHeader
 	{
-		SClientID           clientId;   // destination client
-		const messageType_t messageType;
-		csize_t             contentSize;
+		SClientID              clientId;     // destination client
+		messageType_t          messageType;  // EMessageType | EMessageFlag.
+		CLittleEndian<csize_t> contentSize;
 		SPayloadHeader(const messageType_t type) : messageType(type), contentSize(DEF_VAL) {}
 	}payloadHeader;
 	SRequestSendMessage(const SClientID& id, const messageType_t type) : header(id, REQUEST_SEND_MSG), payloadHeader(type) {}
@@ -175,8 +313,8 @@ struct SResponseMessageSent
 	SResponseHeader header;
 	struct SPayload
 	{
-		SClientID   clientId;   // destination client
-		messageID_t messageId;
+		SClientID                  clientId;   // destination client
+		CLittleEndian<messageID_t> messageId;
 		SPayload() : messageId(DEF_VAL) {}
 	}payload;
 };
@@ -190,13 +328,142 @@ struct SRequestMessages
 
 struct SPendingMessage
 {
-	SClientID     clientId;   // message's clientID.
-	messageID_t   messageId;
-	messageType_t messageType;
-	csize_t       messageSize;
+	SClientID                  clientId;   // message's clientID.
+	CLittleEndian<messageID_t> messageId;
+	messageType_t              messageType;
+	CLittleEndian<csize_t>     messageSize;
 	/* Variable Size content */
 	SPendingMessage() : messageId(DEF_VAL), messageType(DEF_VAL), messageSize(DEF_VAL) {}
 };
 
+struct SRequestUploadBlob
+{
+	SRequestHeader header;
+	SBlobHash      payloadHeader;   // SHA-256 of the blob. Verified by server.
+	/* Variable Size blob */
+	SRequestUploadBlob(const SClientID& id) : header(id, REQUEST_UPLOAD_BLOB) {}
+};
+
+struct SResponseBlobStored
+{
+	SResponseHeader header;
+	SBlobHash       payload;
+};
+
+struct SBlobReference
+{
+	SBlobHash blobHash;
+	uint8_t   wrappedKey[WRAPPED_KEY_SIZE];   // blob's content key, encrypted by the symmetric key.
+	/* Upon delivery to clients older than VERSION_RESUMABLE, followed by the blob */
+	SBlobReference() : wrappedKey{ DEF_VAL } {}
+};
+
+/**
+ * Blob sizes & offsets of transfers are 64 bit. Server selects their width by the version of the request,
+ * hence clients older than VERSION_LARGE transfer 32 bit sizes.
+ */
+struct STransferChunk
+{
+	SBlobHash              blobHash;
+	CLittleEndian<bsize_t> blobSize;
+	CLittleEndian<bsize_t> offset;    // chunk's offset within blob.
+	/* Variable Size chunk data */
+	STransferChunk() : blobSize(DEF_VAL), offset(DEF_VAL) {}
+};
+
+/**
+ * Upload a blob chunk. Server appends the chunk only if offset matches its committed size.
+ * A chunk without data queries the committed size, hence allows resuming an upload.
+ */
+struct SRequestUploadChunk
+{
+	SRequestHeader header;
+	STransferChunk payloadHeader;
+	SRequestUploadChunk(const SClientID& id) : header(id, REQUEST_UPLOAD_CHUNK) {}
+};
+
+struct SResponseUploadAck
+{
+	SResponseHeader header;
+	struct SPayload
+	{
+		SBlobHash              blobHash;
+		CLittleEndian<bsize_t> committed;   // bytes stored by server. Equals blob size once upload is completed.
+		SPayload() : committed(DEF_VAL) {}
+	}payload;
+};
+
+/**
+ * Download a blob chunk starting at offset. A request with offset equal to blob size
+ * acknowledges the download's completion, so server may release the blob.
+ */
+struct SRequestDownloadChunk
+{
+	SRequestHeader header;
+	struct SPayload
+	{
+		SBlobHash              blobHash;
+		CLittleEndian<bsize_t> offset;
+		CLittleEndian<csize_t> length;
+		SPayload() : offset(DEF_VAL), length(DEF_VAL) {}
+	}payload;
+	SRequestDownloadChunk(const SClientID& id) : header(id, REQUEST_DOWNLOAD_CHUNK) {}
+};
+
+struct SResponseDownloadChunk
+{
+	SResponseHeader header;
+	STransferChunk  payloadHeader;
+};
+
+/**
+ * Send a message to several recipients. Content is encrypted once by a content key, and stored once by server
+ * as a blob. Each recipient receives a blob reference, holding the content key wrapped by its symmetric key.
+ */
+struct SRequestSendFanout
+{
+	SRequestHeader header;
+	struct SPayloadHeader
+	{
+		messageType_t          messageType;  // EMessageType | content's EMessageFlag. MSG_FLAG_BLOB is implied.
+		CLittleEndian<csize_t> recipients;
+		CLittleEndian<csize_t> contentSize;
+		SPayloadHeader(const messageType_t type) : messageType(type), recipients(DEF_VAL), contentSize(DEF_VAL) {}
+	}payloadHeader;
+	/* Variable { SFanoutRecipient } followed by content */
+	SRequestSendFanout(const SClientID& id, const messageType_t type) : header(id, REQUEST_SEND_FANOUT), payloadHeader(type) {}
+};
+
+struct SFanoutRecipient
+{
+	SClientID clientId;
+	uint8_t   wrappedKey[WRAPPED_KEY_SIZE];   // content key, encrypted by recipient's symmetric key.
+	SFanoutRecipient() : wrappedKey{ DEF_VAL } {}
+};
+
+struct SResponseFanoutSent
+{
+	SResponseHeader header;
+	/* Variable { SResponseMessageSent::SPayload }, in recipients' order */
+};
+
+struct SFileChunk
+{
+	CLittleEndian<csize_t> chunkSize;   // nonce + ciphertext + tag.
+	/* Variable Size chunk */
+	SFileChunk() : chunkSize(DEF_VAL) {}
+};
+
+/**
+ * AES-GCM associated data of a chunk of a MSG_FLAG_STREAM message. Not sent.
+ * Binds a chunk to its position, hence reordered, duplicated, dropped or truncated chunks fail authentication.
+ */
+struct SChunkAAD
+{
+	CLittleEndian<uint64_t> index;  // chunk's index within the file.
+	uint8_t                 last;   // 1 for file's last chunk.
+	SChunkAAD(const uint64_t chunkIndex, const bool lastChunk) : index(chunkIndex), last(lastChunk ? 1 : 0) {}
+};
+
 
 #pragma pack(pop)
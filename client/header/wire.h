@@ -0,0 +1,256 @@
+/**
+ * MessageU Client
+ * @file wire.h
+ * @brief Compile-time wire codec of protocol structs.
+ * Each protocol struct declares its field list. The list yields the struct's wire size at compile time and asserts
+ * the struct's memory layout is its wire layout: every field is 1-byte aligned and every integer is CLittleEndian.
+ * Hence encoding & decoding are bounds-checked copies, and parsing received payloads may be done in place.
+ * @author Roman Koifman
+ * https://github.com/Romansko/MessageU/blob/main/client/header/wire.h
+ */
+#pragma once
+#include "protocol.h"
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+template <typename... Fields>
+struct SWireFields;
+
+template <>
+struct SWireFields<>
+{
+	static constexpr size_t size = 0;
+};
+
+template <typename Field, typename... Fields>
+struct SWireFields<Field, Fields...>
+{
+	static_assert(alignof(Field) == 1, "Wire fields must be 1-byte aligned. Use CLittleEndian for integers.");
+	static_assert(std::is_trivially_copyable<Field>::value, "Wire fields must be trivially copyable.");
+	static constexpr size_t size = sizeof(Field) + SWireFields<Fields...>::size;
+};
+
+/**
+ * Field list of a protocol struct, in wire order. Not defined for types which are not sent over the wire.
+ */
+template <typename T>
+struct SWireLayout;
+
+template <typename T>
+struct SWire
+{
+	static constexpr size_t size = SWireLayout<T>::size;
+	static_assert(size == sizeof(T), "Struct layout doesn't match its wire field list.");
+	static_assert(alignof(T) == 1, "Wire structs must be 1-byte aligned.");
+};
+
+template <> struct SWireLayout<SClientID>      : SWireFields<uint8_t[CLIENT_ID_SIZE]> {};
+template <> struct SWireLayout<SClientName>    : SWireFields<uint8_t[CLIENT_NAME_SIZE]> {};
+template <> struct SWireLayout<SPublicKey>     : SWireFields<uint8_t[PUBLIC_KEY_SIZE]> {};
+template <> struct SWireLayout<SSymmetricKey>  : SWireFields<uint8_t[SYMMETRIC_KEY_SIZE]> {};
+template <> struct SWireLayout<SBlobHash>      : SWireFields<uint8_t[BLOB_HASH_SIZE]> {};
+template <> struct SWireLayout<SRequestHeader> : SWireFields<SClientID, version_t, CLittleEndian<code_t>, CLittleEndian<csize_t>> {};
+template <> struct SWireLayout<SResponseHeader>: SWireFields<version_t, CLittleEndian<code_t>, CLittleEndian<csize_t>> {};
+
+template <> struct SWireLayout<SRequestRegistration>   : SWireFields<SRequestHeader, SClientName, SPublicKey> {};
+template <> struct SWireLayout<SResponseRegistration>  : SWireFields<SResponseHeader, SClientID> {};
+template <> struct SWireLayout<SRequestClientsList>    : SWireFields<SRequestHeader> {};
+template <> struct SWireLayout<SClientsListEntry>      : SWireFields<SClientID, SClientName> {};
+template <> struct SWireLayout<SRequestPublicKey>      : SWireFields<SRequestHeader, SClientID> {};
+template <> struct SWireLayout<SResponsePublicKey>     : SWireFields<SResponseHeader, SClientID, SPublicKey, version_t> {};
+template <> struct SWireLayout<SRequestSendMessage>    : SWireFields<SRequestHeader, SClientID, messageType_t, CLittleEndian<csize_t>> {};
+template <> struct SWireLayout<SResponseMessageSent>   : SWireFields<SResponseHeader, SClientID, CLittleEndian<messageID_t>> {};
+template <> struct SWireLayout<SRequestMessages>       : SWireFields<SRequestHeader> {};
+template <> struct SWireLayout<SPendingMessage>        : SWireFields<SClientID, CLittleEndian<messageID_t>, messageType_t, CLittleEndian<csize_t>> {};
+template <> struct SWireLayout<SRequestUploadBlob>     : SWireFields<SRequestHeader, SBlobHash> {};
+template <> struct SWireLayout<SResponseBlobStored>    : SWireFields<SResponseHeader, SBlobHash> {};
+template <> struct SWireLayout<SBlobReference>         : SWireFields<SBlobHash, uint8_t[WRAPPED_KEY_SIZE]> {};
+template <> struct SWireLayout<STransferChunk>         : SWireFields<SBlobHash, CLittleEndian<bsize_t>, CLittleEndian<bsize_t>> {};
+template <> struct SWireLayout<SRequestUploadChunk>    : SWireFields<SRequestHeader, STransferChunk> {};
+template <> struct SWireLayout<SResponseUploadAck>     : SWireFields<SResponseHeader, SBlobHash, CLittleEndian<bsize_t>> {};
+template <> struct SWireLayout<SRequestDownloadChunk>  : SWireFields<SRequestHeader, SBlobHash, CLittleEndian<bsize_t>, CLittleEndian<csize_t>> {};
+template <> struct SWireLayout<SResponseDownloadChunk> : SWireFields<SResponseHeader, STransferChunk> {};
+template <> struct SWireLayout<SRequestSendFanout>     : SWireFields<SRequestHeader, messageType_t, CLittleEndian<csize_t>, CLittleEndian<csize_t>> {};
+template <> struct SWireLayout<SFanoutRecipient>       : SWireFields<SClientID, uint8_t[WRAPPED_KEY_SIZE]> {};
+template <> struct SWireLayout<SResponseMessageSent::SPayload> : SWireFields<SClientID, CLittleEndian<messageID_t>> {};
+template <> struct SWireLayout<SFileChunk>             : SWireFields<CLittleEndian<csize_t>> {};
+template <> struct SWireLayout<SChunkAAD>              : SWireFields<CLittleEndian<uint64_t>, uint8_t> {};
+
+/**
+ * Encode a protocol struct into buffer. Return false if buffer is too small.
+ */
+template <typename T>
+bool wireEncode(const T& message, uint8_t* const buffer, const size_t size)
+{
+	if (buffer == nullptr || size < SWire<T>::size)
+		return false;
+	memcpy(buffer, &message, SWire<T>::size);
+	return true;
+}
+
+/**
+ * Decode a protocol struct from buffer. Return false if buffer is too small.
+ */
+template <typename T>
+bool wireDecode(T& message, const uint8_t* const buffer, const size_t size)
+{
+	if (buffer == nullptr || size < SWire<T>::size)
+		return false;
+	memcpy(&message, buffer, SWire<T>::size);
+	return true;
+}
+
+/**
+ * Bounds-checked sequential reader of a received payload.
+ * Protocol structs are viewed in place, since their memory layout is their wire layout.
+ */
+class CWireReader
+{
+public:
+	CWireReader(const uint8_t* const buffer, const size_t size) : _ptr(buffer), _left(buffer == nullptr ? 0 : size) {}
+
+	size_t remaining() const { return _left; }
+	bool   empty() const     { return _left == 0; }
+
+	/**
+	 * Consume count opaque bytes. Return nullptr if less than count bytes are left.
+	 */
+	const uint8_t* take(const size_t count)
+	{
+		if (count > _left)
+			return nullptr;
+		const uint8_t* const bytes = _ptr;
+		_ptr  += count;
+		_left -= count;
+		return bytes;
+	}
+
+	/**
+	 * Consume a protocol struct without copying it. Return nullptr if buffer is too short.
+	 */
+	template <typename T>
+	const T* view()
+	{
+		return reinterpret_cast<const T*>(take(SWire<T>::size));
+	}
+
+	/**
+	 * Consume a protocol struct into message. Return false if buffer is too short.
+	 */
+	template <typename T>
+	bool read(T& message)
+	{
+		const uint8_t* const bytes = take(SWire<T>::size);
+		return wireDecode(message, bytes, SWire<T>::size);
+	}
+
+private:
+	const uint8_t* _ptr;
+	size_t         _left;
+};
+
+/**
+ * A client of RESPONSE_USERS payload. Points into the payload, hence valid as long as the payload is.
+ */
+struct SClientRecord
+{
+	const SClientID* clientId;
+	const char*      name;        // not null terminated.
+	size_t           nameLength;
+
+	std::string username() const { return std::string(name, nameLength); }
+};
+
+/**
+ * Zero-copy view of RESPONSE_USERS payload. Iterated records point into the payload.
+ */
+class CClientsListView
+{
+public:
+	class CIterator
+	{
+	public:
+		CIterator(const uint8_t* const ptr) : _ptr(ptr) {}
+		bool       operator!=(const CIterator& other) const { return _ptr != other._ptr; }
+		CIterator& operator++() { _ptr += SWire<SClientsListEntry>::size; return *this; }
+		SClientRecord operator*() const
+		{
+			const auto  entry = reinterpret_cast<const SClientsListEntry*>(_ptr);
+			const char* name  = reinterpret_cast<const char*>(entry->clientName.name);
+			return { &entry->clientId, name, strnlen(name, sizeof(entry->clientName.name) - 1) };  // just in case..
+		}
+	private:
+		const uint8_t* _ptr;
+	};
+
+	CClientsListView(const uint8_t* const payload, const size_t size) : _payload(payload), _size(payload == nullptr ? 0 : size) {}
+
+	bool      valid() const { return (_size % SWire<SClientsListEntry>::size) == 0; }
+	size_t    count() const { return _size / SWire<SClientsListEntry>::size; }
+	CIterator begin() const { return CIterator(_payload); }
+	CIterator end()   const { return CIterator(valid() ? (_payload + _size) : _payload); }  // invalid view is empty.
+
+private:
+	const uint8_t* _payload;
+	size_t         _size;
+};
+
+/**
+ * A message of RESPONSE_PENDING_MSG payload. Points into the payload, hence valid as long as the payload is.
+ */
+struct SPendingRecord
+{
+	const SPendingMessage* header;
+	const uint8_t*         content;   // header->messageSize bytes.
+};
+
+/**
+ * Zero-copy view of RESPONSE_PENDING_MSG payload. The entire payload is validated upon construction,
+ * hence iterating a valid view never reads out of bounds. An invalid view is empty.
+ */
+class CPendingMessagesView
+{
+public:
+	class CIterator
+	{
+	public:
+		CIterator(const uint8_t* const ptr) : _ptr(ptr) {}
+		bool       operator!=(const CIterator& other) const { return _ptr != other._ptr; }
+		CIterator& operator++() { _ptr += SWire<SPendingMessage>::size + (**this).header->messageSize; return *this; }
+		SPendingRecord operator*() const
+		{
+			return { reinterpret_cast<const SPendingMessage*>(_ptr), _ptr + SWire<SPendingMessage>::size };
+		}
+	private:
+		const uint8_t* _ptr;
+	};
+
+	CPendingMessagesView(const uint8_t* const payload, const size_t size) : _payload(payload), _size(payload == nullptr ? 0 : size), _count(0)
+	{
+		CWireReader reader(_payload, _size);
+		while (!reader.empty())
+		{
+			const SPendingMessage* const header = reader.view<SPendingMessage>();
+			if (header == nullptr || reader.take(header->messageSize) == nullptr)
+			{
+				_size  = 0;
+				_count = 0;
+				_valid = false;
+				return;
+			}
+			++_count;
+		}
+	}
+
+	bool      valid() const { return _valid; }
+	size_t    count() const { return _count; }
+	CIterator begin() const { return CIterator(_payload); }
+	CIterator end()   const { return CIterator(_payload + _size); }
+
+private:
+	const uint8_t* _payload;
+	size_t         _size;
+	size_t         _count;
+	bool           _valid = true;
+};
@@ -8,15 +8,19 @@
 #include "AESWrapper.h"
 #include <modes.h>
 #include <aes.h>
+#include <gcm.h>
+#include <osrng.h>
 #include <filters.h>
 #include <stdexcept>
-#include <immintrin.h>	// _rdrand32_step
 
 
+/**
+ * Fill buffer with random bytes (keys & nonces). A seeded generator per thread, as they are generated by concurrent operations.
+ */
 void AESWrapper::GenerateKey(uint8_t* const buffer, const size_t length)
 {
-	for (size_t i = 0; i < length; i += sizeof(size_t))
-		_rdrand32_step(reinterpret_cast<size_t*>(&buffer[i]));
+	thread_local CryptoPP::AutoSeededRandomPool rng;
+	rng.GenerateBlock(buffer, length);
 }
 
 AESWrapper::AESWrapper()
@@ -64,3 +68,58 @@ std::string AESWrapper::decrypt(const uint8_t* cipher, size_t length) const
 
 	return decrypted;
 }
+
+
+/**
+ * Encrypt using AES-GCM. Crypto++ uses AES-NI & PCLMUL when supported by the CPU.
+ * Returned cipher = nonce + ciphertext + tag. The tag authenticates aad as well.
+ */
+std::string AESWrapper::encryptAEAD(const uint8_t* plain, size_t length, const uint8_t* aad, size_t aadLength) const
+{
+	CryptoPP::byte nonce[AEAD_NONCE_SIZE];
+	GenerateKey(nonce, sizeof(nonce));   // nonce must never repeat under the same key. Per thread generator, seeded once.
+
+	CryptoPP::GCM<CryptoPP::AES>::Encryption gcmEncryption;
+	gcmEncryption.SetKeyWithIV(_key.symmetricKey, sizeof(_key.symmetricKey), nonce, sizeof(nonce));
+
+	std::string cipher;
+	cipher.reserve(AEAD_NONCE_SIZE + length + AEAD_TAG_SIZE);
+	cipher.append(reinterpret_cast<const char*>(nonce), sizeof(nonce));
+	CryptoPP::AuthenticatedEncryptionFilter aef(gcmEncryption, new CryptoPP::StringSink(cipher), false, AEAD_TAG_SIZE);
+	if (aadLength != 0)
+	{
+		aef.ChannelPut(CryptoPP::AAD_CHANNEL, aad, aadLength);   // associated data precedes the plain text.
+		aef.ChannelMessageEnd(CryptoPP::AAD_CHANNEL);
+	}
+	aef.ChannelPut(CryptoPP::DEFAULT_CHANNEL, plain, length);
+	aef.ChannelMessageEnd(CryptoPP::DEFAULT_CHANNEL);
+
+	return cipher;
+}
+
+/**
+ * Decrypt AES-GCM cipher (nonce + ciphertext + tag). aad must equal the associated data it was encrypted with.
+ * Throws upon tampered or corrupted cipher, or mismatching aad.
+ */
+std::string AESWrapper::decryptAEAD(const uint8_t* cipher, size_t length, const uint8_t* aad, size_t aadLength) const
+{
+	if (cipher == nullptr || length < AEAD_NONCE_SIZE + AEAD_TAG_SIZE)
+		throw std::length_error("AES-GCM cipher is too short");
+
+	CryptoPP::GCM<CryptoPP::AES>::Decryption gcmDecryption;
+	gcmDecryption.SetKeyWithIV(_key.symmetricKey, sizeof(_key.symmetricKey), cipher, AEAD_NONCE_SIZE);
+
+	std::string decrypted;
+	decrypted.reserve(length - AEAD_NONCE_SIZE - AEAD_TAG_SIZE);
+	CryptoPP::AuthenticatedDecryptionFilter adf(gcmDecryption, new CryptoPP::StringSink(decrypted),
+		CryptoPP::AuthenticatedDecryptionFilter::DEFAULT_FLAGS, AEAD_TAG_SIZE);
+	if (aadLength != 0)
+	{
+		adf.ChannelPut(CryptoPP::AAD_CHANNEL, aad, aadLength);   // associated data precedes the cipher text.
+		adf.ChannelMessageEnd(CryptoPP::AAD_CHANNEL);
+	}
+	adf.ChannelPut(CryptoPP::DEFAULT_CHANNEL, cipher + AEAD_NONCE_SIZE, length - AEAD_NONCE_SIZE);
+	adf.ChannelMessageEnd(CryptoPP::DEFAULT_CHANNEL);   // verifies tag.
+
+	return decrypted;
+}
@@ -11,7 +11,18 @@
 #include "RSAWrapper.h"
 #include "AESWrapper.h"
 #include "CFileHandler.h"
+#include "CFileSink.h"
 #include "CSocketHandler.h"
+#include "CThreadPool.h"
+#include "CClientRuntime.h"
+#include "CConnectionPool.h"
+#include "CLatencyStats.h"
+#include "wire.h"
+#include <algorithm>
+#include <atomic>
+#include <set>
+#include <sha.h>
+#include <boost/filesystem.hpp>
 
 std::ostream& operator<<(std::ostream& os, const EMessageType& type)
 {
@@ -19,17 +30,97 @@ std::ostream& operator<<(std::ostream& os, const EMessageType& type)
 	return os;
 }
 
-CClientLogic::CClientLogic() : _fileHandler(nullptr), _socketHandler(nullptr), _rsaDecryptor(nullptr)
+CClientLogic::CClientLogic() : _clients(std::make_shared<const clients_t>()), _clientInfo(CLIENT_INFO), _transfersInfo(TRANSFERS_INFO),
+	_ioContext(nullptr), _connections(nullptr), _rsaDecryptor(nullptr), _threadPool(nullptr), _fileSink(nullptr), _runtime(nullptr),
+	_lastTicket(0), _sending(0), _stopSender(false)
 {
-	_fileHandler   = new CFileHandler();
-	_socketHandler = new CSocketHandler();
+	_ioContext   = new boost::asio::io_context;
+	_connections = new CConnectionPool(*_ioContext, std::thread::hardware_concurrency() + 1);
+	_threadPool  = new CThreadPool();
+	_fileSink    = new CFileSink();
 }
 
+/**
+ * An identity of a runtime. Socket handlers & thread pool are shared by runtime's identities.
+ * Credentials are stored in clientInfo, and transfers next to it.
+ */
+CClientLogic::CClientLogic(CClientRuntime& runtime, const std::string& clientInfo) : _clients(std::make_shared<const clients_t>()),
+	_clientInfo(clientInfo), _transfersInfo(clientInfo + ".transfers"), _ioContext(nullptr), _connections(&runtime.connections()),
+	_rsaDecryptor(nullptr), _threadPool(&runtime.threadPool()), _fileSink(&runtime.fileSink()), _runtime(&runtime), _lastTicket(0), _sending(0), _stopSender(false)
+{
+}
+
+/**
+ * Operations must not be in progress upon destruction.
+ * Queued messages which were not sent yet are reported as failed.
+ */
 CClientLogic::~CClientLogic()
 {
-	delete _fileHandler;
-	delete _socketHandler;
+	{
+		std::lock_guard<std::mutex> lock(_outboundMutex);
+		_stopSender = true;
+	}
+	_outboundChanged.notify_all();
+	if (_sender.joinable())
+		_sender.join();
 	delete _rsaDecryptor;
+	if (_runtime == nullptr)  // shared resources are owned by runtime.
+	{
+		delete _fileSink;
+		delete _threadPool;
+		delete _connections;
+		delete _ioContext;
+	}
+}
+
+/**
+ * State of the calling thread. Created upon thread's first call, hence used without locking.
+ * Shared by the identities a thread operates, as an operation doesn't nest another identity's operation.
+ */
+CClientLogic::SOperation& CClientLogic::operation()
+{
+	thread_local SOperation state;
+	return state;
+}
+
+CClientLogic::SOperation::~SOperation()
+{
+	delete fileHandler;
+}
+
+/**
+ * File handler of the calling thread.
+ */
+CFileHandler* CClientLogic::fileHandler() const
+{
+	SOperation& state = operation();
+	if (state.fileHandler == nullptr)
+		state.fileHandler = new CFileHandler();
+	return state.fileHandler;
+}
+
+/**
+ * Lease a socket handler from the connection pool for the duration of an operation.
+ * Nested operations use the outer lease.
+ */
+CClientLogic::CSocketLease::CSocketLease(CClientLogic& logic) : _logic(logic), _leased(false)
+{
+	SOperation& state = _logic.operation();
+	if (state.socketHandler == nullptr)
+	{
+		state.socketHandler = _logic._connections->acquire();
+		_leased = true;
+	}
+}
+
+CClientLogic::CSocketLease::~CSocketLease()
+{
+	if (_leased)
+	{
+		SOperation& state = _logic.operation();
+		_logic._connections->release(state.socketHandler);
+		state.socketHandler = nullptr;
+	}
 }
 
 /**
@@ -37,35 +128,37 @@ CClientLogic::~CClientLogic()
  */
 bool CClientLogic::parseServeInfo()
 {
-	std::stringstream err;
-	if (!_fileHandler->open(SERVER_INFO))
+	if (_runtime != nullptr)
+		return true;  // server info is shared by runtime's identities.
+	const CSocketLease lease(*this);
+	if (!fileHandler()->open(SERVER_INFO))
 	{
 		clearLastError();
-		_lastError << "Couldn't open " << SERVER_INFO;
+		lastError() << "Couldn't open " << SERVER_INFO;
 		return false;
 	}
 	std::string info;
-	if (!_fileHandler->readLine(info))
+	if (!fileHandler()->readLine(info))
 	{
 		clearLastError();
-		_lastError << "Couldn't read " << SERVER_INFO;
+		lastError() << "Couldn't read " << SERVER_INFO;
 		return false;
 	}
-	_fileHandler->close();
+	fileHandler()->close();
 	CStringer::trim(info);
 	const auto pos = info.find(':');
 	if (pos == std::string::npos)
 	{
 		clearLastError();
-		_lastError << SERVER_INFO << " has invalid format! missing separator ':'";
+		lastError() << SERVER_INFO << " has invalid format! missing separator ':'";
 		return false;
 	}
 	const auto address = info.substr(0, pos);
 	const auto port = info.substr(pos + 1);
-	if (!_socketHandler->setSocketInfo(address, port))
+	if (!_connections->setServerInfo(address, port))
 	{
 		clearLastError();
-		_lastError << SERVER_INFO << " has invalid IP address or port!";
+		lastError() << SERVER_INFO << " has invalid IP address or port!";
 		return false;
 	}
 	return true;
@@ -77,34 +170,34 @@ bool CClientLogic::parseServeInfo()
 bool CClientLogic::parseClientInfo()
 {
 	std::string line;
-	if (!_fileHandler->open(CLIENT_INFO))
+	if (!fileHandler()->open(_clientInfo))
 	{
 		clearLastError();
-		_lastError << "Couldn't open " << CLIENT_INFO;
+		lastError() << "Couldn't open " << _clientInfo;
 		return false;
 	}
 
 	// Read & Parse username
-	if (!_fileHandler->readLine(line))
+	if (!fileHandler()->readLine(line))
 	{
 		clearLastError();
-		_lastError << "Couldn't read username from " << CLIENT_INFO;
+		lastError() << "Couldn't read username from " << _clientInfo;
 		return false;
 	}
 	CStringer::trim(line);
 	if (line.length() >= CLIENT_NAME_SIZE)
 	{
 		clearLastError();
-		_lastError << "Invalid username read from " << CLIENT_INFO;
+		lastError() << "Invalid username read from " << _clientInfo;
 		return false;
 	}
 	_self.username = line;
 
 	// Read & Parse Client's UUID.
-	if (!_fileHandler->readLine(line))
+	if (!fileHandler()->readLine(line))
 	{
 		clearLastError();
-		_lastError << "Couldn't read client's UUID from " << CLIENT_INFO;
+		lastError() << "Couldn't read client's UUID from " << _clientInfo;
 		return false;
 	}
 
@@ -114,21 +207,21 @@ bool CClientLogic::parseClientInfo()
 	{
 		memset(_self.id.uuid, 0, sizeof(_self.id.uuid));
 		clearLastError();
-		_lastError << "Couldn't parse client's UUID from " << CLIENT_INFO;
+		lastError() << "Couldn't parse client's UUID from " << _clientInfo;
 		return false;
 	}
 	memcpy(_self.id.uuid, unhexed, sizeof(_self.id.uuid));
 
 	// Read & Parse Client's private key.
 	std::string decodedKey;
-	while (_fileHandler->readLine(line))
+	while (fileHandler()->readLine(line))
 	{
 		decodedKey.append(CStringer::decodeBase64(line));
 	}
 	if (decodedKey.empty())
 	{
 		clearLastError();
-		_lastError << "Couldn't read client's private key from " << CLIENT_INFO;
+		lastError() << "Couldn't read client's private key from " << _clientInfo;
 		return false;
 	}
 	try
@@ -139,10 +232,11 @@ bool CClientLogic::parseClientInfo()
 	catch(...)
 	{
 		clearLastError();
-		_lastError << "Couldn't parse private key from " << CLIENT_INFO;
+		lastError() << "Couldn't parse private key from " << _clientInfo;
 		return false;
 	}
-	_fileHandler->close();
+	fileHandler()->close();
+	(void)loadTransfers();  // no transfers were stored yet is not an error.
 	return true;
 }
 
@@ -153,22 +247,24 @@ bool CClientLogic::parseClientInfo()
  */
 std::vector<std::string> CClientLogic::getUsernames() const
 {
-	std::vector<std::string> usernames(_clients.size());
-	std::transform(_clients.begin(), _clients.end(), usernames.begin(),
+	const auto snapshot = clients();
+	std::vector<std::string> usernames(snapshot->size());
+	std::transform(snapshot->begin(), snapshot->end(), usernames.begin(),
 		[](const SClient& client) { return client.username; });
 	std::sort(usernames.begin(), usernames.end());
 	return usernames;
 }
 
 /**
- * Reset _lastError StringStream: Empty string, clear errors flag and reset formatting.
+ * Reset lastError() StringStream: Empty string, clear errors flag and reset formatting.
  */
 void CClientLogic::clearLastError()
 {
 	const std::stringstream clean;
-	_lastError.str("");
-	_lastError.clear();
-	_lastError.copyfmt(clean);
+	std::stringstream& error = lastError();
+	error.str("");
+	error.clear();
+	error.copyfmt(clean);
 }
 
 /**
@@ -176,40 +272,40 @@ void CClientLogic::clearLastError()
  */
 bool CClientLogic::storeClientInfo()
 {
-	if (!_fileHandler->open(CLIENT_INFO, true))
+	if (!fileHandler()->open(_clientInfo, true))
 	{
 		clearLastError();
-		_lastError << "Couldn't open " << CLIENT_INFO;
+		lastError() << "Couldn't open " << _clientInfo;
 		return false;
 	}
 
 	// Write username
-	if (!_fileHandler->writeLine(_self.username))
+	if (!fileHandler()->writeLine(_self.username))
 	{
 		clearLastError();
-		_lastError << "Couldn't write username to " << CLIENT_INFO;
+		lastError() << "Couldn't write username to " << _clientInfo;
 		return false;
 	}
 
 	// Write UUID.
 	const auto hexifiedUUID = CStringer::hex(_self.id.uuid, sizeof(_self.id.uuid));
-	if (!_fileHandler->writeLine(hexifiedUUID))
+	if (!fileHandler()->writeLine(hexifiedUUID))
 	{
 		clearLastError();
-		_lastError << "Couldn't write UUID to " << CLIENT_INFO;
+		lastError() << "Couldn't write UUID to " << _clientInfo;
 		return false;
 	}
 
 	// Write Base64 encoded private key
 	const auto encodedKey = CStringer::encodeBase64(_rsaDecryptor->getPrivateKey());
-	if (!_fileHandler->write(reinterpret_cast<const uint8_t*>(encodedKey.c_str()), encodedKey.size()))
+	if (!fileHandler()->write(reinterpret_cast<const uint8_t*>(encodedKey.c_str()), encodedKey.size()))
 	{
 		clearLastError();
-		_lastError << "Couldn't write client's private key to " << CLIENT_INFO;
+		lastError() << "Couldn't write client's private key to " << _clientInfo;
 		return false;
 	}
 
-	_fileHandler->close();
+	fileHandler()->close();
 	return true;
 }
 
@@ -221,14 +317,14 @@ bool CClientLogic::validateHeader(const SResponseHeader& header, const EResponse
 	if (header.code == RESPONSE_ERROR)
 	{
 		clearLastError();
-		_lastError << "Generic error response code (" << RESPONSE_ERROR << ") received.";
+		lastError() << "Generic error response code (" << RESPONSE_ERROR << ") received.";
 		return false;
 	}
 	
 	if (header.code != expectedCode)
 	{
 		clearLastError();
-		_lastError << "Unexpected response code " << header.code << " received. Expected code was " << expectedCode;
+		lastError() << "Unexpected response code " << header.code << " received. Expected code was " << expectedCode;
 		return false;
 	}
 
@@ -250,6 +346,16 @@ bool CClientLogic::validateHeader(const SResponseHeader& header, const EResponse
 		expectedSize = sizeof(SResponseMessageSent) - sizeof(SResponseHeader);
 		break;
 	}
+	case RESPONSE_BLOB_STORED:
+	{
+		expectedSize = sizeof(SResponseBlobStored) - sizeof(SResponseHeader);
+		break;
+	}
+	case RESPONSE_UPLOAD_ACK:
+	{
+		expectedSize = sizeof(SResponseUploadAck) - sizeof(SResponseHeader);
+		break;
+	}
 	default:
 	{
 		return true;  // variable payload size. 
@@ -259,7 +365,7 @@ bool CClientLogic::validateHeader(const SResponseHeader& header, const EResponse
 	if (header.payloadSize != expectedSize)
 	{
 		clearLastError();
-		_lastError << "Unexpected payload size " << header.payloadSize << ". Expected size was " << expectedSize;
+		lastError() << "Unexpected payload size " << header.payloadSize << ". Expected size was " << expectedSize;
 		return false;
 	}
 	
@@ -279,33 +385,33 @@ bool CClientLogic::receiveUnknownPayload(const uint8_t* const request, const siz
 	if (request == nullptr || reqSize == 0)
 	{
 		clearLastError();
-		_lastError << "Invalid request was provided";
+		lastError() << "Invalid request was provided";
 		return false;
 	}
-	if (!_socketHandler->connect())
+	if (!socketHandler()->connect())
 	{
 		clearLastError();
-		_lastError << "Failed connecting to server on " << _socketHandler;
+		lastError() << "Failed connecting to server on " << socketHandler();
 		return false;
 	}
-	if (!_socketHandler->send(request, reqSize))
+	if (!socketHandler()->send(request, reqSize))
 	{
-		_socketHandler->close();
+		socketHandler()->close();
 		clearLastError();
-		_lastError << "Failed sending request to server on " << _socketHandler;
+		lastError() << "Failed sending request to server on " << socketHandler();
 		return false;
 	}
-	if (!_socketHandler->receive(buffer, sizeof(buffer)))
+	if (!socketHandler()->receive(buffer, sizeof(buffer)))
 	{
 		clearLastError();
-		_lastError << "Failed receiving response header from server on " << _socketHandler;
+		lastError() << "Failed receiving response header from server on " << socketHandler();
 		return false;
 	}
-	memcpy(&response, buffer, sizeof(SResponseHeader));
+	(void)wireDecode(response, buffer, sizeof(buffer));
 	if (!validateHeader(response, expectedCode))
 	{
 		clearLastError();
-		_lastError << "Received unexpected response code from server on  " << _socketHandler;
+		lastError() << "Received unexpected response code from server on  " << socketHandler();
 		return false;
 	}
 	if (response.payloadSize == 0)
@@ -313,8 +419,8 @@ bool CClientLogic::receiveUnknownPayload(const uint8_t* const request, const siz
 
 	size = response.payloadSize;
 	payload = new uint8_t[size];
-	uint8_t* ptr = static_cast<uint8_t*>(buffer) + sizeof(SResponseHeader);
-	size_t recSize = sizeof(buffer) - sizeof(SResponseHeader);
+	uint8_t* ptr = static_cast<uint8_t*>(buffer) + SWire<SResponseHeader>::size;
+	size_t recSize = sizeof(buffer) - SWire<SResponseHeader>::size;
 	if (recSize > size)
 		recSize = size;
 	memcpy(payload, ptr, recSize);
@@ -324,10 +430,10 @@ bool CClientLogic::receiveUnknownPayload(const uint8_t* const request, const siz
 		size_t toRead = (size - recSize);
 		if (toRead > PACKET_SIZE)
 			toRead = PACKET_SIZE;
-		if (!_socketHandler->receive(buffer, toRead))
+		if (!socketHandler()->receive(buffer, toRead))
 		{
 			clearLastError();
-			_lastError << "Failed receiving payload data from server on " << _socketHandler;
+			lastError() << "Failed receiving payload data from server on " << socketHandler();
 			delete[] payload;
 			payload = nullptr;
 			size = 0;
@@ -342,20 +448,16 @@ bool CClientLogic::receiveUnknownPayload(const uint8_t* const request, const siz
 }
 
 /**
- * Store a client's public key on RAM.
+ * Store a client's public key & protocol version on RAM.
  */
-bool CClientLogic::setClientPublicKey(const SClientID& clientID, const SPublicKey& publicKey)
+bool CClientLogic::setClientPublicKey(const SClientID& clientID, const SPublicKey& publicKey, const version_t version)
 {
-	for (SClient& client : _clients)
+	return updateClient(clientID, [&publicKey, version](SClient& client)
 	{
-		if (client.id == clientID)
-		{
-			client.publicKey = publicKey;
-			client.publicKeySet = true;
-			return true;
-		}
-	}
-	return false;
+		client.publicKey    = publicKey;
+		client.publicKeySet = true;
+		client.version      = version;
+	});
 }
 
 /**
@@ -363,12 +465,27 @@ bool CClientLogic::setClientPublicKey(const SClientID& clientID, const SPublicKe
  */
 bool CClientLogic::setClientSymmetricKey(const SClientID& clientID, const SSymmetricKey& symmetricKey)
 {
-	for (SClient& client : _clients)
+	return updateClient(clientID, [&symmetricKey](SClient& client)
+	{
+		client.symmetricKey    = symmetricKey;
+		client.symmetricKeySet = true;
+	});
+}
+
+/**
+ * Update a client on a copy of the clients list, then publish the copy.
+ * Readers holding the previous list are not affected.
+ */
+bool CClientLogic::updateClient(const SClientID& clientID, const std::function<void(SClient&)>& update)
+{
+	std::lock_guard<std::mutex> lock(_clientsMutex);
+	const auto updated = std::make_shared<clients_t>(*clients());
+	for (SClient& client : *updated)
 	{
 		if (client.id == clientID)
 		{
-			client.symmetricKey = symmetricKey;
-			client.symmetricKeySet = true;
+			update(client);
+			std::atomic_store(&_clients, std::shared_ptr<const clients_t>(updated));
 			return true;
 		}
 	}
@@ -382,15 +499,25 @@ bool CClientLogic::setClientSymmetricKey(const SClientID& clientID, const SSymme
  */
 bool CClientLogic::getClient(const SClientID& clientID, SClient& client) const
 {
-	for (const SClient& itr : _clients)
+	const auto snapshot = clients();
+	const SClient* const found = findClient(*snapshot, clientID);
+	if (found == nullptr)
+		return false;  // client invalid.
+	client = *found;
+	return true;
+}
+
+/**
+ * Find a client within a clients list without copying it. Pointer is valid as long as the list is.
+ */
+const CClientLogic::SClient* CClientLogic::findClient(const clients_t& clients, const SClientID& clientID)
+{
+	for (const SClient& itr : clients)
 	{
 		if (itr.id == clientID)
-		{
-			client = itr;
-			return true;
-		}
+			return &itr;
 	}
-	return false;  // client invalid.
+	return nullptr;  // client invalid.
 }
 
 /**
@@ -399,7 +526,8 @@ bool CClientLogic::getClient(const SClientID& clientID, SClient& client) const
  */
 bool CClientLogic::getClient(const std::string& username, SClient& client) const
 {
-	for (const SClient& itr : _clients)
+	const auto snapshot = clients();
+	for (const SClient& itr : *snapshot)
 	{
 		if (username == itr.username)
 		{
@@ -415,13 +543,15 @@ bool CClientLogic::getClient(const std::string& username, SClient& client) const
  */
 bool CClientLogic::registerClient(const std::string& username)
 {
+	const CSocketLease lease(*this);
+	const CLatencyStats::CRequest timing(REQUEST_REGISTRATION);
 	SRequestRegistration  request;
 	SResponseRegistration response;
 
 	if (username.length() >= CLIENT_NAME_SIZE)  // >= because of null termination.
 	{
 		clearLastError();
-		_lastError << "Invalid username length!";
+		lastError() << "Invalid username length!";
 		return false;
 	}
 	for (auto ch : username)
@@ -429,7 +559,7 @@ bool CClientLogic::registerClient(const std::string& username)
 		if (!std::isalnum(ch))  // check that username is alphanumeric. [a-zA-Z0-9].
 		{
 			clearLastError();
-			_lastError << "Invalid username! Username may only contain letters and numbers!";
+			lastError() << "Invalid username! Username may only contain letters and numbers!";
 			return false;
 		}
 	}
@@ -440,20 +570,20 @@ bool CClientLogic::registerClient(const std::string& username)
 	if (publicKey.size() != PUBLIC_KEY_SIZE)
 	{
 		clearLastError();
-		_lastError << "Invalid public key length!";
+		lastError() << "Invalid public key length!";
 		return false;
 	}
 
 	// fill request data
 	request.header.payloadSize = sizeof(request.payload);
-	strcpy_s(reinterpret_cast<char*>(request.payload.clientName.name), CLIENT_NAME_SIZE, username.c_str());
+	(void)username.copy(reinterpret_cast<char*>(request.payload.clientName.name), CLIENT_NAME_SIZE - 1);  // DEF_VAL terminated.
 	memcpy(request.payload.clientPublicKey.publicKey, publicKey.c_str(), sizeof(request.payload.clientPublicKey.publicKey));
 
-	if (!_socketHandler->sendReceive(reinterpret_cast<const uint8_t* const>(&request), sizeof(request),
+	if (!socketHandler()->sendReceive(reinterpret_cast<const uint8_t* const>(&request), sizeof(request),
 		reinterpret_cast<uint8_t* const>(&response), sizeof(response)))
 	{
 		clearLastError();
-		_lastError << "Failed communicating with server on " << _socketHandler;
+		lastError() << "Failed communicating with server on " << socketHandler();
 		return false;
 	}
 
@@ -468,7 +598,7 @@ bool CClientLogic::registerClient(const std::string& username)
 	if (!storeClientInfo())
 	{
 		clearLastError();
-		_lastError << "Failed writing client info to " << CLIENT_INFO << ". Please register again with different username.";
+		lastError() << "Failed writing client info to " << _clientInfo << ". Please register again with different username.";
 		return false;
 	}
 
@@ -480,16 +610,28 @@ bool CClientLogic::registerClient(const std::string& username)
  */
 bool CClientLogic::requestClientsList()
 {
+	return requestClientsList([this](const CClientsListView& view)
+	{
+		const auto received = std::make_shared<clients_t>();
+		received->reserve(view.count());
+		for (const SClientRecord& record : view)
+			received->push_back({ *record.clientId, record.username() });
+		std::lock_guard<std::mutex> lock(_clientsMutex);
+		std::atomic_store(&_clients, std::shared_ptr<const clients_t>(received));
+	});
+}
+
+/**
+ * Request client list from server. The received list is passed to consumer as a view into the payload,
+ * hence records are not copied unless consumer does so. The view is valid only within consumer.
+ */
+bool CClientLogic::requestClientsList(const std::function<void(const CClientsListView&)>& consumer)
+{
+	const CSocketLease lease(*this);
+	const CLatencyStats::CRequest timing(REQUEST_CLIENTS_LIST);
 	SRequestClientsList request(_self.id);
 	uint8_t* payload   = nullptr;
-	uint8_t* ptr       = nullptr;
 	size_t payloadSize = 0;
-	size_t parsedBytes = 0;
-	struct
-	{
-		SClientID   clientId;
-		SClientName clientName;
-	}client;
 	
 	if (!receiveUnknownPayload(reinterpret_cast<uint8_t*>(&request), sizeof(request), RESPONSE_USERS,payload, payloadSize))
 		return false;  // description was set within.
@@ -498,26 +640,18 @@ bool CClientLogic::requestClientsList()
 	{
 		delete[] payload;
 		clearLastError();
-		_lastError << "Server has no users registered. Empty Clients list.";
+		lastError() << "Server has no users registered. Empty Clients list.";
 		return false;
 	}
-	if (payloadSize % sizeof(client) != 0)
+	const CClientsListView view(payload, payloadSize);
+	if (!view.valid())
 	{
 		delete[] payload;
 		clearLastError();
-		_lastError << "Clients list received is corrupted! (Invalid size).";
+		lastError() << "Clients list received is corrupted! (Invalid size).";
 		return false;
 	}
-	ptr = payload;
-	_clients.clear();
-	while (parsedBytes < payloadSize)
-	{
-		memcpy(&client, ptr, sizeof(client));
-		ptr += sizeof(client);
-		parsedBytes += sizeof(client);
-		client.clientName.name[sizeof(client.clientName.name) - 1] = '\0'; // just in case..
-		_clients.push_back({ client.clientId, reinterpret_cast<char*>(client.clientName.name) });
-	}
+	consumer(view);
 	delete[] payload;
 	return true;
 }
@@ -528,6 +662,8 @@ bool CClientLogic::requestClientsList()
  */
 bool CClientLogic::requestClientPublicKey(const std::string& username)
 {
+	const CSocketLease lease(*this);
+	const CLatencyStats::CRequest timing(REQUEST_PUBLIC_KEY);
 	SRequestPublicKey  request(_self.id);
 	SResponsePublicKey response;
 	SClient            client;
@@ -536,23 +672,24 @@ bool CClientLogic::requestClientPublicKey(const std::string& username)
 	if (username == _self.username)
 	{
 		clearLastError();
-		_lastError << username << ", your key is stored in the system already.";
+		lastError() << username << ", your key is stored in the system already.";
 		return false;
 	}
 	
 	if (!getClient(username, client))
 	{
 		clearLastError();
-		_lastError << "username '" << username << "' doesn't exist. Please check your input or try to request users list again.";
+		lastError() << "username '" << username << "' doesn't exist. Please check your input or try to request users list again.";
 		return false;
 	}
+	request.header.payloadSize = sizeof(request.payload);
 	request.payload = client.id;
 
-	if (!_socketHandler->sendReceive(reinterpret_cast<const uint8_t* const>(&request), sizeof(request),
+	if (!socketHandler()->sendReceive(reinterpret_cast<const uint8_t* const>(&request), sizeof(request),
 		reinterpret_cast<uint8_t* const>(&response), sizeof(response)))
 	{
 		clearLastError();
-		_lastError << "Failed communicating with server on " << _socketHandler;
+		lastError() << "Failed communicating with server on " << socketHandler();
 		return false;
 	}
 
@@ -563,15 +700,15 @@ bool CClientLogic::requestClientPublicKey(const std::string& username)
 	if (request.payload != response.payload.clientId)
 	{
 		clearLastError();
-		_lastError << "Unexpected clientID was received.";
+		lastError() << "Unexpected clientID was received.";
 		return false;
 	}
 
 	// Set public key.
-	if (!setClientPublicKey(response.payload.clientId, response.payload.clientPublicKey))
+	if (!setClientPublicKey(response.payload.clientId, response.payload.clientPublicKey, response.payload.clientVersion))
 	{
 		clearLastError();
-		_lastError << "Couldn't assign public key for user " << username << ". ClientID was not found. Please try retrieve users list again..";
+		lastError() << "Couldn't assign public key for user " << username << ". ClientID was not found. Please try retrieve users list again..";
 		return false;
 	}
 	return true;
@@ -583,11 +720,11 @@ bool CClientLogic::requestClientPublicKey(const std::string& username)
  */
 bool CClientLogic::requestPendingMessages(std::vector<SMessage>& messages)
 {
+	const CSocketLease lease(*this);
+	const CLatencyStats::CRequest timing(REQUEST_PENDING_MSG);
 	SRequestMessages  request(_self.id);
 	uint8_t*          payload     = nullptr;
-	uint8_t*          ptr         = nullptr;
 	size_t            payloadSize = 0;
-	size_t            parsedBytes = 0;
 
 	messages.clear();
 	if (!receiveUnknownPayload(reinterpret_cast<uint8_t*>(&request), sizeof(request), RESPONSE_PENDING_MSG, payload, payloadSize))
@@ -597,44 +734,46 @@ bool CClientLogic::requestPendingMessages(std::vector<SMessage>& messages)
 	{
 		delete[] payload;
 		clearLastError();
-		_lastError << "There are no pending messages for you";
+		if (resumeDownloads(messages))
+			return true;
+		lastError() << "There are no pending messages for you";
 		return false;
 	}
-	if (payload == nullptr || payloadSize < sizeof(SPendingMessage))
+	/***
+	 * The entire payload is validated by the view. This is a fatal error. This means the entire payload
+	 * was not parsed correctly. Report error as if the entire payload is corrupt.
+	 */
+	const CPendingMessagesView view(payload, payloadSize);
+	if (!view.valid())
 	{
 		delete[] payload;
 		clearLastError();
-		_lastError << "Unexpected payload";
+		lastError() << "Payload is corrupt and ignored. (Invalid Message Header length).";
 		return false;
 	}
 
+	struct SWrite
+	{
+		messageID_t       messageId;
+		size_t            index;    // of the message within messages.
+		std::future<bool> written;
+	};
+	std::vector<SWrite> writes;  // received files are written while following messages are decrypted.
+
 	clearLastError();
-	ptr = payload;
-	while (parsedBytes < payloadSize)
-	{
-		SClient      client;
-		SMessage     message;
-		const size_t msgHeaderSize = sizeof(SPendingMessage);
-		const auto   header        = reinterpret_cast<SPendingMessage*>(ptr);
-		const size_t leftover      = payloadSize - parsedBytes;
-
-		/***
-		 * Split validation into two expressions in order to not violate memory access by header pointer.
-		 * This is a fatal error. This means the entire payload was not parsed correctly.
-		 * Report error as if the entire payload is corrupt.
-		 */ 
-		if ((msgHeaderSize > leftover) || (msgHeaderSize + header->messageSize) > leftover)
-		{
-			delete[] payload;
-			clearLastError();
-			_lastError << "Payload is corrupt and ignored. (Invalid Message Header length).";
-			return false;
-		}
+	messages.reserve(view.count());
+	auto snapshot = clients();  // refreshed upon symmetric key receipt, since following messages may use the key.
+	for (const SPendingRecord& record : view)
+	{
+		const SPendingMessage* const header  = record.header;
+		const uint8_t* const         content = record.content;
+		const SClient* const         client  = findClient(*snapshot, header->clientId);
+		const bool                   keySet  = (client != nullptr) && client->symmetricKeySet;
+		SMessage                     message;
 
-		
-		if (getClient(header->clientId, client))
+		if (client != nullptr)
 		{
-			message.username = client.username;
+			message.username = client->username;
 		}
 		else
 		{
@@ -643,10 +782,9 @@ bool CClientLogic::requestPendingMessages(std::vector<SMessage>& messages)
 			message.username.append(CStringer::hex(header->clientId.uuid, sizeof(header->clientId.uuid)));
 		}
 
-		ptr         += msgHeaderSize;
-		parsedBytes += msgHeaderSize;
-		
-		switch (header->messageType)
+		const messageType_t type = header->messageType & MSG_TYPE_MASK;
+		const bool          aead = (header->messageType & MSG_FLAG_AEAD) != 0;
+		switch (type)
 		{
 		case MSG_SYMMETRIC_KEY_REQUEST:
 		{
@@ -659,49 +797,47 @@ bool CClientLogic::requestPendingMessages(std::vector<SMessage>& messages)
 		{				
 			if (header->messageSize == 0)  // invalid symmetric key
 			{
-				_lastError << "\tMessage ID #" << header->messageId << ": ";
-				_lastError << "Can't decrypt symmetric key. Content length is " << header->messageSize << "." << std::endl;
-				parsedBytes += header->messageSize;
-				ptr         += header->messageSize;
+				lastError() << "\tMessage ID #" << header->messageId << ": ";
+				lastError() << "Can't decrypt symmetric key. Content length is " << header->messageSize << "." << std::endl;
 				continue;
 			}
 
 			std::string key;
 			try
 			{
-				key = _rsaDecryptor->decrypt(ptr, header->messageSize);
+				std::lock_guard<std::mutex> lock(_rsaMutex);
+				const CLatencyStats::CTimer timer(PHASE_DECRYPT);
+				key = _rsaDecryptor->decrypt(content, header->messageSize);
 			}
 			catch(...)
 			{
-				_lastError << "\tMessage ID #" << header->messageId << ": ";
-				_lastError << "Can't decrypt symmetric key." << std::endl;
-				parsedBytes += header->messageSize;
-				ptr         += header->messageSize;
+				lastError() << "\tMessage ID #" << header->messageId << ": ";
+				lastError() << "Can't decrypt symmetric key." << std::endl;
 				continue;
 			}
 				
 			const size_t keySize = key.size();
 			if (keySize != SYMMETRIC_KEY_SIZE)  // invalid symmetric key
 			{
-				_lastError << "\tMessage ID #" << header->messageId << ": ";
-				_lastError << "Invalid symmetric key size (" << keySize << ")." << std::endl;
+				lastError() << "\tMessage ID #" << header->messageId << ": ";
+				lastError() << "Invalid symmetric key size (" << keySize << ")." << std::endl;
 			}
 			else
 			{
-				memcpy(client.symmetricKey.symmetricKey, key.c_str(), keySize);
-				if (setClientSymmetricKey(header->clientId, client.symmetricKey))
+				SSymmetricKey symmetricKey;
+				memcpy(symmetricKey.symmetricKey, key.c_str(), keySize);
+				if (setClientSymmetricKey(header->clientId, symmetricKey))
 				{
+					snapshot = clients();
 					message.content = "symmetric key received";
 					messages.push_back(message);
 				}
 				else
 				{
-					_lastError << "\tMessage ID #" << header->messageId << ": ";
-					_lastError << "Couldn't set symmetric key of user: " << message.username << std::endl;
+					lastError() << "\tMessage ID #" << header->messageId << ": ";
+					lastError() << "Couldn't set symmetric key of user: " << message.username << std::endl;
 				}
 			}
-			parsedBytes += header->messageSize;
-			ptr         += header->messageSize;
 			break;
 		}
 		case MSG_TEXT:
@@ -709,35 +845,52 @@ bool CClientLogic::requestPendingMessages(std::vector<SMessage>& messages)
 		{
 			if (header->messageSize == 0)
 			{
-				_lastError << "\tMessage ID #" << header->messageId << ": ";
-				_lastError << "Message with no content provided." << std::endl;
-				parsedBytes += header->messageSize;
-				ptr += header->messageSize;
+				lastError() << "\tMessage ID #" << header->messageId << ": ";
+				lastError() << "Message with no content provided." << std::endl;
+				continue;
+			}
+			if (keySet && (header->messageType & MSG_FLAG_BLOB) && (header->messageSize == SWire<SBlobReference>::size))
+			{
+				// blob was not delivered along with its reference. It is downloaded once all messages are parsed.
+				if (!queueDownload(client->symmetricKey, header->messageType, content, message.username))
+				{
+					lastError() << "\tMessage ID #" << header->messageId << ": ";
+					lastError() << "Can't decrypt blob reference." << std::endl;
+				}
 				continue;
 			}
 			message.content = "can't decrypt message"; // assume failure
 			bool push = true;  // push to msg queue
-			if (client.symmetricKeySet)
+			if (keySet)
 			{
-				AESWrapper aes(client.symmetricKey);
 				std::string data;
 				try
 				{
-					data = aes.decrypt(ptr, header->messageSize);
+					const CLatencyStats::CTimer timer(PHASE_DECRYPT);
+					data = decryptContent(client->symmetricKey, header->messageType, content, header->messageSize);
+				}
+				catch (...)
+				{
+					// failure already assumed.
+					if (aead)
+					{
+						lastError() << "\tMessage ID #" << header->messageId << ": ";
+						lastError() << "Message authentication failed. Content is corrupt." << std::endl;
+					}
 				}
-				catch (...) {}  // do nothing. failure already assumed.
-				if (header->messageType == MSG_FILE)
+				if (type == MSG_FILE)
 				{
-					// Set filename with timestamp.
-					std::stringstream filepath;
-					filepath << _fileHandler->getTempFolder() << "\\MessageU\\" << message.username << "_" << CStringer::getTimestamp();
-					message.content = filepath.str();
-					if (!_fileHandler->writeAtOnce(message.content, data))
+					if (data.empty())
 					{
-						_lastError << "\tMessage ID #" << header->messageId << ": ";
-						_lastError << "Failed to save file on disk." << std::endl;
+						lastError() << "\tMessage ID #" << header->messageId << ": ";
+						lastError() << "Failed to save file on disk." << std::endl;
 						push = false;
 					}
+					else
+					{
+						message.content = receivedFilePath(message.username);
+						writes.push_back({ header->messageId, messages.size(), _fileSink->write(message.content, std::move(data)) });
+					}
 				}
 				else  // MSG_TEXT
 				{
@@ -746,8 +899,6 @@ bool CClientLogic::requestPendingMessages(std::vector<SMessage>& messages)
 			}
 			if (push)
 				messages.push_back(message);
-			parsedBytes += header->messageSize;
-			ptr         += header->messageSize;
 			break;
 		}
 		default:
@@ -760,6 +911,30 @@ bool CClientLogic::requestPendingMessages(std::vector<SMessage>& messages)
 	}
 	delete[] payload;
 
+	(void)resumeDownloads(messages);
+
+	// messages whose file failed to be written are not returned.
+	std::set<size_t> failed;
+	for (auto& write : writes)
+	{
+		if (!write.written.get())
+		{
+			lastError() << "\tMessage ID #" << write.messageId << ": ";
+			lastError() << "Failed to save file on disk." << std::endl;
+			failed.insert(write.index);
+		}
+	}
+	if (!failed.empty())
+	{
+		std::vector<SMessage> saved;
+		saved.reserve(messages.size() - failed.size());
+		for (size_t i = 0; i < messages.size(); ++i)
+		{
+			if (failed.find(i) == failed.end())
+				saved.push_back(std::move(messages[i]));
+		}
+		messages.swap(saved);
+	}
 	return true;
 }
 
@@ -768,10 +943,14 @@ bool CClientLogic::requestPendingMessages(std::vector<SMessage>& messages)
  */
 bool CClientLogic::sendMessage(const std::string& username, const EMessageType type, const std::string& data)
 {
+	const CSocketLease lease(*this);
+	const CLatencyStats::CRequest timing(REQUEST_SEND_MSG);
 	SClient              client; // client to send to
 	SRequestSendMessage  request(_self.id, (type));
 	SResponseMessageSent response;
-	uint8_t*             content = nullptr;
+	uint8_t*             content    = nullptr;
+	bool                 streamed   = false;  // request was sent & response received by sendFileChunks.
+	bool                 blobCached = false;  // message references a blob which was uploaded by a previous message.
 	std::map<const EMessageType, const std::string> descriptions = {
 		{MSG_SYMMETRIC_KEY_REQUEST, "symmetric key request"},
 		{MSG_SYMMETRIC_KEY_SEND,    "symmetric key"},
@@ -783,14 +962,14 @@ bool CClientLogic::sendMessage(const std::string& username, const EMessageType t
 	if (username == _self.username)
 	{
 		clearLastError();
-		_lastError << username << ", you can't send a " << descriptions[type] << " to yourself..";
+		lastError() << username << ", you can't send a " << descriptions[type] << " to yourself..";
 		return false;
 	}
 	
 	if (!getClient(username, client))
 	{
 		clearLastError();
-		_lastError << "username '" << username << "' doesn't exist. Please check your input or try to request users list again.";
+		lastError() << "username '" << username << "' doesn't exist. Please check your input or try to request users list again.";
 		return false;
 	}
 	request.payloadHeader.clientId = client.id;
@@ -800,7 +979,7 @@ bool CClientLogic::sendMessage(const std::string& username, const EMessageType t
 		if (!client.publicKeySet)
 		{
 			clearLastError();
-			_lastError << "Couldn't find " << client.username << "'s public key.";
+			lastError() << "Couldn't find " << client.username << "'s public key.";
 			return false;
 		}
 
@@ -810,14 +989,16 @@ bool CClientLogic::sendMessage(const std::string& username, const EMessageType t
 		if (!setClientSymmetricKey(request.payloadHeader.clientId, symKey))
 		{
 			clearLastError();
-			_lastError << "Failed storing symmetric key of clientID "
+			lastError() << "Failed storing symmetric key of clientID "
 				<< CStringer::hex(request.payloadHeader.clientId.uuid, sizeof(request.payloadHeader.clientId.uuid))
 				<< ". Please try to request clients list again..";
 			return false;
 		}
 
+		CLatencyStats::CTimer timer(PHASE_ENCRYPT);
 		RSAPublicWrapper rsa(client.publicKey);
 		const std::string encryptedKey = rsa.encrypt(symKey.symmetricKey, sizeof(symKey.symmetricKey));
+		timer.stop();
 		request.payloadHeader.contentSize = encryptedKey.size();  // 128
 		content = new uint8_t[request.payloadHeader.contentSize];
 		memcpy(content, encryptedKey.c_str(), request.payloadHeader.contentSize);
@@ -828,33 +1009,102 @@ bool CClientLogic::sendMessage(const std::string& username, const EMessageType t
 		if (data.empty())
 		{
 			clearLastError();
-			_lastError << "Empty input was provided!";
+			lastError() << "Empty input was provided!";
+			return false;
+		}
+		if ((type == MSG_TEXT) && (data.size() > TEXT_MAX_SIZE))
+		{
+			clearLastError();
+			lastError() << "Text message is limited to " << TEXT_MAX_SIZE << " bytes.";
 			return false;
 		}
 		if (!client.symmetricKeySet)
 		{
 			clearLastError();
-			_lastError << "Couldn't find " << client.username << "'s symmetric key.";
+			lastError() << "Couldn't find " << client.username << "'s symmetric key.";
+			return false;
+		}
+
+		// checked before encrypting.
+		uint64_t    fileSize  = 0;
+		std::time_t lastWrite = 0;
+		if ((type == MSG_FILE) && fileHandler()->fileInfo(data, fileSize, lastWrite) && !fileFits(client, fileSize))
+		{
+			clearLastError();
+			lastError() << "File is too large for " << client.username << "'s client.";
 			return false;
 		}
 
-		uint8_t* file = nullptr;
+		if ((type == MSG_FILE) && (client.version >= VERSION_BLOB))
+		{
+			// file is uploaded once as a blob. Message references the blob along with its wrapped content key.
+			SBlob blob;
+			if (!getFileBlob(data, client.version >= VERSION_STREAM, blob, blobCached))  // data = filename
+				return false;  // error message updated within.
+			AESWrapper aes(client.symmetricKey);
+			SBlobReference reference;
+			reference.blobHash = blob.hash;
+			const std::string wrappedKey = aes.encryptAEAD(blob.contentKey.symmetricKey, sizeof(blob.contentKey.symmetricKey));
+			memcpy(reference.wrappedKey, wrappedKey.c_str(), sizeof(reference.wrappedKey));
+			request.payloadHeader.messageType |= (blob.flags | MSG_FLAG_BLOB);
+			request.payloadHeader.contentSize = SWire<SBlobReference>::size;
+			content = new uint8_t[request.payloadHeader.contentSize];
+			(void)wireEncode(reference, content, request.payloadHeader.contentSize);
+		}
+
+		const uint8_t* file = nullptr;  // mapped. Encrypted straight from the page cache.
 		size_t bytes;
-		if ((type == MSG_FILE) && !_fileHandler->readAtOnce(data, file, bytes))  // data = filename
+		if ((content == nullptr) && (type == MSG_FILE) && !fileHandler()->mapAtOnce(data, file, bytes))  // data = filename
 		{
 			clearLastError();
-			_lastError << "file not found";
+			lastError() << "file not found";
 			return false;
 		}
-		AESWrapper aes(client.symmetricKey);
-		const std::string encrypted = (type == MSG_TEXT) ? aes.encrypt(data) : aes.encrypt(file, bytes);
-		request.payloadHeader.contentSize = encrypted.size();
-		content = new uint8_t[request.payloadHeader.contentSize];
-		memcpy(content, encrypted.c_str(), request.payloadHeader.contentSize);
-		delete[] file;
+		if (content != nullptr)
+		{
+			// blob reference was set.
+		}
+		else if ((type == MSG_FILE) && (client.version >= VERSION_CHUNKED))
+		{
+			// file chunks are sent while next chunks are being encrypted.
+			streamed = sendFileChunks(request, client.symmetricKey, file, bytes, client.version >= VERSION_STREAM, response);
+			fileHandler()->unmap();
+			if (!streamed)
+				return false;  // error message updated within.
+		}
+		else
+		{
+			AESWrapper aes(client.symmetricKey);
+			const uint8_t* plain  = (type == MSG_TEXT) ? reinterpret_cast<const uint8_t*>(data.c_str()) : file;
+			size_t         length = (type == MSG_TEXT) ? data.size() : bytes;
+			std::string compressed;
+			if ((client.version >= VERSION_COMPRESSION) && tryCompress(plain, length, compressed))
+			{
+				request.payloadHeader.messageType |= MSG_FLAG_COMPRESSED;
+				plain  = reinterpret_cast<const uint8_t*>(compressed.c_str());
+				length = compressed.size();
+			}
+			CLatencyStats::CTimer timer(PHASE_ENCRYPT);
+			std::string encrypted;
+			if (client.version >= VERSION_AEAD)  // negotiated by destination client's version.
+			{
+				request.payloadHeader.messageType |= MSG_FLAG_AEAD;
+				encrypted = aes.encryptAEAD(plain, length);
+			}
+			else
+			{
+				encrypted = aes.encrypt(plain, length);
+			}
+			timer.stop();
+			request.payloadHeader.contentSize = encrypted.size();
+			content = new uint8_t[request.payloadHeader.contentSize];
+			memcpy(content, encrypted.c_str(), request.payloadHeader.contentSize);
+			fileHandler()->unmap();
+		}
 	}
 
 	// prepare message to send
+	CLatencyStats::CTimer serialization(PHASE_SERIALIZE);
 	size_t msgSize;
 	uint8_t* msgToSend;
 	request.header.payloadSize = sizeof(request.payloadHeader) + request.payloadHeader.contentSize;
@@ -866,19 +1116,20 @@ bool CClientLogic::sendMessage(const std::string& username, const EMessageType t
 	else
 	{
 		msgToSend = new uint8_t[sizeof(request) + request.payloadHeader.contentSize];
-		memcpy(msgToSend, &request, sizeof(request));
+		(void)wireEncode(request, msgToSend, sizeof(request));
 		memcpy(msgToSend + sizeof(request), content, request.payloadHeader.contentSize);
 		msgSize = sizeof(request) + request.payloadHeader.contentSize;
 	}
+	serialization.stop();
 
 	// send request and receive response
-	if (!_socketHandler->sendReceive(msgToSend, msgSize, reinterpret_cast<uint8_t* const>(&response), sizeof(response)))
+	if (!streamed && !socketHandler()->sendReceive(msgToSend, msgSize, reinterpret_cast<uint8_t* const>(&response), sizeof(response)))
 	{
 		delete[] content;
 		if (msgToSend != reinterpret_cast<uint8_t*>(&request))
 			delete[] msgToSend;
 		clearLastError();
-		_lastError << "Failed communicating with server on " << _socketHandler;
+		lastError() << "Failed communicating with server on " << socketHandler();
 		return false;
 	}
 
@@ -888,16 +1139,1200 @@ bool CClientLogic::sendMessage(const std::string& username, const EMessageType t
 
 	// Validate SResponseMessageSent header
 	if (!validateHeader(response.header, RESPONSE_MSG_SENT))
+	{
+		if (blobCached)
+		{
+			// Server releases blobs once delivered to all recipients. Upload again.
+			{
+				std::lock_guard<std::recursive_mutex> lock(_transfersMutex);
+				_blobs.erase(data);
+			}
+			return sendMessage(username, type, data);
+		}
 		return false;  // error message updated within.
+	}
 
 	// Validate destination clientID
 	if (request.payloadHeader.clientId != response.payload.clientId)
 	{
 		clearLastError();
-		_lastError << "Unexpected clientID was received.";
+		lastError() << "Unexpected clientID was received.";
+		return false;
+	}
+
+	return true;
+}
+
+
+
+/**
+ * Send a text message to several clients by a single request. Text is encrypted once by a fresh content key,
+ * which is wrapped by each recipient's symmetric key. Server stores the encrypted text once.
+ * Recipients must support blob references.
+ */
+bool CClientLogic::sendFanout(const std::vector<std::string>& usernames, const std::string& text)
+{
+	const CSocketLease lease(*this);
+	const CLatencyStats::CRequest timing(REQUEST_SEND_FANOUT);
+	if (text.empty())
+	{
+		clearLastError();
+		lastError() << "Empty input was provided!";
+		return false;
+	}
+	if (text.size() > TEXT_MAX_SIZE)
+	{
+		clearLastError();
+		lastError() << "Text message is limited to " << TEXT_MAX_SIZE << " bytes.";
+		return false;
+	}
+	if (usernames.empty() || usernames.size() > FANOUT_MAX_RECIPIENTS)
+	{
+		clearLastError();
+		lastError() << "A message may be sent to 1 up to " << FANOUT_MAX_RECIPIENTS << " users.";
 		return false;
 	}
 
+	std::vector<SClient> recipients;
+	recipients.reserve(usernames.size());
+	for (const auto& username : usernames)
+	{
+		SClient client;
+		if (username == _self.username)
+		{
+			clearLastError();
+			lastError() << username << ", you can't send a text message to yourself..";
+			return false;
+		}
+		if (!getClient(username, client))
+		{
+			clearLastError();
+			lastError() << "username '" << username << "' doesn't exist. Please check your input or try to request users list again.";
+			return false;
+		}
+		if (!client.symmetricKeySet)
+		{
+			clearLastError();
+			lastError() << "Couldn't find " << client.username << "'s symmetric key.";
+			return false;
+		}
+		if (client.version < VERSION_BLOB)
+		{
+			clearLastError();
+			lastError() << client.username << "'s client doesn't support messages to several users. Please send a text message instead.";
+			return false;
+		}
+		recipients.push_back(client);
+	}
+
+	// content is compressed & encrypted once.
+	SRequestSendFanout request(_self.id, MSG_TEXT | MSG_FLAG_AEAD);
+	const uint8_t* plain  = reinterpret_cast<const uint8_t*>(text.c_str());
+	size_t         length = text.size();
+	std::string compressed;
+	if (tryCompress(plain, length, compressed))  // supported by every client of VERSION_BLOB.
+	{
+		request.payloadHeader.messageType |= MSG_FLAG_COMPRESSED;
+		plain  = reinterpret_cast<const uint8_t*>(compressed.c_str());
+		length = compressed.size();
+	}
+	CLatencyStats::CTimer encryption(PHASE_ENCRYPT);
+	const AESWrapper contentAes;
+	const SSymmetricKey contentKey = contentAes.getKey();
+	const std::string encrypted = contentAes.encryptAEAD(plain, length);
+	std::vector<SFanoutRecipient> wrapped(recipients.size());
+	for (size_t i = 0; i < recipients.size(); ++i)
+	{
+		const std::string wrappedKey = AESWrapper(recipients[i].symmetricKey).encryptAEAD(contentKey.symmetricKey, sizeof(contentKey.symmetricKey));
+		wrapped[i].clientId = recipients[i].id;
+		memcpy(wrapped[i].wrappedKey, wrappedKey.c_str(), sizeof(wrapped[i].wrappedKey));
+	}
+	encryption.stop();
+
+	// prepare message to send
+	CLatencyStats::CTimer serialization(PHASE_SERIALIZE);
+	request.payloadHeader.recipients  = static_cast<csize_t>(wrapped.size());
+	request.payloadHeader.contentSize = static_cast<csize_t>(encrypted.size());
+	const size_t recipientsSize = wrapped.size() * SWire<SFanoutRecipient>::size;
+	request.header.payloadSize = static_cast<csize_t>(sizeof(request.payloadHeader) + recipientsSize + encrypted.size());
+	const size_t msgSize = sizeof(request) + recipientsSize + encrypted.size();
+	uint8_t* const msgToSend = new uint8_t[msgSize];
+	uint8_t* ptr = msgToSend;
+	(void)wireEncode(request, ptr, sizeof(request));
+	ptr += sizeof(request);
+	for (const auto& recipient : wrapped)
+	{
+		(void)wireEncode(recipient, ptr, SWire<SFanoutRecipient>::size);
+		ptr += SWire<SFanoutRecipient>::size;
+	}
+	memcpy(ptr, encrypted.c_str(), encrypted.size());
+	serialization.stop();
+
+	// send request and receive response
+	uint8_t* payload     = nullptr;
+	size_t   payloadSize = 0;
+	const bool received = receiveUnknownPayload(msgToSend, msgSize, RESPONSE_FANOUT_SENT, payload, payloadSize);
+	delete[] msgToSend;
+	if (!received)
+		return false;  // description was set within.
+
+	// Validate a message was stored for each recipient, in order.
+	const size_t entrySize = SWire<SResponseMessageSent::SPayload>::size;
+	bool valid = (payloadSize == wrapped.size() * entrySize);
+	CWireReader reader(payload, payloadSize);
+	for (size_t i = 0; valid && i < wrapped.size(); ++i)
+	{
+		const auto* const sent = reader.view<SResponseMessageSent::SPayload>();
+		valid = (sent != nullptr) && (sent->clientId == wrapped[i].clientId);
+	}
+	delete[] payload;
+	if (!valid)
+	{
+		clearLastError();
+		lastError() << "Unexpected response was received.";
+		return false;
+	}
 	return true;
 }
 
+/**
+ * Encrypt a file as a sequence of SFileChunk, each independently encrypted by AES-GCM.
+ * Chunks are compressed when compressedFirst is set. It is the 1st chunk, already compressed by tryCompress.
+ * When stream is set, each chunk's SChunkAAD is authenticated along (MSG_FLAG_STREAM).
+ * Chunks are encrypted on the thread pool and passed to sink in order as soon as they are ready.
+ * onContentSize, if set, is invoked with the total content size before the first chunk is passed to sink.
+ * Compressed chunks sizes are unknown in advance, hence onContentSize can't be set along with compressedFirst.
+ */
+bool CClientLogic::encryptFileChunks(const SSymmetricKey& key, const uint8_t* const file, const size_t bytes, const std::string& compressedFirst, const bool stream,
+	const std::function<bool(const uint64_t)>& onContentSize, const std::function<bool(const void*, const size_t, const bool)>& sink)
+{
+	const size_t chunks = (bytes + FILE_CHUNK_SIZE - 1) / FILE_CHUNK_SIZE;
+	if (file == nullptr || bytes == 0)
+	{
+		clearLastError();
+		lastError() << "Invalid file for a chunked file message.";
+		return false;
+	}
+	const bool compress = !compressedFirst.empty();
+	if (compress && onContentSize)
+	{
+		clearLastError();
+		lastError() << "Compressed file chunks can't be sized in advance.";
+		return false;
+	}
+
+	// Encryption runs ahead of sink. Limit chunks in flight to bound memory usage.
+	const AESWrapper aes(key);
+	const size_t maxInFlight = 2 * _threadPool->size();
+	std::deque<std::shared_future<std::string>> inFlight;
+	size_t queued = 0;
+	const code_t code = CLatencyStats::currentCode();  // chunks are timed on pool threads.
+	auto enqueue = [&]()
+	{
+		const size_t offset = queued * FILE_CHUNK_SIZE;
+		const size_t length = std::min(FILE_CHUNK_SIZE, bytes - offset);
+		const SChunkAAD aad(queued, queued + 1 == chunks);
+		const std::string* const probed = (compress && queued == 0) ? &compressedFirst : nullptr;
+		inFlight.push_back(_threadPool->submit([&aes, file, offset, length, compress, probed, stream, aad, code]()
+		{
+			const CLatencyStats::CTimer timer(PHASE_ENCRYPT, code);
+			const uint8_t* const associated     = stream ? reinterpret_cast<const uint8_t*>(&aad) : nullptr;
+			const size_t         associatedSize = stream ? SWire<SChunkAAD>::size : 0;
+			if (!compress)
+				return aes.encryptAEAD(file + offset, length, associated, associatedSize);
+			if (probed != nullptr)
+				return aes.encryptAEAD(reinterpret_cast<const uint8_t*>(probed->c_str()), probed->size(), associated, associatedSize);
+			const std::string compressed = CStringer::compress(file + offset, length);
+			return aes.encryptAEAD(reinterpret_cast<const uint8_t*>(compressed.c_str()), compressed.size(), associated, associatedSize);
+		}).share());
+		++queued;
+	};
+	auto drain = [&inFlight]()  // tasks reference aes & file. Must wait for them before returning.
+	{
+		for (auto& task : inFlight)
+			task.wait();
+	};
+
+	while (queued < chunks && inFlight.size() < maxInFlight)
+		enqueue();
+
+	const uint64_t contentSize = bytes + static_cast<uint64_t>(chunks) * (sizeof(SFileChunk) + AEAD_NONCE_SIZE + AEAD_TAG_SIZE);
+	if (onContentSize && !onContentSize(contentSize))
+	{
+		drain();
+		return false;  // error message updated within.
+	}
+
+	bool success = true;
+
+	while (success && !inFlight.empty())
+	{
+		std::string encrypted;
+		try
+		{
+			encrypted = inFlight.front().get();
+		}
+		catch (...)
+		{
+			drain();
+			clearLastError();
+			lastError() << "Failed encrypting file.";
+			return false;
+		}
+		inFlight.pop_front();
+		if (queued < chunks)
+			enqueue();
+
+		SFileChunk chunk;
+		chunk.chunkSize = static_cast<csize_t>(encrypted.size());
+		success = sink(&chunk, sizeof(chunk), false) && sink(encrypted.c_str(), encrypted.size(), inFlight.empty());
+	}
+	drain();
+	return success;  // upon failure, error message updated by sink.
+}
+
+/**
+ * Return whether a file of fileSize bytes can be sent to client.
+ * Files sent inline, to clients older than VERSION_BLOB, are limited by the server's PAYLOAD_MAX_SIZE.
+ * Clients older than VERSION_LARGE receive up to 4GB of encrypted content.
+ */
+bool CClientLogic::fileFits(const SClient& client, const uint64_t fileSize)
+{
+	if (client.version >= VERSION_LARGE)
+		return true;
+	const uint64_t maxContent = (client.version < VERSION_BLOB) ? (PAYLOAD_MAX_SIZE - sizeof(SRequestSendMessage::payloadHeader)) : UINT32_MAX;
+	return (fileSize + (fileSize / FILE_CHUNK_SIZE + 1) * (sizeof(SFileChunk) + AEAD_NONCE_SIZE + AEAD_TAG_SIZE) <= maxContent);
+}
+
+/**
+ * Send a file message as a sequence of SFileChunk, streamed to the server while being encrypted.
+ * Request header precedes the chunks, hence they are not compressed: their size must be known in advance.
+ * Upon success, response is received from the server.
+ */
+bool CClientLogic::sendFileChunks(SRequestSendMessage& request, const SSymmetricKey& key, const uint8_t* const file, const size_t bytes, const bool stream, SResponseMessageSent& response)
+{
+	/**
+	 * Socket sends whole packets and pads the last one. Hence, data is buffered until a whole packet
+	 * is filled. Only the last packet of the request is padded.
+	 */
+	std::string packet;
+	auto send = [this, &packet](const void* data, const size_t size, const bool last) -> bool
+	{
+		packet.append(static_cast<const char*>(data), size);
+		const size_t toSend = last ? packet.size() : (packet.size() - (packet.size() % PACKET_SIZE));
+		if (toSend == 0)
+			return true;
+		const bool success = socketHandler()->send(reinterpret_cast<const uint8_t*>(packet.c_str()), toSend);
+		packet.erase(0, toSend);
+		if (!success)
+		{
+			clearLastError();
+			lastError() << "Failed communicating with server on " << socketHandler();
+		}
+		return success;
+	};
+
+	// request header is sent once content size is known.
+	auto sendHeader = [this, &request, &send, stream](const uint64_t contentSize) -> bool
+	{
+		if (contentSize > (PAYLOAD_MAX_SIZE - sizeof(request.payloadHeader)))
+		{
+			clearLastError();
+			lastError() << "File is too large for a chunked file message.";
+			return false;
+		}
+		request.payloadHeader.messageType |= (MSG_FLAG_AEAD | MSG_FLAG_CHUNKED);
+		if (stream)
+			request.payloadHeader.messageType |= MSG_FLAG_STREAM;
+		request.payloadHeader.contentSize  = static_cast<csize_t>(contentSize);
+		request.header.payloadSize         = sizeof(request.payloadHeader) + request.payloadHeader.contentSize;
+		if (!socketHandler()->connect())
+		{
+			clearLastError();
+			lastError() << "Failed connecting to server on " << socketHandler();
+			return false;
+		}
+		return send(&request, sizeof(request), false);
+	};
+
+	if (!encryptFileChunks(key, file, bytes, std::string(), stream, sendHeader, send))
+	{
+		socketHandler()->close();
+		return false;  // error message updated within.
+	}
+	if (!socketHandler()->receive(reinterpret_cast<uint8_t* const>(&response), sizeof(response)))
+	{
+		socketHandler()->close();
+		clearLastError();
+		lastError() << "Failed communicating with server on " << socketHandler();
+		return false;
+	}
+	socketHandler()->close();
+	return true;
+}
+
+/**
+ * Get a blob of a file, encrypted by a random content key. Blobs are cached by filepath.
+ * Upon cache miss (or file modification), file is read, encrypted, spooled to disk and uploaded.
+ * stream selects chunks' encoding (MSG_FLAG_STREAM). A cached blob of the other encoding is replaced.
+ * The blob is addressed by the SHA-256 of its encrypted content, hence it can be referenced by
+ * messages to many clients while uploaded once.
+ */
+bool CClientLogic::getFileBlob(const std::string& filepath, const bool stream, SBlob& blob, bool& cached)
+{
+	uint64_t    fileSize  = 0;
+	std::time_t lastWrite = 0;
+	cached = false;
+	if (!fileHandler()->fileInfo(filepath, fileSize, lastWrite))
+	{
+		clearLastError();
+		lastError() << "file not found";
+		return false;
+	}
+	bool found = false;
+	{
+		std::lock_guard<std::recursive_mutex> lock(_transfersMutex);
+		const auto itr = _blobs.find(filepath);
+		found = (itr != _blobs.end() && itr->second.fileSize == fileSize && itr->second.lastWrite == lastWrite &&
+			((itr->second.flags & MSG_FLAG_STREAM) != 0) == stream);
+		if (found)
+			blob = itr->second;
+	}
+	if (found)
+	{
+		cached = blob.uploaded;
+		return blob.uploaded || uploadBlob(filepath, blob);   // resume an interrupted upload.
+	}
+
+	const uint8_t* file = nullptr;
+	size_t bytes;
+	if (!fileHandler()->mapAtOnce(filepath, file, bytes))
+	{
+		clearLastError();
+		lastError() << "file not found";
+		return false;
+	}
+
+	const AESWrapper contentAes;  // random content key.
+	std::string probe;  // 1st chunk probes compressibility & is spooled as probed.
+	(void)tryCompress(file, std::min(bytes, FILE_CHUNK_SIZE), probe);
+
+	// Spool encrypted blob, so an interrupted upload can be resumed without encrypting again.
+	// Chunks are spooled & hashed once encrypted, hence the blob is never held in memory. Spool is renamed by its hash.
+	uint8_t spoolId[BLOB_HASH_SIZE];
+	AESWrapper::GenerateKey(spoolId, sizeof(spoolId));  // random name, unique among concurrent sends.
+	const std::string encrypting = spoolPath(CStringer::hex(spoolId, sizeof(spoolId)), ".encrypting");
+	CryptoPP::SHA256 hash;
+	auto spool = [this, &hash](const void* data, const size_t size, const bool)
+	{
+		hash.Update(static_cast<const uint8_t*>(data), size);
+		if (fileHandler()->write(static_cast<const uint8_t*>(data), size))
+			return true;
+		clearLastError();
+		lastError() << "Failed to spool file for upload.";
+		return false;
+	};
+	bool success = fileHandler()->open(encrypting, true);
+	if (!success)
+	{
+		clearLastError();
+		lastError() << "Failed to spool file for upload.";
+	}
+	else
+	{
+		success = encryptFileChunks(contentAes.getKey(), file, bytes, probe, stream, nullptr, spool);
+	}
+	fileHandler()->close();
+	fileHandler()->unmap();
+	if (!success)
+	{
+		(void)fileHandler()->remove(encrypting);
+		return false;  // error message updated within.
+	}
+
+	blob.contentKey = contentAes.getKey();
+	blob.flags      = MSG_FLAG_AEAD | MSG_FLAG_CHUNKED | (!probe.empty() ? MSG_FLAG_COMPRESSED : 0) | (stream ? MSG_FLAG_STREAM : 0);
+	blob.fileSize   = fileSize;
+	blob.lastWrite  = lastWrite;
+	blob.uploaded   = false;
+	hash.Final(blob.hash.hash);
+	if (!fileHandler()->rename(encrypting, spoolPath(blob.hash, ".upload")))
+	{
+		(void)fileHandler()->remove(encrypting);
+		clearLastError();
+		lastError() << "Failed to spool file for upload.";
+		return false;
+	}
+	{
+		std::lock_guard<std::recursive_mutex> lock(_transfersMutex);
+		_blobs[filepath] = blob;
+		(void)storeTransfers();
+	}
+	return uploadBlob(filepath, blob);
+}
+
+/**
+ * Upload a spooled blob in chunks. Server's committed size is queried first,
+ * hence only the missing chunks are sent.
+ */
+bool CClientLogic::uploadBlob(const std::string& filepath, SBlob& blob)
+{
+	const std::string spool = spoolPath(blob.hash, ".upload");
+	uint64_t    blobSize  = 0;
+	std::time_t lastWrite = 0;
+	if (!fileHandler()->fileInfo(spool, blobSize, lastWrite) || blobSize == 0 || !fileHandler()->open(spool))
+	{
+		{
+			std::lock_guard<std::recursive_mutex> lock(_transfersMutex);
+			_blobs.erase(filepath);   // spooled blob is gone. File will be encrypted again.
+			(void)storeTransfers();
+		}
+		clearLastError();
+		lastError() << "Spooled upload was not found. Please send the file again.";
+		return false;
+	}
+
+	SRequestUploadChunk request(_self.id);
+	SResponseUploadAck  response;
+	request.payloadHeader.blobHash = blob.hash;
+	request.payloadHeader.blobSize = blobSize;
+	uint8_t* const buffer = new uint8_t[sizeof(request) + TRANSFER_CHUNK_SIZE];
+	size_t   length    = 0;   // 1st request has no data. It queries server's committed size.
+	uint64_t committed = 0;
+	bool     success   = true;
+	for (;;)
+	{
+		const CLatencyStats::CRequest timing(REQUEST_UPLOAD_CHUNK);
+		request.payloadHeader.offset = committed;
+		request.header.payloadSize   = static_cast<csize_t>(sizeof(request.payloadHeader) + length);
+		(void)wireEncode(request, buffer, sizeof(request));
+		if ((length > 0) && !(fileHandler()->seek(committed) && fileHandler()->read(buffer + sizeof(request), length)))
+		{
+			success = false;
+			break;
+		}
+		if (!socketHandler()->sendReceive(buffer, sizeof(request) + length, reinterpret_cast<uint8_t* const>(&response), sizeof(response)) ||
+			!validateHeader(response.header, RESPONSE_UPLOAD_ACK) || (response.payload.blobHash != blob.hash) ||
+			(response.payload.committed > blobSize) || ((length > 0) && (response.payload.committed <= committed)))
+		{
+			success = false;
+			break;
+		}
+		committed = response.payload.committed;
+		if (committed == blobSize)
+			break;
+		length = static_cast<size_t>(std::min<uint64_t>(TRANSFER_CHUNK_SIZE, blobSize - committed));
+	}
+	delete[] buffer;
+	fileHandler()->close();
+	if (!success)
+	{
+		clearLastError();
+		lastError() << "Upload to server on " << socketHandler() << " was interrupted. Send the file again to resume the upload.";
+		return false;
+	}
+
+	(void)fileHandler()->remove(spool);
+	blob.uploaded = true;
+	std::lock_guard<std::recursive_mutex> lock(_transfersMutex);
+	_blobs[filepath] = blob;
+	(void)storeTransfers();
+	return true;
+}
+
+/**
+ * Unwrap a blob reference's content key and queue the blob for download.
+ */
+bool CClientLogic::queueDownload(const SSymmetricKey& key, const messageType_t messageType, const uint8_t* const content, const std::string& username)
+{
+	SBlobReference reference;
+	SDownload      download;
+	if (!wireDecode(reference, content, SWire<SBlobReference>::size))
+		return false;
+	try
+	{
+		const std::string contentKey = AESWrapper(key).decryptAEAD(reference.wrappedKey, sizeof(reference.wrappedKey));
+		if (contentKey.size() != SYMMETRIC_KEY_SIZE)
+			return false;
+		memcpy(download.contentKey.symmetricKey, contentKey.c_str(), sizeof(download.contentKey.symmetricKey));
+	}
+	catch (...)
+	{
+		return false;
+	}
+	download.hash        = reference.blobHash;
+	download.messageType = messageType & ~MSG_FLAG_BLOB;
+	download.username    = username;
+	std::lock_guard<std::recursive_mutex> lock(_transfersMutex);
+	_downloads.push_back(download);
+	(void)storeTransfers();   // message was removed from server. Keep it until downloaded.
+	return true;
+}
+
+/**
+ * Download queued blobs and decrypt them into messages. Return false if no downloads were queued.
+ * Downloads are claimed under _transfersMutex, then downloaded & decrypted without holding it, hence uploads
+ * and other downloads proceed meanwhile. A blob being downloaded by another thread isn't claimed, as its spool is in use.
+ * Interrupted downloads are kept, and resumed upon next pending messages request.
+ */
+bool CClientLogic::resumeDownloads(std::vector<SMessage>& messages)
+{
+	std::vector<SDownload> claimed;
+	{
+		std::lock_guard<std::recursive_mutex> lock(_transfersMutex);
+		for (auto& download : _downloads)
+		{
+			const bool busy = std::any_of(_downloads.begin(), _downloads.end(), [&download](const SDownload& other)
+				{ return other.claimed && (other.hash == download.hash); });
+			const bool mine = std::any_of(claimed.begin(), claimed.end(), [&download](const SDownload& other)
+				{ return other.hash == download.hash; });
+			if (!download.claimed && (!busy || mine))
+			{
+				claimed.push_back(download);
+				download.claimed = true;
+			}
+		}
+	}
+	if (claimed.empty())
+		return false;
+
+	// claim is released upon completion. Completed downloads are removed.
+	auto release = [this](const SDownload& download, const bool completed)
+	{
+		std::lock_guard<std::recursive_mutex> lock(_transfersMutex);
+		const auto itr = std::find_if(_downloads.begin(), _downloads.end(), [&download](const SDownload& other)
+			{ return other.claimed && (other.hash == download.hash) && (other.username == download.username); });
+		if (itr == _downloads.end())
+			return;
+		if (completed)
+			_downloads.erase(itr);
+		else
+			itr->claimed = false;
+	};
+
+	for (const SDownload& download : claimed)
+	{
+		SMessage message;
+		message.username = download.username;
+		const std::string log = lastError().str();   // messages parsing errors. Preserve upon download failure.
+		if (!downloadBlob(download))
+		{
+			clearLastError();
+			lastError() << log << "\tDownload of a message from " << message.username << " was interrupted. It will be resumed upon next request." << std::endl;
+			release(download, false);
+			continue;
+		}
+		const uint8_t* blob     = nullptr;
+		size_t         blobSize = 0;
+		message.content = "can't decrypt message"; // assume failure
+		bool push = true;
+		try
+		{
+			CLatencyStats::CTimer timer(PHASE_DECRYPT);
+			if (!fileHandler()->mapAtOnce(spoolPath(download.hash, ".download"), blob, blobSize))
+			{
+				lastError() << "\tMessage from " << message.username << ": Failed to read downloaded message." << std::endl;
+				push = false;
+			}
+			else if ((download.messageType & MSG_TYPE_MASK) != MSG_FILE)
+			{
+				message.content = decryptContent(download.contentKey, download.messageType, blob, blobSize);
+			}
+			else if (download.messageType & MSG_FLAG_CHUNKED)
+			{
+				// file is written while being decrypted, hence never held in memory.
+				if (!storeReceivedChunks(message.username, download.contentKey, download.messageType, blob, blobSize, message.content))
+				{
+					lastError() << "\tMessage from " << message.username << ": Failed to save file on disk." << std::endl;
+					push = false;
+				}
+			}
+			else
+			{
+				const std::string data = decryptContent(download.contentKey, download.messageType, blob, blobSize);
+				timer.stop();
+				if (!storeReceivedFile(message.username, data, message.content))
+				{
+					lastError() << "\tMessage from " << message.username << ": Failed to save file on disk." << std::endl;
+					push = false;
+				}
+			}
+		}
+		catch (...)
+		{
+			lastError() << "\tMessage from " << message.username << ": Message authentication failed. Content is corrupt." << std::endl;
+		}
+		fileHandler()->unmap();
+		if (push)
+			messages.push_back(message);
+		(void)fileHandler()->remove(spoolPath(download.hash, ".download"));
+		release(download, true);
+	}
+	(void)storeTransfers();
+	return true;
+}
+
+/**
+ * Download a blob in chunks into a spool file. Download starts from the spooled size, hence an
+ * interrupted download is resumed. Completion is acknowledged, so server may release the blob.
+ * The blob is left spooled for decryption.
+ */
+bool CClientLogic::downloadBlob(const SDownload& download)
+{
+	const std::string spool = spoolPath(download.hash, ".download");
+	uint64_t    offset    = 0;
+	std::time_t lastWrite = 0;
+	if (!fileHandler()->fileInfo(spool, offset, lastWrite))
+		offset = 0;  // new download.
+
+	SRequestDownloadChunk request(_self.id);
+	request.header.payloadSize = sizeof(request.payload);
+	request.payload.blobHash   = download.hash;
+	request.payload.length     = TRANSFER_CHUNK_SIZE;
+	for (;;)
+	{
+		const CLatencyStats::CRequest timing(REQUEST_DOWNLOAD_CHUNK);
+		uint8_t*       payload     = nullptr;
+		size_t         payloadSize = 0;
+		STransferChunk chunk;
+		request.payload.offset = offset;
+		if (!receiveUnknownPayload(reinterpret_cast<uint8_t*>(&request), sizeof(request), RESPONSE_DOWNLOAD_CHUNK, payload, payloadSize))
+			return false;
+		CWireReader reader(payload, payloadSize);
+		if (!reader.read(chunk))
+		{
+			delete[] payload;
+			return false;
+		}
+		const size_t length = reader.remaining();
+		if ((chunk.blobHash != download.hash) || (chunk.offset != offset) || (offset + length > chunk.blobSize))
+		{
+			delete[] payload;
+			return false;
+		}
+		if (length > 0)
+		{
+			const bool written = fileHandler()->open(spool, true, true) && fileHandler()->write(reader.take(length), length);
+			fileHandler()->close();
+			if (!written)
+			{
+				delete[] payload;
+				return false;
+			}
+			offset += length;
+		}
+		delete[] payload;
+		if (offset == chunk.blobSize)
+			break;
+		if (length == 0)
+			return false;   // no progress.
+	}
+
+	// acknowledge completion. Failure is not an error since blob was downloaded.
+	{
+		const CLatencyStats::CRequest timing(REQUEST_DOWNLOAD_CHUNK);
+		uint8_t* payload     = nullptr;
+		size_t   payloadSize = 0;
+		request.payload.offset = offset;
+		request.payload.length = 0;
+		if (receiveUnknownPayload(reinterpret_cast<uint8_t*>(&request), sizeof(request), RESPONSE_DOWNLOAD_CHUNK, payload, payloadSize))
+			delete[] payload;
+	}
+	return true;
+}
+
+/**
+ * Store a received file on disk. Set filename with source username & timestamp.
+ */
+bool CClientLogic::storeReceivedFile(const std::string& username, const std::string& data, std::string& filepath)
+{
+	filepath = receivedFilePath(username);
+	return fileHandler()->writeAtOnce(filepath, data);
+}
+
+/**
+ * Folder of received files & transfer spools, within %TMP%. Resolved once.
+ */
+const std::string& CClientLogic::filesFolder()
+{
+	static const std::string folder = (boost::filesystem::path(CFileHandler().getTempFolder()) / "MessageU").string()
+		+ static_cast<char>(boost::filesystem::path::preferred_separator);
+	return folder;
+}
+
+/**
+ * Path of a received file. Filename is set with source username, timestamp & a sequence number.
+ * Files of a pending messages batch are named within the same millisecond, hence the sequence keeps them apart.
+ */
+std::string CClientLogic::receivedFilePath(const std::string& username)
+{
+	static std::atomic<uint64_t> sequence(0);
+	return filesFolder() + username + "_" + CStringer::getTimestamp() + "_" + std::to_string(sequence++);
+}
+
+/**
+ * Decrypt a chunked file message into a received file. Chunks are written in order, once decrypted.
+ * Throws upon invalid chunks layout or chunk authentication failure. A partially written file is removed.
+ */
+bool CClientLogic::storeReceivedChunks(const std::string& username, const SSymmetricKey& key, const messageType_t messageType, const uint8_t* const content, const size_t size, std::string& filepath)
+{
+	filepath = receivedFilePath(username);
+	if (!fileHandler()->open(filepath, true))
+		return false;
+	bool written = false;
+	try
+	{
+		written = decryptFileChunks(key, messageType, content, size, [this](const std::string& plain)
+		{
+			return plain.empty() || fileHandler()->write(reinterpret_cast<const uint8_t*>(plain.c_str()), plain.size());
+		});
+	}
+	catch (...)
+	{
+		fileHandler()->close();
+		(void)fileHandler()->remove(filepath);
+		throw;
+	}
+	fileHandler()->close();
+	if (!written)
+		(void)fileHandler()->remove(filepath);
+	return written;
+}
+
+/**
+ * Spool file path of a blob transfer.
+ */
+std::string CClientLogic::spoolPath(const SBlobHash& hash, const std::string& extension) const
+{
+	return spoolPath(CStringer::hex(hash.hash, sizeof(hash.hash)), extension);
+}
+
+std::string CClientLogic::spoolPath(const std::string& name, const std::string& extension) const
+{
+	return filesFolder() + _self.username + "_" + name + extension;
+}
+
+/**
+ * Store uploaded blobs & queued downloads to TRANSFERS_INFO file, so transfers survive a restart.
+ * Upload line:   U <hash> <content key> <flags> <file size> <last write> <uploaded> <filepath>
+ * Download line: D <hash> <content key> <message type> <username>
+ */
+bool CClientLogic::storeTransfers()
+{
+	std::lock_guard<std::recursive_mutex> lock(_transfersMutex);
+	if (!fileHandler()->open(_transfersInfo, true))
+		return false;
+	bool success = true;
+	for (const auto& itr : _blobs)
+	{
+		const SBlob& blob = itr.second;
+		std::stringstream line;
+		line << "U " << CStringer::hex(blob.hash.hash, sizeof(blob.hash.hash)) << ' '
+			<< CStringer::hex(blob.contentKey.symmetricKey, sizeof(blob.contentKey.symmetricKey)) << ' '
+			<< static_cast<uint32_t>(blob.flags) << ' ' << blob.fileSize << ' ' << blob.lastWrite << ' '
+			<< blob.uploaded << ' ' << itr.first;
+		success = success && fileHandler()->writeLine(line.str());
+	}
+	for (const SDownload& download : _downloads)
+	{
+		std::stringstream line;
+		line << "D " << CStringer::hex(download.hash.hash, sizeof(download.hash.hash)) << ' '
+			<< CStringer::hex(download.contentKey.symmetricKey, sizeof(download.contentKey.symmetricKey)) << ' '
+			<< static_cast<uint32_t>(download.messageType) << ' ' << download.username;
+		success = success && fileHandler()->writeLine(line.str());
+	}
+	fileHandler()->close();
+	return success;
+}
+
+/**
+ * Load uploaded blobs & queued downloads from TRANSFERS_INFO file. Corrupted lines are ignored.
+ */
+bool CClientLogic::loadTransfers()
+{
+	std::lock_guard<std::recursive_mutex> lock(_transfersMutex);
+	if (!fileHandler()->open(_transfersInfo))
+		return false;
+	_blobs.clear();
+	_downloads.clear();
+	std::string line;
+	while (fileHandler()->readLine(line))
+	{
+		std::istringstream fields(line);
+		std::string kind;
+		std::string hash;
+		std::string key;
+		uint32_t    type = DEF_VAL;
+		fields >> kind >> hash >> key >> type;
+		hash = CStringer::unhex(hash);
+		key  = CStringer::unhex(key);
+		if (fields.fail() || hash.size() != BLOB_HASH_SIZE || key.size() != SYMMETRIC_KEY_SIZE)
+			continue;
+
+		if (kind == "U")
+		{
+			SBlob       blob;
+			std::string filepath;
+			fields >> blob.fileSize >> blob.lastWrite >> blob.uploaded;
+			std::getline(fields >> std::ws, filepath);
+			if (fields.fail() || filepath.empty())
+				continue;
+			memcpy(blob.hash.hash, hash.c_str(), sizeof(blob.hash.hash));
+			memcpy(blob.contentKey.symmetricKey, key.c_str(), sizeof(blob.contentKey.symmetricKey));
+			blob.flags = static_cast<messageType_t>(type);
+			_blobs[filepath] = blob;
+		}
+		else if (kind == "D")
+		{
+			SDownload download;
+			std::getline(fields >> std::ws, download.username);
+			memcpy(download.hash.hash, hash.c_str(), sizeof(download.hash.hash));
+			memcpy(download.contentKey.symmetricKey, key.c_str(), sizeof(download.contentKey.symmetricKey));
+			download.messageType = static_cast<messageType_t>(type);
+			_downloads.push_back(download);
+		}
+	}
+	fileHandler()->close();
+	return true;
+}
+
+/**
+ * Decrypt a message content according to its EMessageFlag flags.
+ * Throws upon decryption, authentication or decompression failure.
+ */
+std::string CClientLogic::decryptContent(const SSymmetricKey& key, const messageType_t messageType, const uint8_t* const content, const size_t size) const
+{
+	if (messageType & MSG_FLAG_BLOB)
+	{
+		SBlobReference reference;
+		if (!wireDecode(reference, content, size))
+			throw std::length_error("Invalid blob reference");
+		const std::string contentKey = AESWrapper(key).decryptAEAD(reference.wrappedKey, sizeof(reference.wrappedKey));
+		if (contentKey.size() != SYMMETRIC_KEY_SIZE)
+			throw std::length_error("Invalid content key");
+		SSymmetricKey blobKey;
+		memcpy(blobKey.symmetricKey, contentKey.c_str(), sizeof(blobKey.symmetricKey));
+		return decryptContent(blobKey, messageType & ~MSG_FLAG_BLOB, content + SWire<SBlobReference>::size, size - SWire<SBlobReference>::size);
+	}
+
+	if (messageType & MSG_FLAG_CHUNKED)
+		return decryptFileChunks(key, messageType, content, size);
+
+	const bool compressed = (messageType & MSG_FLAG_COMPRESSED) != 0;
+
+	const AESWrapper aes(key);
+	const std::string data = (messageType & MSG_FLAG_AEAD) ? aes.decryptAEAD(content, size) : aes.decrypt(content, size);
+	if (compressed)
+	{
+		// non-chunked files are never compressed by senders. Bounded as a single chunk.
+		const size_t maxSize = ((messageType & MSG_TYPE_MASK) == MSG_TEXT) ? TEXT_MAX_SIZE : FILE_CHUNK_SIZE;
+		return CStringer::decompress(reinterpret_cast<const uint8_t*>(data.c_str()), data.size(), maxSize);
+	}
+	return data;
+}
+
+/**
+ * Decrypt a chunked file message content. Chunks are decrypted in parallel on the thread pool.
+ * Throws upon invalid chunks layout or chunk authentication failure.
+ */
+std::string CClientLogic::decryptFileChunks(const SSymmetricKey& key, const messageType_t messageType, const uint8_t* const content, const size_t size) const
+{
+	std::string file;
+	file.reserve((messageType & MSG_FLAG_COMPRESSED) ? 0 : size);
+	(void)decryptFileChunks(key, messageType, content, size, [&file](const std::string& plain)
+	{
+		file.append(plain);
+		return true;
+	});
+	return file;
+}
+
+/**
+ * Decrypt a chunked file message content, passing plain chunks to sink in order. Chunks are decrypted
+ * on the thread pool, a bounded number ahead of sink, hence memory usage doesn't grow with the file.
+ * MSG_FLAG_STREAM chunks are authenticated along with their expected SChunkAAD, hence chunks which
+ * were reordered, duplicated or dropped, and a file truncated before its last chunk, fail authentication.
+ * Return false if sink failed. Throws upon invalid chunks layout or chunk authentication failure.
+ */
+bool CClientLogic::decryptFileChunks(const SSymmetricKey& key, const messageType_t messageType, const uint8_t* const content, const size_t size,
+	const std::function<bool(const std::string&)>& sink) const
+{
+	const bool compressed = (messageType & MSG_FLAG_COMPRESSED) != 0;
+	const bool stream     = (messageType & MSG_FLAG_STREAM) != 0;
+	const AESWrapper aes(key);
+	const size_t maxInFlight = 2 * _threadPool->size();
+	std::deque<std::future<std::string>> inFlight;
+	CWireReader reader(content, size);
+	if (stream && reader.empty())
+		throw std::length_error("Missing last chunk");
+	uint64_t index = 0;
+	auto enqueue = [&]()
+	{
+		const SFileChunk* const chunk = reader.view<SFileChunk>();
+		if (chunk == nullptr)
+			throw std::length_error("Invalid chunk header");
+		const size_t         cipherSize = chunk->chunkSize;
+		const uint8_t* const cipher     = reader.take(cipherSize);
+		if ((cipherSize < AEAD_NONCE_SIZE + AEAD_TAG_SIZE) || (cipher == nullptr))
+			throw std::length_error("Invalid chunk size");
+		const SChunkAAD aad(index++, reader.empty());
+		inFlight.push_back(_threadPool->submit([&aes, cipher, cipherSize, compressed, stream, aad]()
+		{
+			std::string plain = stream ? aes.decryptAEAD(cipher, cipherSize, reinterpret_cast<const uint8_t*>(&aad), SWire<SChunkAAD>::size) :
+				aes.decryptAEAD(cipher, cipherSize);
+			if (compressed)
+				plain = CStringer::decompress(reinterpret_cast<const uint8_t*>(plain.c_str()), plain.size(), FILE_CHUNK_SIZE);
+			return plain;
+		}));
+	};
+	auto drain = [&inFlight]()  // tasks reference aes. Must wait for them before returning.
+	{
+		for (auto& task : inFlight)
+		{
+			if (task.valid())  // a task whose get() threw is no longer valid.
+				task.wait();
+		}
+	};
+
+	bool success = true;
+	try
+	{
+		while (success && !(reader.empty() && inFlight.empty()))
+		{
+			while (!reader.empty() && inFlight.size() < maxInFlight)
+				enqueue();
+			const std::string plain = inFlight.front().get();
+			inFlight.pop_front();
+			success = sink(plain);
+		}
+	}
+	catch (...)
+	{
+		drain();
+		throw;
+	}
+	drain();
+	return success;
+}
+
+/**
+ * Compress plain content. Return false if content is too small or incompressible,
+ * in which case compressed is left empty and the content should be sent as is.
+ */
+bool CClientLogic::tryCompress(const uint8_t* const plain, const size_t length, std::string& compressed)
+{
+	compressed.clear();
+	if (plain == nullptr || length < COMPRESSION_MIN_SIZE)
+		return false;
+	try
+	{
+		compressed = CStringer::compress(plain, length);
+	}
+	catch (...)
+	{
+		compressed.clear();
+		return false;
+	}
+	if (compressed.size() > length - (length / COMPRESSION_MIN_RATIO))
+	{
+		compressed.clear();
+		return false;
+	}
+	return true;
+}
+
+
+/**
+ * Queue a message to be sent by the background sender thread. Returns immediately.
+ * onSent is invoked on the sender thread once the message was sent, or failed permanently.
+ * Messages to the same username are sent in queueing order.
+ */
+CClientLogic::ticket_t CClientLogic::queueMessage(const std::string& username, const EMessageType type, const std::string& data, const sentCallback_t& onSent)
+{
+	SOutbound message;
+	message.username = username;
+	message.type     = type;
+	message.data     = data;
+	message.onSent   = onSent;
+	message.due      = std::chrono::steady_clock::now();
+	ticket_t ticket;
+	{
+		std::lock_guard<std::mutex> lock(_outboundMutex);
+		ticket = message.ticket = ++_lastTicket;
+		_outbound.push_back(std::move(message));
+		if (!_sender.joinable())
+			_sender = std::thread(&CClientLogic::senderLoop, this);
+	}
+	_outboundChanged.notify_all();
+	return ticket;
+}
+
+/**
+ * Amount of queued messages, including messages being sent.
+ */
+size_t CClientLogic::outboundSize() const
+{
+	std::lock_guard<std::mutex> lock(_outboundMutex);
+	return _outbound.size() + _sending;
+}
+
+/**
+ * Block until all queued messages were sent or failed.
+ */
+void CClientLogic::flushOutbound()
+{
+	std::unique_lock<std::mutex> lock(_outboundMutex);
+	_outboundChanged.wait(lock, [this]() { return _stopSender || (_outbound.empty() && _sending == 0); });
+}
+
+/**
+ * Sender thread. Drains due messages in batches. Upon stop, remaining messages are reported as failed.
+ */
+void CClientLogic::senderLoop()
+{
+	std::unique_lock<std::mutex> lock(_outboundMutex);
+	while (!_stopSender)
+	{
+		if (_outbound.empty())
+		{
+			_outboundChanged.wait(lock);
+			continue;
+		}
+
+		// a message isn't due while an earlier message to the same username awaits a retry.
+		const auto now  = std::chrono::steady_clock::now();
+		auto       next = std::chrono::steady_clock::time_point::max();
+		std::set<std::string>  waiting;
+		std::vector<SOutbound> batch;
+		std::deque<SOutbound>  later;
+		for (auto& message : _outbound)
+		{
+			if (waiting.count(message.username) == 0 && message.due <= now)
+			{
+				batch.push_back(std::move(message));
+			}
+			else
+			{
+				if (waiting.insert(message.username).second)
+					next = std::min(next, message.due);
+				later.push_back(std::move(message));
+			}
+		}
+		_outbound.swap(later);
+		if (batch.empty())
+		{
+			_outboundChanged.wait_until(lock, next);
+			continue;
+		}
+
+		_sending = batch.size();
+		lock.unlock();
+		std::vector<SOutbound> retries;
+		sendBatch(batch, retries);
+		lock.lock();
+		_outbound.insert(_outbound.begin(), std::make_move_iterator(retries.begin()), std::make_move_iterator(retries.end()));
+		_sending = 0;
+		_outboundChanged.notify_all();
+	}
+
+	std::deque<SOutbound> dropped;
+	dropped.swap(_outbound);
+	lock.unlock();
+	_outboundChanged.notify_all();
+	for (const auto& message : dropped)
+	{
+		if (message.onSent)
+			message.onSent(message.ticket, false, "Client stopped before the message was sent.");
+	}
+}
+
+/**
+ * Send a batch of messages over a single leased connection handler.
+ * Batch is grouped by username. Consecutive symmetric key requests to the same username are coalesced into one.
+ * Failed messages are moved to retries with an exponential backoff, unless retrying is pointless.
+ * Once a message awaits a retry, later messages to the same username await along with it.
+ */
+void CClientLogic::sendBatch(std::vector<SOutbound>& batch, std::vector<SOutbound>& retries)
+{
+	const CSocketLease lease(*this);
+	std::stable_sort(batch.begin(), batch.end(), [](const SOutbound& a, const SOutbound& b) { return a.username < b.username; });
+	size_t index = 0;
+	while (index < batch.size())
+	{
+		size_t end = index + 1;
+		if (batch[index].type == MSG_SYMMETRIC_KEY_REQUEST)
+		{
+			while (end < batch.size() && batch[end].username == batch[index].username && batch[end].type == MSG_SYMMETRIC_KEY_REQUEST)
+				++end;
+		}
+
+		const bool  waiting   = !retries.empty() && retries.back().username == batch[index].username;
+		bool        sent      = false;
+		bool        retryable = true;
+		std::string error;
+		if (!waiting)
+		{
+			// an exception must not escape the sender thread. It would fail again, hence reported rather than retried.
+			try
+			{
+				sent = sendMessage(batch[index].username, batch[index].type, batch[index].data);
+				if (!sent)
+					error = getLastError();
+			}
+			catch (const std::exception& e)
+			{
+				error     = e.what();
+				retryable = false;
+			}
+			catch (...)
+			{
+				error     = "Unknown error while sending a message.";
+				retryable = false;
+			}
+		}
+
+		for (; index < end; ++index)
+		{
+			SOutbound& message = batch[index];
+			if (waiting)
+			{
+				message.due = retries.back().due;
+				retries.push_back(std::move(message));
+			}
+			else if (!sent && retryable && (++message.attempts < OUTBOUND_MAX_ATTEMPTS) && isDeliverable(message))
+			{
+				const uint32_t delay = std::min(OUTBOUND_MAX_DELAY_MS, OUTBOUND_RETRY_DELAY_MS << (message.attempts - 1));
+				message.due = std::chrono::steady_clock::now() + std::chrono::milliseconds(delay);
+				retries.push_back(std::move(message));
+			}
+			else if (message.onSent)
+			{
+				message.onSent(message.ticket, sent, error);
+			}
+		}
+	}
+}
+
+/**
+ * Return false if a failed message would fail again regardless of retries.
+ * E.g. unknown username, missing keys or missing file.
+ */
+bool CClientLogic::isDeliverable(const SOutbound& message)
+{
+	SClient client;
+	if (message.username == _self.username || !getClient(message.username, client))
+		return false;
+	uint64_t    bytes;
+	std::time_t lastWrite;
+	switch (message.type)
+	{
+	case MSG_SYMMETRIC_KEY_SEND:
+		return client.publicKeySet;
+	case MSG_TEXT:
+		return !message.data.empty() && client.symmetricKeySet;
+	case MSG_FILE:
+		return client.symmetricKeySet && fileHandler()->fileInfo(message.data, bytes, lastWrite) && fileFits(client, bytes);
+	default:
+		return true;
+	}
+}
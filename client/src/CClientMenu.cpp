@@ -7,9 +7,35 @@
  * https://github.com/Romansko/MessageU/blob/main/client/src/CClientMenu.cpp
  */
 #include "CClientMenu.h"
+#include <algorithm>
 #include <iostream>
+#include <sstream>
 #include <boost/algorithm/string/trim.hpp>
 
+/**
+ * Clear the console.
+ */
+void CClientMenu::clear() const
+{
+#ifdef _WIN32
+	(void)system("cls");
+#else
+	std::cout << "\033[2J\033[H" << std::flush;  // ANSI: erase display & move cursor home.
+#endif
+}
+
+/**
+ * Wait for the user to press Enter.
+ */
+void CClientMenu::pause() const
+{
+	std::cout << "Press Enter to continue . . ." << std::flush;
+	std::string line;
+	std::getline(std::cin, line);
+	if (std::cin.eof())   // ignore ctrl + d.
+		std::cin.clear();
+}
+
 /**
  * Print error and exit client.
  */
@@ -36,7 +62,7 @@ void CClientMenu::initialize()
 /**
  * Print main menu to the screen.
  */
-void CClientMenu::display() const
+void CClientMenu::display()
 {
 	clear();
 	if (_registered && !_clientLogic.getSelfUsername().empty())
@@ -44,6 +70,31 @@ void CClientMenu::display() const
 	std::cout << "MessageU client at your service." << std::endl << std::endl;
 	for (const auto& opt : _menuOptions)
 		std::cout << opt << std::endl;
+
+	std::lock_guard<std::mutex> lock(_reportsMutex);
+	if (!_reports.empty())
+	{
+		std::cout << std::endl;
+		for (const auto& report : _reports)
+			std::cout << report << std::endl;
+		_reports.clear();
+	}
+}
+
+/**
+ * Queue a message for sending. The outcome is reported upon next menu display.
+ */
+void CClientMenu::queueMessage(const std::string& username, const EMessageType type, const std::string& data, const std::string& description)
+{
+	_clientLogic.queueMessage(username, type, data,
+		[this, username, description](const CClientLogic::ticket_t, const bool sent, const std::string& error)
+		{
+			std::lock_guard<std::mutex> lock(_reportsMutex);
+			if (sent)
+				_reports.push_back(description + " to " + username + " was sent successfully.");
+			else
+				_reports.push_back(description + " to " + username + " failed: " + error);
+		});
 }
 
 
@@ -111,6 +162,11 @@ void CClientMenu::handleUserChoice()
 	{
 	case CMenuOption::EOption::MENU_EXIT:
 	{
+		if (_clientLogic.outboundSize() != 0)
+		{
+			std::cout << "Sending queued messages.." << std::endl;
+			_clientLogic.flushOutbound();
+		}
 		std::cout << "Client will now exit." << std::endl;
 		pause();
 		exit(0);
@@ -176,7 +232,7 @@ void CClientMenu::handleUserChoice()
 	{
 		const std::string username = readUserInput("Please type a username to send message to..");
 		const std::string message  = readUserInput("Enter message: ");
-		success = _clientLogic.sendMessage(username, MSG_TEXT, message);
+		queueMessage(username, MSG_TEXT, message, "Message");
 		break;
 	}
 	case CMenuOption::EOption::MENU_REQ_SYM_KEY:
@@ -195,7 +251,22 @@ void CClientMenu::handleUserChoice()
 	{
 		const std::string username = readUserInput("Please type a username to send file to..");
 		const std::string message  = readUserInput("Enter filepath: ");
-		success = _clientLogic.sendMessage(username, MSG_FILE, message);
+		queueMessage(username, MSG_FILE, message, "File " + message);
+		break;
+	}
+	case CMenuOption::EOption::MENU_SEND_FANOUT:
+	{
+		std::stringstream input(readUserInput("Please type usernames to send message to, separated by commas.."));
+		std::vector<std::string> usernames;
+		std::string username;
+		while (std::getline(input, username, ','))
+		{
+			boost::algorithm::trim(username);
+			if (!username.empty())
+				usernames.push_back(username);
+		}
+		const std::string message = readUserInput("Enter message: ");
+		success = _clientLogic.sendFanout(usernames, message);
 		break;
 	}
 	}
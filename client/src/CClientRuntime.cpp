@@ -0,0 +1,158 @@
+/**
+ * MessageU Client
+ * @file CClientRuntime.cpp
+ * @brief Runtime of many client identities within one process.
+ * @author Roman Koifman
+ * https://github.com/Romansko/MessageU/blob/main/client/src/CClientRuntime.cpp
+ */
+#include "CClientRuntime.h"
+#include "CClientLogic.h"
+#include "CConnectionPool.h"
+#include "CFileHandler.h"
+#include "CFileSink.h"
+#include "CStringer.h"
+#include "CThreadPool.h"
+#include <boost/asio.hpp>
+
+CClientRuntime::CClientRuntime(const size_t maxConnections, const size_t threads) : _ioContext(nullptr), _connections(nullptr), _threadPool(nullptr), _fileSink(nullptr), _fileHandler(nullptr)
+{
+	_ioContext   = new io_context;
+	_connections = new CConnectionPool(*_ioContext, maxConnections);
+	_threadPool  = new CThreadPool(threads);
+	_fileSink    = new CFileSink();
+	_fileHandler = new CFileHandler();
+}
+
+/**
+ * Identities are destroyed first, since they use the shared resources.
+ */
+CClientRuntime::~CClientRuntime()
+{
+	for (auto& identity : _identities)
+		delete identity.second;
+	delete _fileHandler;
+	delete _fileSink;
+	delete _threadPool;
+	delete _connections;
+	delete _ioContext;
+}
+
+/**
+ * Reset _lastError StringStream: Empty string, clear errors flag and reset formatting.
+ */
+void CClientRuntime::clearLastError()
+{
+	const std::stringstream clean;
+	_lastError.str("");
+	_lastError.clear();
+	_lastError.copyfmt(clean);
+}
+
+/**
+ * Parse SERVER_INFO file for server address & port. Shared by all identities.
+ */
+bool CClientRuntime::parseServeInfo()
+{
+	std::string info;
+	if (!_fileHandler->open(SERVER_INFO) || !_fileHandler->readLine(info))
+	{
+		clearLastError();
+		_lastError << "Couldn't read " << SERVER_INFO;
+		return false;
+	}
+	_fileHandler->close();
+	CStringer::trim(info);
+	const auto pos = info.find(':');
+	if (pos == std::string::npos)
+	{
+		clearLastError();
+		_lastError << SERVER_INFO << " has invalid format! missing separator ':'";
+		return false;
+	}
+	if (!_connections->setServerInfo(info.substr(0, pos), info.substr(pos + 1)))
+	{
+		clearLastError();
+		_lastError << SERVER_INFO << " has invalid IP address or port!";
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Load an identity from each IDENTITY_EXTENSION file within directory.
+ * Invalid credentials files are reported and skipped. Return false if no identity was loaded.
+ */
+bool CClientRuntime::loadIdentities(const std::string& directory)
+{
+	clearLastError();
+	size_t loaded = 0;
+	for (const std::string& clientInfo : _fileHandler->listFiles(directory, IDENTITY_EXTENSION))
+	{
+		CClientLogic* identity = new CClientLogic(*this, clientInfo);
+		if (!identity->parseClientInfo())
+		{
+			_lastError << "\t" << identity->getLastError() << std::endl;
+			delete identity;
+			continue;
+		}
+		const std::string username = identity->getSelfUsername();
+		if (_identities.find(username) != _identities.end())
+		{
+			_lastError << "\tIdentity " << username << " was loaded already. " << clientInfo << " is skipped." << std::endl;
+			delete identity;
+			continue;
+		}
+		_identities[username] = identity;
+		++loaded;
+	}
+	if (loaded == 0)
+	{
+		_lastError << "No identities were loaded from " << directory;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Register a new identity via the server. Its credentials are stored within directory.
+ */
+CClientLogic* CClientRuntime::registerIdentity(const std::string& directory, const std::string& username)
+{
+	if (_identities.find(username) != _identities.end())
+	{
+		clearLastError();
+		_lastError << "Identity " << username << " exists already.";
+		return nullptr;
+	}
+	CClientLogic* identity = new CClientLogic(*this, directory + "/" + username + IDENTITY_EXTENSION);
+	if (!identity->registerClient(username))
+	{
+		clearLastError();
+		_lastError << identity->getLastError();
+		delete identity;
+		return nullptr;
+	}
+	_identities[username] = identity;
+	return identity;
+}
+
+/**
+ * Find a loaded identity by username. Return nullptr if not loaded.
+ */
+CClientLogic* CClientRuntime::getIdentity(const std::string& username) const
+{
+	const auto itr = _identities.find(username);
+	return (itr == _identities.end()) ? nullptr : itr->second;
+}
+
+/**
+ * Usernames of loaded identities, sorted alphabetically.
+ */
+std::vector<std::string> CClientRuntime::getIdentities() const
+{
+	std::vector<std::string> usernames;
+	usernames.reserve(_identities.size());
+	for (const auto& identity : _identities)
+		usernames.push_back(identity.first);
+	return usernames;
+}
@@ -0,0 +1,74 @@
+/**
+ * MessageU Client
+ * @file CConnectionPool.cpp
+ * @brief Bounded pool of socket handlers sharing one I/O context.
+ * @author Roman Koifman
+ * https://github.com/Romansko/MessageU/blob/main/client/src/CConnectionPool.cpp
+ */
+#include "CConnectionPool.h"
+#include "CSocketHandler.h"
+
+CConnectionPool::CConnectionPool(io_context& ioContext, const size_t maxConnections) :
+	_ioContext(ioContext), _maxConnections(maxConnections == 0 ? 1 : maxConnections), _leased(0)
+{
+}
+
+/**
+ * All leased socket handlers must be released before destruction.
+ */
+CConnectionPool::~CConnectionPool()
+{
+	for (CSocketHandler* socket : _idle)
+		delete socket;
+}
+
+/**
+ * Set server address & port of all socket handlers, leased ones included upon their next lease.
+ */
+bool CConnectionPool::setServerInfo(const std::string& address, const std::string& port)
+{
+	if (!CSocketHandler::isValidAddress(address) || !CSocketHandler::isValidPort(port))
+		return false;
+	std::lock_guard<std::mutex> lock(_mutex);
+	_address = address;
+	_port    = port;
+	return true;
+}
+
+/**
+ * Lease a socket handler. Blocks while maxConnections handlers are leased.
+ */
+CSocketHandler* CConnectionPool::acquire()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	_available.wait(lock, [this]() { return _leased < _maxConnections; });
+	CSocketHandler* socket;
+	if (_idle.empty())
+	{
+		socket = new CSocketHandler(_ioContext);
+	}
+	else
+	{
+		socket = _idle.back();
+		_idle.pop_back();
+	}
+	(void)socket->setSocketInfo(_address, _port);
+	++_leased;
+	return socket;
+}
+
+/**
+ * Return a leased socket handler to the pool. Its connection is closed.
+ */
+void CConnectionPool::release(CSocketHandler* const socket)
+{
+	if (socket == nullptr)
+		return;
+	socket->close();
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_idle.push_back(socket);
+		--_leased;
+	}
+	_available.notify_one();
+}
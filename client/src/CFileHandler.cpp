@@ -7,29 +7,37 @@
  */
 
 #include "CFileHandler.h"
+#include "CLatencyStats.h"
 
 #include <algorithm>
 #include <fstream>
 #include <boost/filesystem.hpp>  // for create_directories
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
 
-CFileHandler::CFileHandler() : _fileStream(nullptr), _open(false)
+CFileHandler::CFileHandler() : _fileStream(nullptr), _open(false), _mapping(nullptr), _region(nullptr)
 {
 }
 
 CFileHandler::~CFileHandler()
 {
 	close();
+	unmap();
 }
 
 
 /**
  * Open a file for read/write. Create folders in filepath if do not exist.
+ * Folders are created once. Successive files of the same folder are just opened.
+ * When writing, append to the end of file instead of truncating it if append is set.
  * Relative paths not supported!
  */
-bool CFileHandler::open(const std::string& filepath, bool write)
+bool CFileHandler::open(const std::string& filepath, bool write, bool append)
 {
-	const auto flags = write ? (std::fstream::binary | std::fstream::out) : (std::fstream::binary | std::fstream::in);
+	auto flags = write ? (std::fstream::binary | std::fstream::out) : (std::fstream::binary | std::fstream::in);
+	if (write && append)
+		flags |= std::fstream::app;
 	if (filepath.empty())
 		return false;
 	
@@ -39,12 +47,20 @@ bool CFileHandler::open(const std::string& filepath, bool write)
 		_fileStream = new std::fstream;
 		// create directories within the path if they are do not exist.
 		const auto parent = boost::filesystem::path(filepath).parent_path();
-		if (!parent.empty())
+		if (!parent.empty() && parent.string() != _folder)
 		{
 			(void)create_directories(parent);
-		}	
+			_folder = parent.string();
+		}
 		_fileStream->open(filepath, flags);
 		_open = _fileStream->is_open();
+		if (!_open && write && !parent.empty())
+		{
+			(void)create_directories(parent);  // folder was removed meanwhile.
+			_fileStream->clear();
+			_fileStream->open(filepath, flags);
+			_open = _fileStream->is_open();
+		}
 	}
 	catch (...)
 	{
@@ -92,6 +108,25 @@ bool CFileHandler::read(uint8_t* const dest, const size_t bytes) const
 }
 
 
+/**
+ * Set read position of fs.
+ */
+bool CFileHandler::seek(const uint64_t offset) const
+{
+	if (_fileStream == nullptr || !_open)
+		return false;
+	try
+	{
+		_fileStream->seekg(static_cast<std::streamoff>(offset), std::fstream::beg);
+		return !_fileStream->fail();
+	}
+	catch (...)
+	{
+		return false;
+	}
+}
+
+
 /**
  * Write given bytes from src to fs.
  */
@@ -99,6 +134,7 @@ bool CFileHandler::write(const uint8_t* const src, const size_t bytes) const
 {
 	if (_fileStream == nullptr || !_open || src == nullptr || bytes == 0)
 		return false;
+	CLatencyStats::CTimer timer(PHASE_DISK_WRITE);
 	try
 	{
 		_fileStream->write(reinterpret_cast<const char*>(src), bytes);
@@ -127,6 +163,23 @@ bool CFileHandler::remove(const std::string& filePath) const
 }
 
 
+/**
+ * Rename a file. Replaces an existing destination file.
+ */
+bool CFileHandler::rename(const std::string& from, const std::string& to) const
+{
+	try
+	{
+		boost::filesystem::rename(from, to);
+		return true;
+	}
+	catch (...)
+	{
+		return false;
+	}
+}
+
+
 /**
  * Read a single line from fs to line.
  */
@@ -160,7 +213,7 @@ bool CFileHandler::writeLine(const std::string& line) const
 /**
  * Calculate the file size which is opened by fs.
  */
-size_t CFileHandler::size() const
+uint64_t CFileHandler::size() const
 {
 	if (_fileStream == nullptr || !_open)
 		return 0;
@@ -169,10 +222,10 @@ size_t CFileHandler::size() const
 		const auto cur = _fileStream->tellg();
 		_fileStream->seekg(0, std::fstream::end);
 		const auto size = _fileStream->tellg();
-		if ((size <= 0) || (size > UINT32_MAX))    // do not support more than uint32 max size files. (up to 4GB).
+		if (size <= 0)
 			return 0;
 		_fileStream->seekg(cur);    // restore position
-		return static_cast<size_t>(size);
+		return static_cast<uint64_t>(size);
 	}
 	catch (...)
 	{
@@ -181,7 +234,47 @@ size_t CFileHandler::size() const
 }
 
 /**
- * Open and read file.
+ * Get file's size and last modification time without opening it.
+ */
+bool CFileHandler::fileInfo(const std::string& filepath, uint64_t& bytes, std::time_t& lastWrite) const
+{
+	try
+	{
+		bytes     = boost::filesystem::file_size(filepath);
+		lastWrite = boost::filesystem::last_write_time(filepath);
+		return true;
+	}
+	catch (...)
+	{
+		return false;
+	}
+}
+
+/**
+ * List regular files with given extension within directory, sorted by path.
+ * Return an empty list if directory doesn't exist.
+ */
+std::vector<std::string> CFileHandler::listFiles(const std::string& directory, const std::string& extension) const
+{
+	std::vector<std::string> files;
+	try
+	{
+		for (const auto& entry : boost::filesystem::directory_iterator(directory))
+		{
+			if (boost::filesystem::is_regular_file(entry.path()) && (entry.path().extension().string() == extension))
+				files.push_back(entry.path().string());
+		}
+	}
+	catch (...)
+	{
+		files.clear();
+	}
+	std::sort(files.begin(), files.end());
+	return files;
+}
+
+/**
+ * Open and read file. Files which don't fit in memory are not read. Map them instead.
  * Caller is responsible for freeing allocated memory upon success.
  */
 bool CFileHandler::readAtOnce(const std::string& filepath, uint8_t*& file, size_t& bytes)
@@ -189,9 +282,13 @@ bool CFileHandler::readAtOnce(const std::string& filepath, uint8_t*& file, size_
 	if (!open(filepath))
 		return false;
 	
-	bytes = size();
-	if (bytes == 0)
+	const uint64_t fileSize = size();
+	if (fileSize == 0 || fileSize > SIZE_MAX)
+	{
+		close();
 		return false;
+	}
+	bytes = static_cast<size_t>(fileSize);
 
 	file = new uint8_t[bytes];
 	const bool success = read(file, bytes);
@@ -216,6 +313,46 @@ bool CFileHandler::writeAtOnce(const std::string& filepath, const std::string& d
 	return success;
 }
 
+/**
+ * Map a file read only. file is valid until unmap(), next mapAtOnce() or destruction.
+ * Pages are read from the page cache upon access, hence no copy of the file is allocated.
+ * The mapping is advised to be read sequentially. Files larger than the address space are not mapped.
+ */
+bool CFileHandler::mapAtOnce(const std::string& filepath, const uint8_t*& file, size_t& bytes)
+{
+	unmap();
+	try
+	{
+		_mapping = new boost::interprocess::file_mapping(filepath.c_str(), boost::interprocess::read_only);
+		_region  = new boost::interprocess::mapped_region(*_mapping, boost::interprocess::read_only);
+	}
+	catch (...)
+	{
+		unmap();  // file doesn't exist or is empty.
+		return false;
+	}
+	bytes = _region->get_size();
+	if (bytes == 0)
+	{
+		unmap();
+		return false;
+	}
+	(void)_region->advise(boost::interprocess::mapped_region::advice_sequential);  // a hint. Not supported everywhere.
+	file = static_cast<const uint8_t*>(_region->get_address());
+	return true;
+}
+
+/**
+ * Release the mapped file.
+ */
+void CFileHandler::unmap()
+{
+	delete _region;
+	delete _mapping;
+	_region  = nullptr;
+	_mapping = nullptr;
+}
+
 /**
  * Returns absolute path to %TMP% folder.
  */
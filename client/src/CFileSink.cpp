@@ -0,0 +1,64 @@
+/**
+ * MessageU Client
+ * @file CFileSink.cpp
+ * @brief Writes files on a background thread, so producers continue while files are written.
+ * @author Roman Koifman
+ * https://github.com/Romansko/MessageU/blob/main/client/src/CFileSink.cpp
+ */
+#include "CFileSink.h"
+#include "CFileHandler.h"
+
+CFileSink::CFileSink() : _fileHandler(new CFileHandler()), _stop(false)
+{
+	_writer = std::thread(&CFileSink::writeLoop, this);
+}
+
+/**
+ * Queued files are written before the writer is joined.
+ */
+CFileSink::~CFileSink()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stop = true;
+	}
+	_condition.notify_all();
+	if (_writer.joinable())
+		_writer.join();
+	delete _fileHandler;
+}
+
+std::future<bool> CFileSink::write(const std::string& filepath, std::string&& data)
+{
+	SFile file;
+	file.filepath = filepath;
+	file.data     = std::move(data);
+	std::future<bool> written = file.written.get_future();
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_files.push_back(std::move(file));
+	}
+	_condition.notify_one();
+	return written;
+}
+
+/**
+ * Writer's loop. Pop & write files until sink is stopped and queue is empty.
+ * The file handler creates a folder once, hence files of the same folder are just opened & written.
+ */
+void CFileSink::writeLoop()
+{
+	for (;;)
+	{
+		SFile file;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_condition.wait(lock, [this]() { return _stop || !_files.empty(); });
+			if (_stop && _files.empty())
+				return;
+			file = std::move(_files.front());
+			_files.pop_front();
+		}
+		file.written.set_value(_fileHandler->writeAtOnce(file.filepath, file.data));
+	}
+}
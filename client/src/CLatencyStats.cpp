@@ -0,0 +1,256 @@
+/**
+ * MessageU Client
+ * @file CLatencyStats.cpp
+ * @brief Latency histograms of request phases, per request code.
+ * @author Roman Koifman
+ * https://github.com/Romansko/MessageU/blob/main/client/src/CLatencyStats.cpp
+ */
+#include "CLatencyStats.h"
+#include "CFileHandler.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+std::atomic<bool>         CLatencyStats::_enabled(false);
+CLatencyStats::SHistogram CLatencyStats::_histograms[LATENCY_CODES][PHASE_COUNT];
+
+namespace
+{
+	thread_local code_t requestCode = DEF_VAL;  // request which the calling thread is handling.
+
+	// periodic dump.
+	std::thread             dumper;
+	std::mutex              dumpMutex;
+	std::condition_variable dumpStopped;
+	bool                    stopDumping = false;
+	bool                    stopAtExit  = false;  // dumper must be joined before static destruction.
+}
+
+CLatencyStats::CRequest::CRequest(const code_t code) : _outer(DEF_VAL), _active(enabled())
+{
+	if (!_active)
+		return;
+	_outer      = requestCode;
+	requestCode = code;
+	_start      = clock_t::now();
+}
+
+CLatencyStats::CRequest::~CRequest()
+{
+	if (!_active)
+		return;
+	record(requestCode, PHASE_REQUEST, clock_t::now() - _start);
+	requestCode = _outer;
+}
+
+code_t CLatencyStats::currentCode()
+{
+	return requestCode;
+}
+
+/**
+ * Histograms slot of a request code. Unknown codes share the last slot.
+ */
+size_t CLatencyStats::slot(const code_t code)
+{
+	if (code >= REQUEST_REGISTRATION && code < REQUEST_REGISTRATION + REQUEST_OPTIONS)
+		return code - REQUEST_REGISTRATION;
+	return LATENCY_CODES - 1;
+}
+
+/**
+ * Add a duration to the histogram of code & phase. Lock free.
+ */
+void CLatencyStats::record(const code_t code, const ELatencyPhase phase, const clock_t::duration elapsed)
+{
+	if (phase >= PHASE_COUNT)
+		return;
+	const uint64_t us = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+	size_t bucket = 0;
+	for (uint64_t value = us; value != 0 && bucket < LATENCY_BUCKETS - 1; value >>= 1)
+		++bucket;
+
+	SHistogram& histogram = _histograms[slot(code)][phase];
+	histogram.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+	histogram.count.fetch_add(1, std::memory_order_relaxed);
+	histogram.totalUs.fetch_add(us, std::memory_order_relaxed);
+	uint64_t max = histogram.maxUs.load(std::memory_order_relaxed);
+	while (us > max && !histogram.maxUs.compare_exchange_weak(max, us, std::memory_order_relaxed)) {}
+}
+
+void CLatencyStats::reset()
+{
+	for (auto& phases : _histograms)
+	{
+		for (auto& histogram : phases)
+		{
+			for (auto& bucket : histogram.buckets)
+				bucket.store(0, std::memory_order_relaxed);
+			histogram.count.store(0, std::memory_order_relaxed);
+			histogram.totalUs.store(0, std::memory_order_relaxed);
+			histogram.maxUs.store(0, std::memory_order_relaxed);
+		}
+	}
+}
+
+/**
+ * Summarize a histogram. Recording concurrently may skew a summary slightly.
+ */
+SLatencySummary CLatencyStats::summary(const code_t code, const ELatencyPhase phase)
+{
+	SLatencySummary result;
+	if (phase >= PHASE_COUNT)
+		return result;
+	const SHistogram& histogram = _histograms[slot(code)][phase];
+	uint64_t counts[LATENCY_BUCKETS];
+	for (size_t i = 0; i < LATENCY_BUCKETS; ++i)
+	{
+		counts[i] = histogram.buckets[i].load(std::memory_order_relaxed);
+		result.count += counts[i];
+	}
+	result.totalUs = histogram.totalUs.load(std::memory_order_relaxed);
+	result.maxUs   = histogram.maxUs.load(std::memory_order_relaxed);
+	if (result.count == 0)
+		return result;
+
+	const uint64_t ranks[] = { (result.count * 50 + 99) / 100, (result.count * 90 + 99) / 100, (result.count * 99 + 99) / 100 };
+	uint64_t* const percentiles[] = { &result.p50Us, &result.p90Us, &result.p99Us };
+	for (size_t p = 0; p < 3; ++p)
+	{
+		uint64_t seen = 0;
+		for (size_t i = 0; i < LATENCY_BUCKETS; ++i)
+		{
+			seen += counts[i];
+			if (seen >= ranks[p])
+			{
+				const uint64_t upperBound = (i == 0) ? 0 : (static_cast<uint64_t>(1) << i) - 1;
+				*percentiles[p] = std::min(upperBound, result.maxUs);
+				break;
+			}
+		}
+	}
+	return result;
+}
+
+const char* CLatencyStats::phaseName(const ELatencyPhase phase)
+{
+	static const char* names[PHASE_COUNT] = {
+		"connect", "serialize", "encrypt", "decrypt", "send", "first_byte", "receive", "disk_write", "request"
+	};
+	return (phase < PHASE_COUNT) ? names[phase] : "unknown";
+}
+
+/**
+ * Table of non empty histograms. Durations in microseconds.
+ */
+void CLatencyStats::dumpText(std::ostream& os)
+{
+	os << std::left << std::setw(6) << "code" << std::setw(12) << "phase" << std::right
+		<< std::setw(10) << "count" << std::setw(12) << "mean" << std::setw(12) << "p50"
+		<< std::setw(12) << "p90" << std::setw(12) << "p99" << std::setw(12) << "max" << std::endl;
+	for (size_t s = 0; s < LATENCY_CODES; ++s)
+	{
+		const code_t code = (s == LATENCY_CODES - 1) ? DEF_VAL : static_cast<code_t>(REQUEST_REGISTRATION + s);
+		for (size_t p = 0; p < PHASE_COUNT; ++p)
+		{
+			const auto phase = static_cast<ELatencyPhase>(p);
+			const SLatencySummary stats = summary(code, phase);
+			if (stats.count == 0)
+				continue;
+			os << std::left << std::setw(6) << ((code == DEF_VAL) ? std::string("-") : std::to_string(code))
+				<< std::setw(12) << phaseName(phase) << std::right << std::setw(10) << stats.count
+				<< std::setw(12) << (stats.totalUs / stats.count) << std::setw(12) << stats.p50Us
+				<< std::setw(12) << stats.p90Us << std::setw(12) << stats.p99Us << std::setw(12) << stats.maxUs << std::endl;
+		}
+	}
+}
+
+/**
+ * Non empty histograms as JSON: { "<code>": { "<phase>": { "count": .., .. } } }. Durations in microseconds.
+ * Phases outside of a request are listed under code "0".
+ */
+void CLatencyStats::dumpJson(std::ostream& os)
+{
+	os << "{";
+	bool firstCode = true;
+	for (size_t s = 0; s < LATENCY_CODES; ++s)
+	{
+		const code_t code = (s == LATENCY_CODES - 1) ? DEF_VAL : static_cast<code_t>(REQUEST_REGISTRATION + s);
+		bool firstPhase = true;
+		for (size_t p = 0; p < PHASE_COUNT; ++p)
+		{
+			const auto phase = static_cast<ELatencyPhase>(p);
+			const SLatencySummary stats = summary(code, phase);
+			if (stats.count == 0)
+				continue;
+			if (firstPhase)
+			{
+				os << (firstCode ? "" : ",") << "\"" << code << "\":{";
+				firstCode = false;
+			}
+			os << (firstPhase ? "" : ",") << "\"" << phaseName(phase) << "\":{\"count\":" << stats.count
+				<< ",\"total_us\":" << stats.totalUs << ",\"p50_us\":" << stats.p50Us << ",\"p90_us\":" << stats.p90Us
+				<< ",\"p99_us\":" << stats.p99Us << ",\"max_us\":" << stats.maxUs << "}";
+			firstPhase = false;
+		}
+		if (!firstPhase)
+			os << "}";
+	}
+	os << "}" << std::endl;
+}
+
+/**
+ * Enable stats and rewrite filepath every intervalSeconds, and upon stopDump().
+ * JSON is dumped if filepath ends with ".json", a table otherwise. Return false if a dump is already running.
+ * Dump is stopped upon exit().
+ */
+bool CLatencyStats::startDump(const std::string& filepath, const uint32_t intervalSeconds)
+{
+	std::lock_guard<std::mutex> lock(dumpMutex);
+	if (dumper.joinable() || filepath.empty() || intervalSeconds == 0)
+		return false;
+	stopDumping = false;
+	if (!stopAtExit)
+		stopAtExit = (std::atexit([]() { stopDump(); }) == 0);
+	enable(true);
+	dumper = std::thread(&CLatencyStats::dumpLoop, filepath, intervalSeconds);
+	return true;
+}
+
+void CLatencyStats::stopDump()
+{
+	std::thread stopped;
+	{
+		std::lock_guard<std::mutex> lock(dumpMutex);
+		stopDumping = true;
+		stopped.swap(dumper);
+	}
+	dumpStopped.notify_all();
+	if (stopped.joinable())
+		stopped.join();
+}
+
+void CLatencyStats::dumpLoop(const std::string filepath, const uint32_t intervalSeconds)
+{
+	const std::string json = ".json";
+	const bool asJson = (filepath.size() >= json.size()) && (filepath.compare(filepath.size() - json.size(), json.size(), json) == 0);
+	CFileHandler fileHandler;
+	bool stop = false;
+	while (!stop)
+	{
+		{
+			std::unique_lock<std::mutex> lock(dumpMutex);
+			stop = dumpStopped.wait_for(lock, std::chrono::seconds(intervalSeconds), []() { return stopDumping; });
+		}
+		std::stringstream dump;
+		if (asJson)
+			dumpJson(dump);
+		else
+			dumpText(dump);
+		(void)fileHandler.writeAtOnce(filepath, dump.str());
+	}
+}
@@ -7,19 +7,19 @@
  */
 
 #include "CSocketHandler.h"
+#include "CLatencyStats.h"
+#include <cstring>
 #include <boost/asio.hpp>
 
 using boost::asio::ip::tcp;
 using boost::asio::io_context;
 
-CSocketHandler::CSocketHandler() : _ioContext(nullptr), _resolver(nullptr), _socket(nullptr), _connected(false)
+CSocketHandler::CSocketHandler() : _ioContext(nullptr), _resolver(nullptr), _socket(nullptr), _ownsContext(true), _connected(false), _awaitingResponse(false)
+{
+}
+
+CSocketHandler::CSocketHandler(io_context& ioContext) : _ioContext(&ioContext), _resolver(nullptr), _socket(nullptr), _ownsContext(false), _connected(false), _awaitingResponse(false)
 {
-	union   // Test for endianness
-	{
-		uint32_t i;
-		uint8_t c[sizeof(uint32_t)];
-	}tester{ 1 };
-	_bigEndian = (tester.c[0] == 0);
 }
 
 CSocketHandler::~CSocketHandler()
@@ -83,10 +83,12 @@ bool CSocketHandler::connect()
 {
 	if (!isValidAddress(_address) || !isValidPort(_port))
 		return false;
+	CLatencyStats::CTimer timer(PHASE_CONNECT);
 	try
 	{
 		close();  // close & clear current socket before new allocations.
-		_ioContext = new io_context;
+		if (_ownsContext)
+			_ioContext = new io_context;
 		_resolver  = new tcp::resolver(*_ioContext);
 		_socket    = new tcp::socket(*_ioContext);
 		boost::asio::connect(*_socket, _resolver->resolve(_address, _port, tcp::resolver::query::canonical_name));
@@ -111,13 +113,17 @@ void CSocketHandler::close()
 			_socket->close();
 	}
 	catch (...) {} // Do Nothing
-	delete _ioContext;
+	if (_ownsContext)
+	{
+		delete _ioContext;
+		_ioContext = nullptr;
+	}
 	delete _resolver;
 	delete _socket;
-	_ioContext = nullptr;
 	_resolver  = nullptr;
 	_socket    = nullptr;
 	_connected = false;
+	_awaitingResponse = false;
 }
 
 
@@ -130,6 +136,7 @@ bool CSocketHandler::receive(uint8_t* const buffer, const size_t size) const
 	if (_socket == nullptr || !_connected || buffer == nullptr || size == 0)
 		return false;
 	
+	CLatencyStats::CTimer timer(PHASE_RECEIVE);
 	size_t bytesLeft = size;
 	uint8_t* ptr     = buffer;
 	while (bytesLeft > 0)
@@ -140,12 +147,12 @@ bool CSocketHandler::receive(uint8_t* const buffer, const size_t size) const
 		size_t bytesRead = read(*_socket, boost::asio::buffer(tempBuffer, PACKET_SIZE), errorCode);
 		if (bytesRead == 0)
 			return false;     // Error. Failed receiving and shouldn't use buffer.
-
-		if (_bigEndian)  // It's required to convert from little endian to big endian.
+		if (_awaitingResponse)
 		{
-			swapBytes(tempBuffer, bytesRead);   
+			_awaitingResponse = false;
+			CLatencyStats::record(CLatencyStats::currentCode(), PHASE_FIRST_BYTE, CLatencyStats::clock_t::now() - _sentAt);
 		}
-		
+
 		const size_t bytesToCopy = (bytesLeft > bytesRead) ? bytesRead : bytesLeft;  // prevent buffer overflow.
 		memcpy(ptr, tempBuffer, bytesToCopy);
 		ptr       += bytesToCopy;
@@ -164,6 +171,7 @@ bool CSocketHandler::send(const uint8_t* const buffer, const size_t size) const
 	if (_socket == nullptr || !_connected || buffer == nullptr || size == 0)
 		return false;
 	
+	CLatencyStats::CTimer timer(PHASE_SEND);
 	size_t bytesLeft   = size;
 	const uint8_t* ptr = buffer;
 	while (bytesLeft > 0)
@@ -174,11 +182,6 @@ bool CSocketHandler::send(const uint8_t* const buffer, const size_t size) const
 		
 		memcpy(tempBuffer, ptr, bytesToSend);
 
-		if (_bigEndian)  // It's required to convert from big endian to little endian.
-		{
-			swapBytes(tempBuffer, bytesToSend);
-		}
-
 		const size_t bytesWritten = write(*_socket, boost::asio::buffer(tempBuffer, PACKET_SIZE), errorCode);
 		if (bytesWritten == 0)
 			return false;
@@ -186,6 +189,10 @@ bool CSocketHandler::send(const uint8_t* const buffer, const size_t size) const
 		ptr += bytesWritten;
 		bytesLeft = (bytesLeft < bytesWritten) ? 0 : (bytesLeft - bytesWritten);  // unsigned protection.
 	}
+	timer.stop();
+	_awaitingResponse = CLatencyStats::enabled();
+	if (_awaitingResponse)
+		_sentAt = CLatencyStats::clock_t::now();
 	return true;
 }
 
@@ -212,24 +219,3 @@ bool CSocketHandler::sendReceive(const uint8_t* const toSend, const size_t size,
 	close();
 	return true;
 }
-
-/**
- * Handle Endianness.
- */
-void CSocketHandler::swapBytes(uint8_t* const buffer, size_t size) const
-{
-	if (buffer == nullptr || size < sizeof(uint32_t))
-		return; 
-
-	size -= (size % sizeof(uint32_t));
-	uint32_t* const ptr = reinterpret_cast<uint32_t* const>(buffer);
-	for (size_t i = 0; i < size; ++i)
-	{
-		const uint32_t tmp = ((buffer[i] << 8) & 0xFF00FF00) | ((buffer[i] >> 8) & 0xFF00FF);
-		buffer[i] = (tmp << 16) | (tmp >> 16);
-	}
-		
-}
-
-
-
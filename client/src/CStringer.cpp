@@ -6,9 +6,12 @@
   */
 #include "CStringer.h"
 #include <base64.h>
+#include <zdeflate.h>
+#include <zinflate.h>
 #include <boost/algorithm/hex.hpp>
 #include <boost/algorithm/string/trim.hpp>
 #include <chrono>
+#include <stdexcept>
 
  std::string CStringer::encodeBase64(const std::string& str)
 {
@@ -82,6 +85,57 @@ void CStringer::trim(std::string& stringToTrim)
  	boost::algorithm::trim(stringToTrim);
  }
 
+/**
+ * Compress bytes with Deflate (RFC 1951) using Crypto++.
+ * Fastest level is used since compression is on the send path.
+ */
+std::string CStringer::compress(const uint8_t* buffer, const size_t size)
+{
+	std::string compressed;
+	CryptoPP::Deflator deflator(new CryptoPP::StringSink(compressed), CryptoPP::Deflator::MIN_DEFLATE_LEVEL + 1);
+	deflator.Put(buffer, size);
+	deflator.MessageEnd();
+	return compressed;
+}
+
+namespace
+{
+	/**
+	 * StringSink which throws once more than maxSize bytes are put.
+	 * Inflator outputs as it goes, hence a decompression bomb is stopped at maxSize.
+	 */
+	class CBoundedStringSink : public CryptoPP::Bufferless<CryptoPP::Sink>
+	{
+	public:
+		CBoundedStringSink(std::string& output, const size_t maxSize) : _output(output), _maxSize(maxSize) {}
+
+		size_t Put2(const CryptoPP::byte* inString, size_t length, int /*messageEnd*/, bool /*blocking*/) override
+		{
+			if (length > _maxSize - _output.size())
+				throw std::length_error("Decompressed size exceeds limit");
+			_output.append(reinterpret_cast<const char*>(inString), length);
+			return 0;
+		}
+
+	private:
+		std::string& _output;
+		const size_t _maxSize;
+	};
+}
+
+/**
+ * Decompress Deflate (RFC 1951) bytes using Crypto++.
+ * Throws upon corrupted data, or when decompressed data exceeds maxSize bytes.
+ */
+std::string CStringer::decompress(const uint8_t* buffer, const size_t size, const size_t maxSize)
+{
+	std::string decompressed;
+	CryptoPP::Inflator inflator(new CBoundedStringSink(decompressed, maxSize));
+	inflator.Put(buffer, size);
+	inflator.MessageEnd();
+	return decompressed;
+}
+
 /**
  * Return current timestamp as sting.
  */
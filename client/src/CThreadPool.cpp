@@ -0,0 +1,54 @@
+/**
+ * MessageU Client
+ * @file CThreadPool.cpp
+ * @brief Fixed size pool of worker threads. Used for CPU bound work such as chunks encryption.
+ * @author Roman Koifman
+ * https://github.com/Romansko/MessageU/blob/main/client/src/CThreadPool.cpp
+ */
+#include "CThreadPool.h"
+
+CThreadPool::CThreadPool(size_t threads) : _stop(false)
+{
+	if (threads == 0)
+		threads = 1;  // hardware_concurrency() may return 0 when not computable.
+	_workers.reserve(threads);
+	for (size_t i = 0; i < threads; ++i)
+		_workers.emplace_back(&CThreadPool::work, this);
+}
+
+/**
+ * Queued tasks are completed before workers are joined.
+ */
+CThreadPool::~CThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stop = true;
+	}
+	_condition.notify_all();
+	for (auto& worker : _workers)
+	{
+		if (worker.joinable())
+			worker.join();
+	}
+}
+
+/**
+ * Worker's loop. Pop & run tasks until pool is stopped and queue is empty.
+ */
+void CThreadPool::work()
+{
+	for (;;)
+	{
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_condition.wait(lock, [this]() { return _stop || !_tasks.empty(); });
+			if (_stop && _tasks.empty())
+				return;
+			task = std::move(_tasks.front());
+			_tasks.pop();
+		}
+		task();  // packaged_task stores exceptions within its future.
+	}
+}
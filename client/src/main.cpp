@@ -6,14 +6,22 @@
  * Multi-threaded Debug (/MTd).
  * Boost Library 1.77.0 (static linkage)
  * Crypto++ Library 8.5 (static linkage).
+ * Linux: built with CMake, see client/CMakeLists.txt.
  * For more info, please refer to https://github.com/Romansko/MessageU#readme
  * @author Roman Koifman
  * https://github.com/Romansko/MessageU/blob/main/client/src/main.cpp
  */
 #include "CClientMenu.h"
+#include "CLatencyStats.h"
+
+constexpr uint32_t LATENCY_DUMP_INTERVAL = 10;  // seconds.
 
 int main(int argc, char* argv[])
 {
+	// "--latency <file>" enables latency stats, dumped to file periodically. As JSON if file ends with ".json".
+	if ((argc == 3) && (std::string(argv[1]) == "--latency"))
+		(void)CLatencyStats::startDump(argv[2], LATENCY_DUMP_INTERVAL);
+
 	CClientMenu menu;
 	menu.initialize();
 	
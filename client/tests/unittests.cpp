@@ -0,0 +1,224 @@
+/**
+ * MessageU Client
+ * @file unittests.cpp
+ * @brief Unit tests of the client's core: wire codec, symmetric & asymmetric encryption, compression, keys and received files.
+ * Usage: messageu_tests. Prints failed checks. Returns non zero upon failure. No server is required.
+ * @author Roman Koifman
+ * https://github.com/Romansko/MessageU/blob/main/client/tests/unittests.cpp
+ */
+#include "AESWrapper.h"
+#include "RSAWrapper.h"
+#include "CClientLogic.h"
+#include "CFileHandler.h"
+#include "CFileSink.h"
+#include "CStringer.h"
+#include "wire.h"
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+	size_t checks   = 0;
+	size_t failures = 0;
+
+	void check(const bool passed, const std::string& what)
+	{
+		++checks;
+		if (passed)
+			return;
+		++failures;
+		std::cerr << "FAILED: " << what << std::endl;
+	}
+
+	/**
+	 * Return whether op throws.
+	 */
+	bool throws(const std::function<void()>& op)
+	{
+		try
+		{
+			op();
+		}
+		catch (...)
+		{
+			return true;
+		}
+		return false;
+	}
+
+	const uint8_t* bytes(const std::string& str)
+	{
+		return reinterpret_cast<const uint8_t*>(str.c_str());
+	}
+
+	void testWire()
+	{
+		SClientID id;
+		for (size_t i = 0; i < sizeof(id.uuid); ++i)
+			id.uuid[i] = static_cast<uint8_t>(i + 1);
+
+		SRequestSendMessage request(id, MSG_TEXT);
+		request.header.payloadSize        = 0x01020304;
+		request.payloadHeader.contentSize = 0x0A0B0C0D;
+		uint8_t buffer[SWire<SRequestSendMessage>::size];
+		check(wireEncode(request, buffer, sizeof(buffer)), "wire encodes a request");
+		check(!wireEncode(request, buffer, sizeof(buffer) - 1), "wire refuses encoding into a short buffer");
+		const uint8_t payloadSize[] = { 0x04, 0x03, 0x02, 0x01 };
+		check(memcmp(buffer + SWire<SClientID>::size + sizeof(version_t) + sizeof(code_t), payloadSize, sizeof(payloadSize)) == 0,
+			"wire integers are little endian");
+
+		SRequestSendMessage decoded(SClientID(), MSG_FILE);
+		check(wireDecode(decoded, buffer, sizeof(buffer)), "wire decodes a request");
+		check(decoded.header.clientId == id, "wire round trips client ID");
+		check(decoded.header.payloadSize == 0x01020304u, "wire round trips payload size");
+		check(decoded.payloadHeader.messageType == MSG_TEXT, "wire round trips message type");
+		check(decoded.payloadHeader.contentSize == 0x0A0B0C0Du, "wire round trips content size");
+		check(!wireDecode(decoded, buffer, sizeof(buffer) - 1), "wire refuses decoding a short buffer");
+
+		// pending messages payload: message header followed by its content.
+		SPendingMessage message;
+		message.clientId    = id;
+		message.messageId   = 42;
+		message.messageType = MSG_TEXT;
+		message.messageSize = 5;
+		std::string payload(SWire<SPendingMessage>::size, '\0');
+		(void)wireEncode(message, reinterpret_cast<uint8_t*>(&payload[0]), payload.size());
+		payload += "hello";
+		CWireReader reader(bytes(payload), payload.size());
+		const SPendingMessage* const view = reader.view<SPendingMessage>();
+		check(view != nullptr && view->messageId == 42u && view->messageSize == 5u, "wire views a message in place");
+		const uint8_t* const content = reader.take(5);
+		check(content != nullptr && memcmp(content, "hello", 5) == 0 && reader.empty(), "wire reader takes content");
+		check(reader.take(1) == nullptr && reader.view<SPendingMessage>() == nullptr, "wire reader refuses reading past its end");
+
+		CWireReader truncated(bytes(payload), SWire<SPendingMessage>::size - 1);
+		SPendingMessage partial;
+		check(!truncated.read(partial), "wire reader refuses a truncated struct");
+	}
+
+	void testSymmetric()
+	{
+		const AESWrapper aes;
+		const std::string plain = "MessageU symmetric encryption";
+
+		check(aes.decrypt(bytes(aes.encrypt(plain)), aes.encrypt(plain).size()) == plain, "aes-cbc round trips");
+		const std::string empty = aes.encrypt(std::string());
+		check(aes.decrypt(bytes(empty), empty.size()).empty(), "aes-cbc round trips empty plain");
+
+		const std::string sealed = aes.encryptAEAD(bytes(plain), plain.size());
+		check(sealed.size() == plain.size() + AEAD_NONCE_SIZE + AEAD_TAG_SIZE, "aes-gcm appends nonce & tag");
+		check(aes.decryptAEAD(bytes(sealed), sealed.size()) == plain, "aes-gcm round trips");
+		check(aes.encryptAEAD(bytes(plain), plain.size()) != sealed, "aes-gcm uses a fresh nonce per message");
+
+		const size_t offsets[] = { 0, AEAD_NONCE_SIZE, sealed.size() - 1 };  // nonce, ciphertext & tag.
+		for (const size_t offset : offsets)
+		{
+			std::string tampered = sealed;
+			tampered[offset] ^= 0x01;
+			check(throws([&]() { (void)aes.decryptAEAD(bytes(tampered), tampered.size()); }),
+				"aes-gcm rejects a tampered byte at " + std::to_string(offset));
+		}
+		check(throws([&]() { (void)aes.decryptAEAD(bytes(sealed), sealed.size() - 1); }), "aes-gcm rejects a truncated cipher");
+		check(throws([&]() { (void)aes.decryptAEAD(bytes(sealed), AEAD_NONCE_SIZE); }), "aes-gcm rejects a cipher shorter than its tag");
+
+		const AESWrapper other;
+		check(throws([&]() { (void)other.decryptAEAD(bytes(sealed), sealed.size()); }), "aes-gcm rejects another key");
+
+		const SChunkAAD aad(7, true);
+		const SChunkAAD otherAad(7, false);
+		const uint8_t* const associated = reinterpret_cast<const uint8_t*>(&aad);
+		const std::string bound = aes.encryptAEAD(bytes(plain), plain.size(), associated, SWire<SChunkAAD>::size);
+		check(aes.decryptAEAD(bytes(bound), bound.size(), associated, SWire<SChunkAAD>::size) == plain, "aes-gcm round trips with aad");
+		check(throws([&]() { (void)aes.decryptAEAD(bytes(bound), bound.size(), reinterpret_cast<const uint8_t*>(&otherAad), SWire<SChunkAAD>::size); }),
+			"aes-gcm rejects another aad");
+		check(throws([&]() { (void)aes.decryptAEAD(bytes(bound), bound.size()); }), "aes-gcm rejects a missing aad");
+	}
+
+	void testCompression()
+	{
+		std::string plain;
+		for (size_t i = 0; plain.size() < FILE_CHUNK_SIZE; ++i)
+			plain += "line " + std::to_string(i % 100) + " of a compressible file\n";
+		const std::string compressed = CStringer::compress(bytes(plain), plain.size());
+		check(compressed.size() < plain.size(), "compression shrinks compressible content");
+		check(CStringer::decompress(bytes(compressed), compressed.size(), plain.size()) == plain, "compression round trips");
+		check(throws([&]() { (void)CStringer::decompress(bytes(compressed), compressed.size(), plain.size() - 1); }),
+			"decompression is bounded");
+
+		std::string corrupted = compressed;
+		corrupted.resize(corrupted.size() / 2);
+		check(throws([&]() { (void)CStringer::decompress(bytes(corrupted), corrupted.size(), plain.size()); }),
+			"decompression rejects truncated content");
+	}
+
+	void testKeys()
+	{
+		// unittests.md: Different clients should have different keys.
+		RSAPrivateWrapper first;
+		RSAPrivateWrapper second;
+		check(first.getPublicKey() != second.getPublicKey(), "clients have different public keys");
+		check(first.getPrivateKey() != second.getPrivateKey(), "clients have different private keys");
+		check(first.getPublicKey().size() == PUBLIC_KEY_SIZE, "public key is of protocol size");
+
+		const AESWrapper firstAes;
+		const AESWrapper secondAes;
+		check(memcmp(firstAes.getKey().symmetricKey, secondAes.getKey().symmetricKey, SYMMETRIC_KEY_SIZE) != 0,
+			"clients have different symmetric keys");
+
+		// symmetric key is wrapped by the recipient's public key.
+		SPublicKey publicKey;
+		const std::string encodedKey = first.getPublicKey();
+		memcpy(publicKey.publicKey, encodedKey.c_str(), std::min(encodedKey.size(), sizeof(publicKey.publicKey)));
+		RSAPublicWrapper rsaPublic(publicKey);
+		const SSymmetricKey key = firstAes.getKey();
+		const std::string wrapped = rsaPublic.encrypt(key.symmetricKey, sizeof(key.symmetricKey));
+		const std::string unwrapped = first.decrypt(bytes(wrapped), wrapped.size());
+		check(unwrapped.size() == SYMMETRIC_KEY_SIZE && memcmp(unwrapped.c_str(), key.symmetricKey, SYMMETRIC_KEY_SIZE) == 0,
+			"rsa round trips a symmetric key");
+		check(throws([&]() { (void)second.decrypt(bytes(wrapped), wrapped.size()); }) || second.decrypt(bytes(wrapped), wrapped.size()) != unwrapped,
+			"rsa unwraps by the recipient's key only");
+	}
+
+	void testReceivedFiles()
+	{
+		// files of a single pending messages batch are named within the same millisecond.
+		const std::string firstPath  = CClientLogic::receivedFilePath("unittests");
+		const std::string secondPath = CClientLogic::receivedFilePath("unittests");
+		check(firstPath != secondPath, "files received from the same sender get distinct paths");
+
+		CFileSink fileSink;
+		std::future<bool> first  = fileSink.write(firstPath, std::string("first file"));
+		std::future<bool> second = fileSink.write(secondPath, std::string("second file"));
+		check(first.get() && second.get(), "received files are written");
+
+		CFileHandler fileHandler;
+		const std::string paths[]    = { firstPath, secondPath };
+		const std::string contents[] = { "first file", "second file" };
+		for (size_t i = 0; i < 2; ++i)
+		{
+			uint8_t* file  = nullptr;
+			size_t   size  = 0;
+			const bool read = fileHandler.readAtOnce(paths[i], file, size);
+			check(read && std::string(reinterpret_cast<const char*>(file), size) == contents[i],
+				"received file #" + std::to_string(i + 1) + " keeps its own content");
+			delete[] file;
+			(void)fileHandler.remove(paths[i]);
+		}
+	}
+}
+
+int main()
+{
+	testWire();
+	testSymmetric();
+	testCompression();
+	testKeys();
+	testReceivedFiles();
+	std::cout << (checks - failures) << "/" << checks << " checks passed." << std::endl;
+	return failures == 0 ? 0 : 1;
+}
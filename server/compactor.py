@@ -0,0 +1,93 @@
+"""
+MessageU Server
+compactor.py: background expiry of undelivered messages, orphan blobs & partial uploads. Reclaims database space.
+https://github.com/Romansko/MessageU/blob/main/server/compactor.py
+"""
+__author__ = "Roman Koifman"
+
+import logging
+import os
+import threading
+import time
+from datetime import datetime, timedelta
+
+
+class Compactor:
+    """
+    Removes data older than a TTL, in batches, every INTERVAL seconds. Counts what was removed.
+    Uses its own Database, so requests aren't charged for its queries.
+    """
+
+    INTERVAL = 60         # Seconds between compactions.
+    BATCH = 1000          # Rows removed per transaction.
+    VACUUM_PAGES = 4096   # Database pages returned to the file system per compaction.
+
+    def __init__(self, database, ttl, uploads):
+        """ Remove messages, unreferenced blobs & partial uploads older than ttl seconds. """
+        self.database = database
+        self.ttl = ttl
+        self.uploads = uploads
+        self.thread = None
+        self.runs = 0
+        self.expiredMessages = 0
+        self.expiredBlobs = 0
+        self.expiredUploads = 0
+        self.vacuumedPages = 0
+        self.lastRun = None      # time of last compaction.
+        self.lastDuration = 0.0  # seconds.
+
+    def compact(self):
+        """ A single compaction. Batches are removed until none is left. """
+        started = time.perf_counter()
+        before = datetime.now() - timedelta(seconds=self.ttl)
+        while True:
+            removed = self.database.expireMessages(before, Compactor.BATCH)
+            self.expiredMessages += removed
+            if removed < Compactor.BATCH:
+                break
+        while True:
+            removed = self.database.expireBlobs(before, Compactor.BATCH)
+            self.expiredBlobs += removed
+            if removed < Compactor.BATCH:
+                break
+        self.expireUploads(before.timestamp())
+        self.vacuumedPages += self.database.vacuum(Compactor.VACUUM_PAGES)
+        self.runs += 1
+        self.lastRun = str(datetime.now())
+        self.lastDuration = time.perf_counter() - started
+
+    def expireUploads(self, before):
+        """ Remove partial uploads which weren't appended to since before. """
+        try:
+            names = os.listdir(self.uploads)
+        except OSError:
+            return
+        for name in names:
+            path = os.path.join(self.uploads, name)
+            try:
+                if os.path.getmtime(path) < before:
+                    os.remove(path)
+                    self.expiredUploads += 1
+            except OSError:
+                pass  # completed meanwhile.
+
+    def start(self):
+        """ Compact every INTERVAL seconds, by a background thread. """
+        if self.thread is not None:
+            return
+
+        def compactLoop():
+            while True:
+                time.sleep(Compactor.INTERVAL)
+                try:
+                    self.compact()
+                except Exception as e:
+                    logging.exception(f"Compaction failed: {e}")
+        self.thread = threading.Thread(target=compactLoop, name="Compactor", daemon=True)
+        self.thread.start()
+
+    def summary(self):
+        return {"ttl": self.ttl, "runs": self.runs, "expired_messages": self.expiredMessages,
+                "expired_blobs": self.expiredBlobs, "expired_uploads": self.expiredUploads,
+                "vacuumed_pages": self.vacuumedPages, "last_run": self.lastRun,
+                "last_duration_us": int(self.lastDuration * 1000000)}
@@ -0,0 +1,107 @@
+"""
+MessageU Server
+connection.py: a client connection. Requests are framed incrementally and responses are buffered,
+               both driven by the server's event loop.
+https://github.com/Romansko/MessageU/blob/main/server/connection.py
+"""
+__author__ = "Roman Koifman"
+
+import collections
+import struct
+import time
+import protocol
+
+
+class Connection:
+    """ Client connection state. Counts received & queued bytes. """
+
+    def __init__(self, sock):
+        self.sock = sock
+        self.received = bytearray()  # bytes of the request being framed.
+        self.payloadSize = None  # of the request being framed. None until its header was received.
+        self.outgoing = collections.deque()  # [memoryview, onSent] of queued responses, in order.
+        self.buffered = 0      # bytes waiting to be sent.
+        self.bytesIn = 0
+        self.bytesOut = 0      # bytes queued for sending.
+        self.events = 0        # selector events the connection is registered for.
+        self.closing = False   # close once buffered bytes are sent.
+        self.broken = False    # sending failed. Buffered bytes were dropped.
+        self.pending = 0       # responses being prepared off the event loop. Connection is kept open meanwhile.
+        self.lastProgress = time.monotonic()  # of receiving or sending.
+
+    def receive(self, size):
+        """ Receive up to size available bytes of a request. Return False if peer closed the connection. """
+        try:
+            data = self.sock.recv(size)
+        except (BlockingIOError, InterruptedError):
+            return True
+        if not data:
+            return False
+        self.bytesIn += len(data)
+        self.received += data
+        self.lastProgress = time.monotonic()
+        return True
+
+    def request(self):
+        """
+        Framing state machine. The header is awaited, then its payload. Return the complete request once
+        received, None while it is awaited. Bytes beyond a request (padding of its last packet) are discarded.
+        """
+        if self.payloadSize is None:
+            if len(self.received) < protocol.REQUEST_HEADER_SIZE:
+                return None
+            code, self.payloadSize = struct.unpack_from("<HL", self.received, protocol.CLIENT_ID_SIZE + protocol.VERSION_SIZE)
+            if code == protocol.ERequestCode.REQUEST_PUBLIC_KEY.value and self.payloadSize == 0:
+                self.payloadSize = protocol.CLIENT_ID_SIZE  # older clients send it unsized, within a padded packet.
+        size = protocol.REQUEST_HEADER_SIZE + self.payloadSize
+        if len(self.received) < size:
+            return None
+        request = bytes(memoryview(self.received)[:size])
+        self.received = bytearray()
+        self.payloadSize = None
+        return request
+
+    def queue(self, data, onSent=None):
+        """ Queue data for sending. onSent(True) is invoked once all of data was sent, onSent(False) if dropped. """
+        if not self.outgoing:
+            self.lastProgress = time.monotonic()  # waiting starts now.
+        self.outgoing.append([memoryview(data), onSent])
+        self.buffered += len(data)
+        self.bytesOut += len(data)
+
+    def flush(self):
+        """ Send as much as the socket accepts without blocking. Return False if sending failed. """
+        while self.outgoing:
+            entry = self.outgoing[0]
+            try:
+                sent = self.sock.send(entry[0])
+            except (BlockingIOError, InterruptedError):
+                return True
+            except OSError:
+                self.broken = True
+                self.drop()
+                return False
+            self.buffered -= sent
+            self.lastProgress = time.monotonic()
+            if sent < len(entry[0]):
+                entry[0] = entry[0][sent:]
+                return True  # socket's buffer is full.
+            self.outgoing.popleft()
+            if entry[1]:
+                entry[1](True)
+        return True
+
+    def drop(self):
+        """ Drop unsent data. """
+        outgoing = self.outgoing
+        self.outgoing = collections.deque()
+        self.buffered = 0
+        for entry in outgoing:
+            if entry[1]:
+                entry[1](False)
+
+    def __str__(self):
+        try:
+            return str(self.sock.getpeername())
+        except OSError:
+            return str(self.sock)
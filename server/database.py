@@ -6,18 +6,25 @@ https://github.com/Romansko/MessageU/blob/main/server/database.py
 __author__ = "Roman Koifman"
 
 import logging
+import os
 import sqlite3
+import threading
+import time
+import uuid
 import protocol
+import storage
+from datetime import datetime
 
 
 class Client:
     """ Represents a client entry """
 
-    def __init__(self, cid, cname, public_key, last_seen):
+    def __init__(self, cid, cname, public_key, last_seen, version):
         self.ID = bytes.fromhex(cid)  # Unique client ID, 16 bytes.
         self.Name = cname  # Client's name, null terminated ascii string, 255 bytes.
         self.PublicKey = public_key  # Client's public key, 160 bytes.
         self.LastSeen = last_seen  # The Date & time of client's last request.
+        self.Version = version  # Client's protocol version of last request, 1 byte.
 
     def validate(self):
         """ Validate Client attributes according to the requirements """
@@ -41,6 +48,7 @@ class Message:
         self.FromClient = from_client  # Sender's unique ID, 16 bytes.
         self.Type = mtype  # Message type, 1 byte.
         self.Content = content  # Message's content, Blob.
+        self.Created = str(datetime.now())  # Messages expire a TTL after creation.
 
     def validate(self):
         """ Validate Message attributes according to the requirements """
@@ -54,14 +62,36 @@ class Message:
 
 
 class Database:
+    BUSY_TIMEOUT = 10  # Seconds to wait for a lock held by another worker process.
+    LAST_SEEN_INTERVAL = 5  # Seconds between batched LastSeen updates.
+    AUTO_VACUUM_INCREMENTAL = 2
     CLIENTS = 'clients'
     MESSAGES = 'messages'
+    BLOBS = 'blobs'
+    DOWNLOADS = 'downloads'
+    BLOB_FILES = 'blobs'  # Directory of blobs which are stored as files. Their rows hold no content.
+    BLOB_ROW_SIZE = 64 << 20  # Larger uploaded blobs are stored as files, rather than database rows.
 
-    def __init__(self, name):
+    def __init__(self, name, messageStore=None, shared=False):
+        """
+        Messages are stored by messageStore. Within the messages table by default.
+        Clients are cached in memory once initialized, and written through. A shared database is written by other
+        processes as well, hence cache misses are looked up and versions are read from the database.
+        """
         self.name = name
+        self.messages = messageStore if messageStore is not None else storage.SqliteMessageStore(self)
+        self.shared = shared
+        self.clients = {}      # ID -> Client.
+        self.clientNames = {}  # Name -> Client.
+        self.usersList = None  # Pre serialized users list entries of all clients. Rebuilt after a registration.
+        self.usersIndex = {}   # ID -> index of client's entry within usersList.
+        self.lastSeen = {}     # ID -> (LastSeen, Version) not written yet. Shared with the LastSeen writer.
+        self.lastSeenLock = threading.Lock()
+        self.lastSeenWriter = None
+        self.busyTime = 0.0  # Seconds spent executing queries. Reset by caller to measure a request.
 
     def connect(self):
-        conn = sqlite3.connect(self.name)  # doesn't raise exception.
+        conn = sqlite3.connect(self.name, timeout=Database.BUSY_TIMEOUT)  # doesn't raise exception.
         conn.text_factory = bytes
         return conn
 
@@ -74,9 +104,10 @@ class Database:
             pass  # table might exist already
         conn.close()
 
-    def execute(self, query, args, commit=False, get_last_row=False):
+    def execute(self, query, args, commit=False, get_last_row=False, get_row_count=False):
         """ Given an query and args, execute query, and return the results. """
         results = None
+        started = time.perf_counter()
         conn = self.connect()
         try:
             cur = conn.cursor()
@@ -88,37 +119,132 @@ class Database:
                 results = cur.fetchall()
             if get_last_row:
                 results = cur.lastrowid  # special query.
+            if get_row_count:
+                results = cur.rowcount  # rows modified.
         except Exception as e:
             logging.exception(f'database execute: {e}')
         conn.close()  # commit is not required.
+        self.busyTime += time.perf_counter() - started
+        return results
+
+    def transaction(self, operation):
+        """
+        Invoke operation(cursor) within a single transaction, which holds the database's write lock throughout.
+        Commit once it returns, roll back if it raises. Return its results, None on failure.
+        """
+        results = None
+        started = time.perf_counter()
+        conn = self.connect()
+        conn.isolation_level = None  # transaction is explicit.
+        try:
+            cur = conn.cursor()
+            cur.execute("BEGIN IMMEDIATE")
+            results = operation(cur)
+            cur.execute("COMMIT")
+        except Exception as e:
+            logging.exception(f'database transaction: {e}')
+            if conn.in_transaction:
+                conn.rollback()
+            results = None
+        conn.close()
+        self.busyTime += time.perf_counter() - started
+        return results
+
+    def timed(self, operation, *args):
+        """ Invoke a message store operation. Its duration is busy time, whether or not it queried the database. """
+        busyTime = self.busyTime
+        started = time.perf_counter()
+        results = operation(*args)
+        self.busyTime = busyTime + time.perf_counter() - started
         return results
 
     def initialize(self):
+        # Space of deleted rows is reclaimed by incremental vacuum. Databases created without it are converted once.
+        results = self.execute("PRAGMA auto_vacuum", [])
+        if results and results[0][0] != Database.AUTO_VACUUM_INCREMENTAL:
+            self.executescript("PRAGMA auto_vacuum=INCREMENTAL; VACUUM;")
+
+        # Write ahead log lets worker processes read while another one writes. Persists within database file.
+        self.executescript("PRAGMA journal_mode=WAL;")
+
         # Try to create Clients table
         self.executescript(f"""
             CREATE TABLE {Database.CLIENTS}(
               ID CHAR(16) NOT NULL PRIMARY KEY,
               Name CHAR(255) NOT NULL,
               PublicKey CHAR(160) NOT NULL,
-              LastSeen DATE
+              LastSeen DATE,
+              Version INTEGER
             );
             """)
 
-        # Try to create Messages table
+        # Databases created by server version 2 have no Version column.
+        self.executescript(f"ALTER TABLE {Database.CLIENTS} ADD COLUMN Version INTEGER;")
+
+        # Workers may register the same username concurrently. The index lets only one of them store it.
+        self.executescript(f"CREATE UNIQUE INDEX IF NOT EXISTS {Database.CLIENTS}_name ON {Database.CLIENTS}(Name);")
+
+        # Messages table, or any other storage of the message store.
+        self.messages.initialize()
+
+        # Try to create Blobs table. A blob is stored once and referenced by messages.
         self.executescript(f"""
-            CREATE TABLE {Database.MESSAGES}(
-              ID INTEGER PRIMARY KEY,
-              ToClient CHAR(16) NOT NULL,
-              FromClient CHAR(16) NOT NULL,
-              Type CHAR(1) NOT NULL,
+            CREATE TABLE {Database.BLOBS}(
+              Hash CHAR(32) NOT NULL PRIMARY KEY,
               Content BLOB,
-              FOREIGN KEY(ToClient) REFERENCES {Database.CLIENTS}(ID),
-              FOREIGN KEY(FromClient) REFERENCES {Database.CLIENTS}(ID)
+              RefCount INTEGER NOT NULL DEFAULT 0,
+              Created DATE
+            );
+            """)
+
+        # Try to create Downloads table. A delivered blob reference is leased until its download is acknowledged.
+        self.executescript(f"""
+            CREATE TABLE {Database.DOWNLOADS}(
+              Hash CHAR(32) NOT NULL,
+              ToClient CHAR(16) NOT NULL,
+              FOREIGN KEY(Hash) REFERENCES {Database.BLOBS}(Hash),
+              FOREIGN KEY(ToClient) REFERENCES {Database.CLIENTS}(ID)
             );
             """)
 
+        self.loadClients()
+
+    def loadClients(self):
+        """ Cache all clients. Return False on failure. """
+        results = self.execute(f"SELECT ID, Name, PublicKey, LastSeen, Version FROM {Database.CLIENTS} ORDER BY rowid", [])
+        if results is None:
+            return False
+        self.clients = {}
+        self.clientNames = {}
+        self.usersList = None
+        for row in results:
+            self.cacheClient(row)
+        return True
+
+    def cacheClient(self, row):
+        """ Cache a client given its row. Invalidates the users list. """
+        clnt = Client(row[0].hex(), row[1].decode('utf-8'), row[2], row[3], row[4])
+        self.clients[clnt.ID] = clnt
+        self.clientNames[clnt.Name] = clnt
+        self.usersList = None
+        return clnt
+
+    def getClient(self, client_id):
+        """ given a client id, return its cached Client. None if client doesn't exist. """
+        clnt = self.clients.get(client_id)
+        if clnt is None and self.shared:  # might have been registered by another process.
+            results = self.execute(f"SELECT ID, Name, PublicKey, LastSeen, Version FROM {Database.CLIENTS} WHERE ID = ?",
+                                   [client_id])
+            if results:
+                clnt = self.cacheClient(results[0])
+        return clnt
+
     def clientUsernameExists(self, username):
         """ Check whether a username already exists within database """
+        if username in self.clientNames:
+            return True
+        if not self.shared:
+            return False
         results = self.execute(f"SELECT * FROM {Database.CLIENTS} WHERE Name = ?", [username])
         if not results:
             return False
@@ -126,48 +252,293 @@ class Database:
 
     def clientIdExists(self, client_id):
         """ Check whether an client ID already exists within database """
-        results = self.execute(f"SELECT * FROM {Database.CLIENTS} WHERE ID = ?", [client_id])
-        if not results:
-            return False
-        return len(results) > 0
+        return self.getClient(client_id) is not None
 
     def storeClient(self, clnt):
         """ Store a client into database """
         if not type(clnt) is Client or not clnt.validate():
             return False
-        return self.execute(f"INSERT INTO {Database.CLIENTS} VALUES (?, ?, ?, ?)",
-                            [clnt.ID, clnt.Name, clnt.PublicKey, clnt.LastSeen], True)
+        if not self.execute(f"INSERT INTO {Database.CLIENTS}(ID, Name, PublicKey, LastSeen, Version) VALUES (?, ?, ?, ?, ?)",
+                            [clnt.ID, clnt.Name, clnt.PublicKey, clnt.LastSeen, clnt.Version], True):
+            return False
+        self.clients[clnt.ID] = clnt
+        self.clientNames[clnt.Name] = clnt
+        self.usersList = None
+        return True
 
     def storeMessage(self, msg):
         """ Store a message into database """
         if not type(msg) is Message or not msg.validate():
             return False
-        results = self.execute(
-            f"INSERT INTO {Database.MESSAGES}(ToClient, FromClient, Type, Content) VALUES (?, ?, ?, ?)",
-            [msg.ToClient, msg.FromClient, msg.Type, msg.Content], True, True)
-        return results
+        return self.timed(self.messages.store, msg)
 
-    def removeMessage(self, msg_id):
-        """ remove a message by id from database """
-        return self.execute(f"DELETE FROM {Database.MESSAGES} WHERE ID = ?", [msg_id], True)
+    def storeReferences(self, msgs, blob_hash):
+        """
+        Store messages which all reference a blob, along with their references to it. All or none are stored,
+        hence a failed request can be sent again without duplicates. Return their IDs, None on failure.
+        """
+        if not msgs or not all(type(msg) is Message and msg.validate() for msg in msgs):
+            return None
 
-    def setLastSeen(self, client_id, time):
-        """ set last seen given a client_id """
-        return self.execute(f"UPDATE {Database.CLIENTS} SET LastSeen = ? WHERE ID = ?",
-                            [time, client_id], True)
+        def acquire(cur):
+            """ within the messages' transaction, if messages are stored within the database. """
+            query = f"UPDATE {Database.BLOBS} SET RefCount = RefCount + ? WHERE Hash = ?"
+            if cur is None:
+                updated = self.execute(query, [len(msgs), blob_hash], True, get_row_count=True)
+            else:
+                cur.execute(query, [len(msgs), blob_hash])
+                updated = cur.rowcount
+            if updated != 1:
+                raise LookupError(f"Blob {bytes(blob_hash).hex()} doesn't exist")
+        return self.timed(self.messages.storeAll, msgs, acquire)
 
-    def getClientsList(self):
-        """ query for all clients """
-        return self.execute(f"SELECT ID, Name FROM {Database.CLIENTS}", [])
+    def removeMessages(self, client_id, ids):
+        """
+        remove delivered messages of a client. Return IDs of the messages which were removed by this call,
+        None on failure. Messages which were expired or removed by a concurrent delivery meanwhile are excluded.
+        """
+        return self.timed(self.messages.remove, client_id, ids)
 
-    def getClientPublicKey(self, client_id):
-        """ given a client id, return a public key. """
-        results = self.execute(f"SELECT PublicKey FROM {Database.CLIENTS} WHERE ID = ?", [client_id])
+    def expireMessages(self, before, limit):
+        """ Remove about limit undelivered messages created before a datetime. Release blobs of messages it removed. """
+        removed, blobs = self.messages.expire(before, limit)
+        for blob_hash in blobs:
+            self.releaseBlob(blob_hash)
+        return removed
+
+    def expireBlobs(self, before, limit):
+        """ Remove up to limit blobs created before a datetime, which are neither referenced nor leased. """
+        expired = f"RefCount <= 0 AND Created < ? AND Hash NOT IN (SELECT Hash FROM {Database.DOWNLOADS})"
+        removed = self.execute(f"DELETE FROM {Database.BLOBS} WHERE Hash IN (SELECT Hash FROM {Database.BLOBS} "
+                               f"WHERE Content IS NOT NULL AND {expired} LIMIT ?)", [str(before), limit],
+                               True, get_row_count=True) or 0
+        files = self.execute(f"SELECT Hash FROM {Database.BLOBS} WHERE Content IS NULL AND {expired} LIMIT ?",
+                             [str(before), max(0, limit - removed)]) or []
+        for row in files:
+            if self.deleteBlob(row[0]):
+                removed += 1
+        return removed
+
+    def vacuum(self, pages):
+        """ Return up to pages free pages to the file system. Return number of pages freed. """
+        results = self.execute("PRAGMA freelist_count", [])
+        if not results:
+            return 0
+        free = results[0][0]
+        self.execute(f"PRAGMA incremental_vacuum({int(pages)})", [])
+        results = self.execute("PRAGMA freelist_count", [])
+        return free - results[0][0] if results else 0
+
+    def storeBlob(self, blob_hash, content, created):
+        """ Store a blob into database. Storing an existing blob is a no-op. """
+        return self.execute(f"INSERT OR IGNORE INTO {Database.BLOBS}(Hash, Content, RefCount, Created) VALUES (?, ?, 0, ?)",
+                            [blob_hash, content, created], True)
+
+    def storeBlobContent(self, blob_hash, content, created):
+        """ Store a blob of a given content. Content larger than BLOB_ROW_SIZE is written to a file, as uploads are. """
+        if len(content) <= Database.BLOB_ROW_SIZE:
+            return self.storeBlob(blob_hash, content, created)
+        path = f"{self.blobPath(blob_hash)}.{uuid.uuid4().hex}"  # unique among worker processes.
+        try:
+            os.makedirs(Database.BLOB_FILES, exist_ok=True)
+            with open(path, "wb") as blob:
+                blob.write(content)
+        except OSError as e:
+            logging.error(f"Failed to write blob file {path}: {e}")
+            if os.path.exists(path):
+                os.remove(path)
+            return False
+        return self.storeBlobFile(blob_hash, path, created)
+
+    def storeBlobFile(self, blob_hash, path, created):
+        """ Store a blob by moving its file into BLOB_FILES. Storing an existing blob is a no-op. """
+        try:
+            os.makedirs(Database.BLOB_FILES, exist_ok=True)
+            os.replace(path, self.blobPath(blob_hash))
+        except OSError as e:
+            logging.error(f"Failed to store blob file {path}: {e}")
+            return False
+        return self.execute(f"INSERT OR IGNORE INTO {Database.BLOBS}(Hash, Content, RefCount, Created) VALUES (?, NULL, 0, ?)",
+                            [blob_hash, created], True)
+
+    def blobPath(self, blob_hash):
+        """ Path of a blob which is stored as a file. """
+        return os.path.join(Database.BLOB_FILES, bytes(blob_hash).hex())
+
+    def deleteBlob(self, blob_hash):
+        """ Remove a blob which is not referenced, along with its file. Return whether it was removed. """
+        results = self.execute(f"SELECT Content IS NULL FROM {Database.BLOBS} WHERE Hash = ? AND RefCount <= 0", [blob_hash])
+        if not results:
+            return False
+        if not self.execute(f"DELETE FROM {Database.BLOBS} WHERE Hash = ? AND RefCount <= 0", [blob_hash], True,
+                            get_row_count=True):
+            return False
+        if results[0][0]:
+            try:
+                os.remove(self.blobPath(blob_hash))
+            except OSError as e:
+                logging.error(f"Failed to remove blob file of {bytes(blob_hash).hex()}: {e}")
+        return True
+
+    def blobExists(self, blob_hash):
+        """ Check whether a blob exists within database """
+        results = self.execute(f"SELECT Hash FROM {Database.BLOBS} WHERE Hash = ?", [blob_hash])
+        if not results:
+            return False
+        return len(results) > 0
+
+    def getBlob(self, blob_hash):
+        """ given a blob hash, return blob's content. """
+        results = self.execute(f"SELECT Content FROM {Database.BLOBS} WHERE Hash = ?", [blob_hash])
         if not results:
             return None
+        if results[0][0] is None:
+            return self.readBlobFile(blob_hash, 0, None)
         return results[0][0]
 
+    def getBlobSize(self, blob_hash):
+        """ given a blob hash, return blob's size. None if blob doesn't exist. """
+        results = self.execute(f"SELECT length(Content) FROM {Database.BLOBS} WHERE Hash = ?", [blob_hash])
+        if not results:
+            return None
+        if results[0][0] is None:
+            try:
+                return os.path.getsize(self.blobPath(blob_hash))
+            except OSError:
+                return None
+        return int(results[0][0])
+
+    def getBlobChunk(self, blob_hash, offset, length):
+        """ given a blob hash, return length bytes of blob's content starting at offset. """
+        results = self.execute(f"SELECT substr(Content, ?, ?) FROM {Database.BLOBS} WHERE Hash = ?",
+                               [offset + 1, length, blob_hash])
+        if not results:
+            return None
+        if results[0][0] is None:
+            return self.readBlobFile(blob_hash, offset, length)
+        return bytes(results[0][0])
+
+    def readBlobFile(self, blob_hash, offset, length):
+        """ Read length bytes (all if None) of a blob file starting at offset. """
+        try:
+            with open(self.blobPath(blob_hash), "rb") as blob:
+                blob.seek(offset)
+                return blob.read() if length is None else blob.read(length)
+        except OSError as e:
+            logging.error(f"Failed to read blob file of {bytes(blob_hash).hex()}: {e}")
+            return None
+
+    def leaseBlob(self, blob_hash, client_id):
+        """ keep a delivered blob reference until client acknowledges its download """
+        return self.execute(f"INSERT INTO {Database.DOWNLOADS}(Hash, ToClient) VALUES (?, ?)",
+                            [blob_hash, client_id], True)
+
+    def leaseExists(self, blob_hash, client_id):
+        """ Check whether a client holds a lease on a blob """
+        results = self.execute(f"SELECT Hash FROM {Database.DOWNLOADS} WHERE Hash = ? AND ToClient = ?",
+                               [blob_hash, client_id])
+        if not results:
+            return False
+        return len(results) > 0
+
+    def endLease(self, blob_hash, client_id):
+        """ remove a single lease of a client on a blob """
+        return self.execute(f"DELETE FROM {Database.DOWNLOADS} WHERE rowid IN "
+                            f"(SELECT rowid FROM {Database.DOWNLOADS} WHERE Hash = ? AND ToClient = ? LIMIT 1)",
+                            [blob_hash, client_id], True)
+
+    def releaseBlob(self, blob_hash):
+        """ remove a message reference from a blob. Remove the blob once it is not referenced. """
+        if not self.execute(f"UPDATE {Database.BLOBS} SET RefCount = RefCount - 1 WHERE Hash = ?", [blob_hash], True):
+            return None
+        self.deleteBlob(blob_hash)
+        return True
+
+    def setLastSeen(self, client_id, time, version):
+        """ set last seen and protocol version given a client_id. Unknown clients are ignored. """
+        clnt = self.getClient(client_id)
+        if clnt is None:
+            return False
+        clnt.LastSeen = time
+        clnt.Version = version
+        with self.lastSeenLock:
+            self.lastSeen[client_id] = (time, version)  # written by flushLastSeen.
+        return True
+
+    def flushLastSeen(self):
+        """ Write pending LastSeen updates within a single transaction. Failed updates are kept for the next flush. """
+        with self.lastSeenLock:
+            updates, self.lastSeen = self.lastSeen, {}
+        if not updates:
+            return True
+        conn = self.connect()
+        try:
+            conn.executemany(f"UPDATE {Database.CLIENTS} SET LastSeen = ?, Version = ? WHERE ID = ?",
+                             [(seen, version, client_id) for client_id, (seen, version) in updates.items()])
+            conn.commit()
+            return True
+        except Exception as e:
+            logging.exception(f'database LastSeen flush: {e}')
+            with self.lastSeenLock:
+                updates.update(self.lastSeen)  # newer updates win.
+                self.lastSeen = updates
+            return False
+        finally:
+            conn.close()
+
+    def startLastSeenWriter(self):
+        """ Flush LastSeen updates every LAST_SEEN_INTERVAL seconds, by a background thread. """
+        if self.lastSeenWriter is not None:
+            return
+
+        def writeLoop():
+            while True:
+                time.sleep(Database.LAST_SEEN_INTERVAL)
+                self.flushLastSeen()
+        self.lastSeenWriter = threading.Thread(target=writeLoop, name="LastSeen writer", daemon=True)
+        self.lastSeenWriter.start()
+
+    def getUsersList(self, client_id):
+        """
+        Return the users list payload for a client: ID & null padded name of every other client.
+        Entries are serialized once, until the next registration.
+        """
+        if self.shared:  # other processes register clients as well.
+            results = self.execute(f"SELECT COUNT(*) FROM {Database.CLIENTS}", [])
+            if results and results[0][0] != len(self.clients):
+                self.loadClients()
+        if self.usersList is None:
+            entries = []
+            self.usersIndex = {}
+            for clnt in self.clients.values():
+                self.usersIndex[clnt.ID] = len(entries)
+                entries.append(clnt.ID + clnt.Name.encode('utf-8').ljust(protocol.NAME_SIZE, b'\0'))
+            self.usersList = b"".join(entries)
+        index = self.usersIndex.get(client_id)
+        if index is None:
+            return self.usersList
+        entrySize = protocol.CLIENT_ID_SIZE + protocol.NAME_SIZE
+        return self.usersList[:index * entrySize] + self.usersList[(index + 1) * entrySize:]
+
+    def getClientPublicKey(self, client_id):
+        """ given a client id, return a public key. """
+        clnt = self.getClient(client_id)
+        if clnt is None:
+            return None
+        return clnt.PublicKey
+
+    def getClientVersion(self, client_id):
+        """ given a client id, return its protocol version. 0 if unknown. """
+        if self.shared:  # updated by other processes as well.
+            results = self.execute(f"SELECT Version FROM {Database.CLIENTS} WHERE ID = ?", [client_id])
+            if not results or results[0][0] is None:
+                return protocol.DEF_VAL
+            return int(results[0][0])
+        clnt = self.getClient(client_id)
+        if clnt is None or clnt.Version is None:
+            return protocol.DEF_VAL
+        return int(clnt.Version)
+
     def getPendingMessages(self, client_id):
         """ given a client id, return pending messages for that client. """
-        return self.execute(f"SELECT ID, FromClient, Type, Content FROM {Database.MESSAGES} WHERE ToClient = ?",
-                            [client_id])
+        return self.timed(self.messages.pending, client_id)
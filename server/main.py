@@ -2,19 +2,41 @@
 MessageU Server
 Python 3.9.6
 main.py: Entry point of MessageU Server.
+Usage: main.py [--workers N] [--backlog N] [--messages sqlite|log] [--message-ttl DAYS]
 https://github.com/Romansko/MessageU/blob/main/server/main.py
 """
 __author__ = "Roman Koifman"
 
+import argparse
 import utils
 import server
 
 if __name__ == '__main__':
     PORT_INFO = "port.info"
+    parser = argparse.ArgumentParser(description="MessageU Server")
+    parser.add_argument("--workers", type=int, default=1,
+                        help="worker processes accepting on the same port. More than 1 requires SO_REUSEPORT.")
+    parser.add_argument("--backlog", type=int, default=server.Server.MAX_QUEUED_CONN,
+                        help="maximum number of connections queued by each worker.")
+    parser.add_argument("--messages", choices=server.Server.MESSAGE_STORES, default='sqlite',
+                        help="message queue storage. A log is held by a single process.")
+    parser.add_argument("--message-ttl", type=float, default=server.Server.MESSAGE_TTL / (24 * 60 * 60),
+                        help="days until undelivered messages expire. 0 keeps them forever.")
+    args = parser.parse_args()
+    messageTtl = int(args.message_ttl * 24 * 60 * 60)
     port = utils.parsePort(PORT_INFO)
     if port is None:
         utils.stopServer(f"Failed to parse integer port from '{PORT_INFO}'!")
-    svr = server.Server('', port)  # don't care about host.
-    if not svr.start():
-        utils.stopServer(f"Server start exception: {svr.lastErr}")
-
+    if args.workers < 1 or args.backlog < 1:
+        utils.stopServer("Workers and backlog must be positive!")
+    if messageTtl < 0:
+        utils.stopServer("Message TTL must not be negative!")
+    if args.workers > 1 and args.messages != 'sqlite':
+        utils.stopServer("Multiple workers require sqlite message storage!")
+    if args.workers > 1:
+        if not server.startWorkers('', port, args.workers, args.backlog, messageTtl):
+            utils.stopServer("Server workers stopped. See log for details.")
+    else:
+        svr = server.Server('', port, args.backlog, messageStore=args.messages, messageTtl=messageTtl)  # don't care about host.
+        if not svr.start():
+            utils.stopServer(f"Server start exception: {svr.lastErr}")
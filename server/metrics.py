@@ -0,0 +1,146 @@
+"""
+MessageU Server
+metrics.py: request counters & latency histograms per request code. Dumped periodically to a local stats file.
+https://github.com/Romansko/MessageU/blob/main/server/metrics.py
+"""
+__author__ = "Roman Koifman"
+
+import json
+import logging
+import os
+import time
+import protocol
+
+LATENCY_BUCKETS = 32  # Bucket i > 0 counts durations within [2^(i-1), 2^i) microseconds.
+UNKNOWN_CODE = 0      # Requests whose header couldn't be parsed.
+
+
+class Histogram:
+    """ log2 latency histogram in microseconds. """
+
+    def __init__(self):
+        self.buckets = [0] * LATENCY_BUCKETS
+        self.count = 0
+        self.total = 0  # microseconds.
+        self.max = 0
+
+    def record(self, seconds):
+        us = int(seconds * 1000000)
+        self.buckets[min(us.bit_length(), LATENCY_BUCKETS - 1)] += 1
+        self.count += 1
+        self.total += us
+        if us > self.max:
+            self.max = us
+
+    def percentile(self, percent):
+        """ Upper bound of the bucket which holds the percentile. """
+        rank = (self.count * percent + 99) // 100
+        seen = 0
+        for i, count in enumerate(self.buckets):
+            seen += count
+            if seen >= rank:
+                return min((1 << i) - 1, self.max)
+        return self.max
+
+    def summary(self):
+        if self.count == 0:
+            return {"count": 0}
+        return {"count": self.count, "total_us": self.total, "p50_us": self.percentile(50),
+                "p90_us": self.percentile(90), "p99_us": self.percentile(99), "max_us": self.max}
+
+
+class RequestStats:
+    """ Counters of a single request code. """
+
+    def __init__(self):
+        self.requests = 0
+        self.failures = 0
+        self.bytesIn = 0
+        self.bytesOut = 0
+        self.latency = Histogram()    # request handling, including DB.
+        self.dbLatency = Histogram()  # DB time of a request.
+
+    def summary(self):
+        return {"requests": self.requests, "failures": self.failures, "bytes_in": self.bytesIn,
+                "bytes_out": self.bytesOut, "latency": self.latency.summary(), "db": self.dbLatency.summary()}
+
+
+class Metrics:
+    """ Server's metrics. Updated by the main loop only, hence not locked. """
+
+    def __init__(self):
+        self.started = time.time()
+        self.codes = {}  # request code -> RequestStats.
+        self.connections = 0      # connections waiting to be served.
+        self.maxConnections = 0
+        self.maxReadyEvents = 0   # events returned by a single select.
+        self.buffered = 0         # bytes waiting to be sent.
+        self.maxBuffered = 0
+        self.compaction = None    # Compactor, whose counters are dumped along.
+
+    def record(self, code, success, bytesIn, bytesOut, seconds, dbSeconds):
+        stats = self.codes.get(code)
+        if stats is None:
+            stats = self.codes[code] = RequestStats()
+        stats.requests += 1
+        if not success:
+            stats.failures += 1
+        stats.bytesIn += bytesIn
+        stats.bytesOut += bytesOut
+        stats.latency.record(seconds)
+        stats.dbLatency.record(dbSeconds)
+
+    def setConnections(self, connections):
+        self.connections = connections
+        if connections > self.maxConnections:
+            self.maxConnections = connections
+
+    def setBuffered(self, buffered):
+        self.buffered = buffered
+        if buffered > self.maxBuffered:
+            self.maxBuffered = buffered
+
+    def setReadyEvents(self, events):
+        if events > self.maxReadyEvents:
+            self.maxReadyEvents = events
+
+    def snapshot(self):
+        names = {code.value: code.name for code in protocol.ERequestCode}
+        codes = {}
+        for code, stats in sorted(self.codes.items()):
+            summary = stats.summary()
+            summary["name"] = names.get(code, "UNKNOWN")
+            codes[str(code)] = summary
+        snapshot = {"uptime": int(time.time() - self.started), "connections": self.connections,
+                    "max_connections": self.maxConnections, "max_ready_events": self.maxReadyEvents,
+                    "buffered": self.buffered, "max_buffered": self.maxBuffered, "requests": codes}
+        if self.compaction is not None:
+            snapshot["compaction"] = self.compaction.summary()
+        return snapshot
+
+    def dump(self, path):
+        """ Replace stats file at once, so readers never see a partial file. """
+        try:
+            temp = path + ".tmp"
+            with open(temp, "w") as stats:
+                json.dump(self.snapshot(), stats, indent=1)
+            os.replace(temp, path)
+            return True
+        except OSError as e:
+            logging.error(f"Failed to dump stats to {path}: {e}")
+            return False
+
+
+class SampledFilter(logging.Filter):
+    """ Pass one of every rate records below WARNING. Warnings & errors always pass. """
+
+    def __init__(self, rate):
+        super().__init__()
+        self.rate = max(1, rate)
+        self.seen = 0
+
+    def filter(self, record):
+        if record.levelno >= logging.WARNING:
+            return True
+        self.seen += 1
+        return (self.seen % self.rate) == 1 or self.rate == 1
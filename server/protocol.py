@@ -8,15 +8,28 @@ __author__ = "Roman Koifman"
 import struct
 from enum import Enum
 
-SERVER_VERSION = 2    # Ver2 - support SQL Database.
+SERVER_VERSION = 3    # Ver3 - negotiate AES-GCM messages by client version.
+VERSION_AEAD = 3      # First client version which supports AES-GCM messages.
+VERSION_RESUMABLE = 7 # First client version which downloads referenced blobs by itself.
+VERSION_LARGE = 8     # First client version which transfers blobs of 64 bit sizes & offsets.
 DEF_VAL = 0           # Default value to initialize inner fields.
 HEADER_SIZE = 7       # Header size without clientID. (version, code, payload size).
+REQUEST_HEADER_SIZE = 23  # (clientID, version, code, payload size).
 CLIENT_ID_SIZE = 16
 MSG_ID_SIZE = 4
+VERSION_SIZE = 1
 MSG_TYPE_MAX = 0xFF
 MSG_ID_MAX = 0xFFFFFFFF
 NAME_SIZE = 255
 PUBLIC_KEY_SIZE = 160
+BLOB_HASH_SIZE = 32   # SHA-256 of an uploaded blob.
+MSG_FLAG_BLOB = 0x80  # Message type flag. Content begins with a referenced blob's hash.
+CSIZE_SIZE = 4        # protocol's size type.
+CSIZE_MAX = 0xFFFFFFFF
+TRANSFER_CHUNK_SIZE = 1 << 20  # Maximal blob bytes per upload/download chunk.
+PAYLOAD_MAX_SIZE = 1 << 30  # Maximal request payload. Larger requests are refused rather than buffered.
+WRAPPED_KEY_SIZE = 44  # AES-GCM encrypted content key. (nonce, key, tag).
+FANOUT_MAX_RECIPIENTS = 256  # Recipients of a single fan-out message.
 
 
 # Request Codes
@@ -26,6 +39,10 @@ class ERequestCode(Enum):
     REQUEST_PUBLIC_KEY = 1002
     REQUEST_SEND_MSG = 1003
     REQUEST_PENDING_MSG = 1004   # payload invalid. payloadSize = 0.
+    REQUEST_UPLOAD_BLOB = 1005
+    REQUEST_UPLOAD_CHUNK = 1006
+    REQUEST_DOWNLOAD_CHUNK = 1007
+    REQUEST_SEND_FANOUT = 1008
 
 
 # Responses Codes
@@ -35,9 +52,30 @@ class EResponseCode(Enum):
     RESPONSE_PUBLIC_KEY = 2002
     RESPONSE_MSG_SENT = 2003
     RESPONSE_PENDING_MSG = 2004
+    RESPONSE_BLOB_STORED = 2005
+    RESPONSE_UPLOAD_ACK = 2006
+    RESPONSE_DOWNLOAD_CHUNK = 2007
+    RESPONSE_FANOUT_SENT = 2008
     RESPONSE_ERROR = 9000        # payload invalid. payloadSize = 0.
 
 
+def blobSizeFormat(version):
+    """ struct format of blob sizes & offsets. Large object extension: 64 bit for clients of VERSION_LARGE and above. """
+    return "Q" if version >= VERSION_LARGE else "L"
+
+
+def transferHeaderSize(version):
+    """ Size of a transfer chunk header (blob hash, blob size, offset), by client version. """
+    return struct.calcsize(f"<{BLOB_HASH_SIZE}s" + 2 * blobSizeFormat(version))
+
+
+def unpackContent(data, offset, contentSize):
+    """ Unpack contentSize bytes of content starting at offset. Request was framed, hence it is complete. """
+    if contentSize < 0 or offset + contentSize > len(data):
+        raise ValueError(f"Content exceeds request by {offset + contentSize - len(data)} bytes.")
+    return data[offset:offset + contentSize]
+
+
 class RequestHeader:
     def __init__(self):
         self.clientID = b""
@@ -134,6 +172,7 @@ class PublicKeyResponse:
         self.header = ResponseHeader(EResponseCode.RESPONSE_PUBLIC_KEY.value)
         self.clientID = b""
         self.publicKey = b""
+        self.clientVersion = None  # Sent only to clients of VERSION_AEAD and above.
 
     def pack(self):
         """ Little Endian pack Response Header and Public Key """
@@ -141,6 +180,8 @@ class PublicKeyResponse:
             data = self.header.pack()
             data += struct.pack(f"<{CLIENT_ID_SIZE}s", self.clientID)
             data += struct.pack(f"<{PUBLIC_KEY_SIZE}s", self.publicKey)
+            if self.clientVersion is not None:
+                data += struct.pack("<B", self.clientVersion)
             return data
         except:
             return b""
@@ -154,9 +195,8 @@ class MessageSendRequest:
         self.contentSize = DEF_VAL
         self.content = b""
 
-    def unpack(self, conn, data):
+    def unpack(self, data):
         """ Little Endian unpack Request Header and message data """
-        packetSize = len(data)
         if not self.header.unpack(data):
             return False
         try:
@@ -165,17 +205,7 @@ class MessageSendRequest:
             offset = self.header.SIZE + CLIENT_ID_SIZE
             self.messageType, self.contentSize = struct.unpack("<BL", data[offset:offset + 5])
             offset = self.header.SIZE + CLIENT_ID_SIZE + 5
-            bytesRead = packetSize - offset
-            if bytesRead > self.contentSize:
-                bytesRead = self.contentSize
-            self.content = struct.unpack(f"<{bytesRead}s", data[offset:offset + bytesRead])[0]
-            while bytesRead < self.contentSize:
-                data = conn.recv(packetSize)  # reuse first size of data.
-                dataSize = len(data)
-                if (self.contentSize - bytesRead) < dataSize:
-                    dataSize = self.contentSize - bytesRead
-                self.content += struct.unpack(f"<{dataSize}s", data[:dataSize])[0]
-                bytesRead += dataSize
+            self.content = unpackContent(data, offset, self.contentSize)
             return True
         except:
             self.clientID = b""
@@ -185,6 +215,173 @@ class MessageSendRequest:
             return False
 
 
+class FanoutRequest:
+    """ A message to several recipients. Content is stored once. Each recipient has its own wrapped content key. """
+
+    def __init__(self):
+        self.header = RequestHeader()
+        self.messageType = DEF_VAL
+        self.recipients = []  # [(clientID, wrapped key)]
+        self.content = b""
+
+    def unpack(self, data):
+        """ Little Endian unpack Request Header, recipients and message data """
+        if not self.header.unpack(data):
+            return False
+        try:
+            offset = self.header.SIZE
+            self.messageType, count, contentSize = struct.unpack("<BLL", data[offset:offset + 9])
+            offset += 9
+            if count == 0 or count > FANOUT_MAX_RECIPIENTS:
+                raise ValueError(f"Invalid number of recipients ({count}).")
+            entrySize = CLIENT_ID_SIZE + WRAPPED_KEY_SIZE
+            entries = unpackContent(data, offset, count * entrySize)
+            self.recipients = [(entries[i:i + CLIENT_ID_SIZE], entries[i + CLIENT_ID_SIZE:i + entrySize])
+                               for i in range(0, len(entries), entrySize)]
+            self.content = unpackContent(data, offset + len(entries), contentSize)
+            return True
+        except:
+            self.messageType = DEF_VAL
+            self.recipients = []
+            self.content = b""
+            return False
+
+
+class BlobUploadRequest:
+    def __init__(self):
+        self.header = RequestHeader()
+        self.blobHash = b""
+        self.content = b""
+
+    def unpack(self, data):
+        """ Little Endian unpack Request Header, blob hash and blob """
+        if not self.header.unpack(data):
+            return False
+        try:
+            blobHash = data[self.header.SIZE:self.header.SIZE + BLOB_HASH_SIZE]
+            self.blobHash = struct.unpack(f"<{BLOB_HASH_SIZE}s", blobHash)[0]
+            offset = self.header.SIZE + BLOB_HASH_SIZE
+            self.content = unpackContent(data, offset, self.header.payloadSize - BLOB_HASH_SIZE)
+            return True
+        except:
+            self.blobHash = b""
+            self.content = b""
+            return False
+
+
+class BlobStoredResponse:
+    def __init__(self):
+        self.header = ResponseHeader(EResponseCode.RESPONSE_BLOB_STORED.value)
+        self.blobHash = b""
+
+    def pack(self):
+        """ Little Endian pack Response Header and blob hash """
+        try:
+            data = self.header.pack()
+            data += struct.pack(f"<{BLOB_HASH_SIZE}s", self.blobHash)
+            return data
+        except:
+            return b""
+
+
+class UploadChunkRequest:
+    def __init__(self):
+        self.header = RequestHeader()
+        self.blobHash = b""
+        self.blobSize = DEF_VAL
+        self.offset = DEF_VAL
+        self.content = b""
+
+    def unpack(self, data):
+        """ Little Endian unpack Request Header, transfer chunk header and chunk data """
+        if not self.header.unpack(data):
+            return False
+        try:
+            offset = self.header.SIZE
+            sizes = blobSizeFormat(self.header.version)
+            headerSize = transferHeaderSize(self.header.version)
+            self.blobHash, self.blobSize, self.offset = struct.unpack(f"<{BLOB_HASH_SIZE}s{sizes}{sizes}",
+                                                                      data[offset:offset + headerSize])
+            offset += headerSize
+            self.content = unpackContent(data, offset, self.header.payloadSize - headerSize)
+            return True
+        except:
+            self.blobHash = b""
+            self.blobSize = DEF_VAL
+            self.offset = DEF_VAL
+            self.content = b""
+            return False
+
+
+class UploadAckResponse:
+    def __init__(self):
+        self.header = ResponseHeader(EResponseCode.RESPONSE_UPLOAD_ACK.value)
+        self.version = DEF_VAL  # of the client. Selects the width of committed size.
+        self.blobHash = b""
+        self.committed = DEF_VAL
+
+    def size(self):
+        """ payload size """
+        return BLOB_HASH_SIZE + struct.calcsize("<" + blobSizeFormat(self.version))
+
+    def pack(self):
+        """ Little Endian pack Response Header, blob hash and committed size """
+        try:
+            data = self.header.pack()
+            data += struct.pack(f"<{BLOB_HASH_SIZE}s{blobSizeFormat(self.version)}", self.blobHash, self.committed)
+            return data
+        except:
+            return b""
+
+
+class DownloadChunkRequest:
+    def __init__(self):
+        self.header = RequestHeader()
+        self.blobHash = b""
+        self.offset = DEF_VAL
+        self.length = DEF_VAL
+
+    def unpack(self, data):
+        """ Little Endian unpack Request Header, blob hash, offset and length """
+        if not self.header.unpack(data):
+            return False
+        try:
+            offset = self.header.SIZE
+            layout = f"<{BLOB_HASH_SIZE}s{blobSizeFormat(self.header.version)}L"  # length of a chunk is 32 bit.
+            self.blobHash, self.offset, self.length = struct.unpack(layout, data[offset:offset + struct.calcsize(layout)])
+            return True
+        except:
+            self.blobHash = b""
+            self.offset = DEF_VAL
+            self.length = DEF_VAL
+            return False
+
+
+class DownloadChunkResponse:
+    def __init__(self):
+        self.header = ResponseHeader(EResponseCode.RESPONSE_DOWNLOAD_CHUNK.value)
+        self.version = DEF_VAL  # of the client. Selects the width of blob size & offset.
+        self.blobHash = b""
+        self.blobSize = DEF_VAL
+        self.offset = DEF_VAL
+        self.content = b""
+
+    def size(self):
+        """ payload size """
+        return transferHeaderSize(self.version) + len(self.content)
+
+    def pack(self):
+        """ Little Endian pack Response Header, transfer chunk header and chunk data """
+        try:
+            sizes = blobSizeFormat(self.version)
+            data = self.header.pack()
+            data += struct.pack(f"<{BLOB_HASH_SIZE}s{sizes}{sizes}", self.blobHash, self.blobSize, self.offset)
+            data += self.content
+            return data
+        except:
+            return b""
+
+
 class MessageSentResponse:
     def __init__(self):
         self.header = ResponseHeader(EResponseCode.RESPONSE_MSG_SENT.value)
@@ -5,103 +5,328 @@ https://github.com/Romansko/MessageU/blob/main/server/server.py
 """
 __author__ = "Roman Koifman"
 
+import concurrent.futures
+import hashlib
 import logging
+import multiprocessing
+import queue
+import signal
+import os
 import selectors
+import time
 import uuid
 import socket
+import compactor
+import connection
 import database
+import metrics
 import protocol
+import storage
 from datetime import datetime
 
+try:
+    import fcntl  # POSIX only. Serializes appends to a partial upload among worker processes.
+except ImportError:
+    fcntl = None
+
+requestLog = logging.getLogger("requests")  # Per request records. Sampled.
+
 
 class Server:
     DATABASE = 'server.db'
+    UPLOADS = 'uploads'  # Partial blob uploads directory.
+    MESSAGE_LOG = 'messages'  # Messages directory of the log message store.
+    MESSAGE_STORES = ('sqlite', 'log')
+    MESSAGE_TTL = 30 * 24 * 60 * 60  # Seconds until undelivered messages, unreferenced blobs & partial uploads expire.
     PACKET_SIZE = 1024   # Default packet size.
-    MAX_QUEUED_CONN = 5  # Default maximum number of queued connections.
+    RECV_SIZE = 1 << 16  # Maximal bytes received from a connection per event.
+    INLINE_BLOB_SIZE = 1 << 16  # Smaller blobs are delivered along with their references, saving downloads.
+    MAX_QUEUED_CONN = socket.SOMAXCONN  # Default maximum number of queued connections (listen backlog).
     IS_BLOCKING = False  # Do not block!
+    CONNECTION_BUFFER_LIMIT = 4 << 20  # A connection isn't read while more bytes wait to be sent to it.
+    BUFFER_LIMIT = 64 << 20  # Connections aren't accepted while more bytes wait to be sent overall.
+    WRITE_TIMEOUT = 30       # Seconds without sending progress before a connection is dropped.
+    VERIFIERS = 2            # Threads verifying & storing completed uploads, off the event loop.
+    READ_TIMEOUT = 30        # Seconds without receiving progress of an incomplete request before it is dropped.
+    STATS = 'stats.json'  # Metrics are dumped to this file.
+    STATS_INTERVAL = 10   # Seconds between stats dumps.
+    LOG_LEVEL = logging.INFO
+    REQUEST_LOG_LEVEL = logging.INFO  # Raise to logging.WARNING to drop per request records.
+    REQUEST_LOG_SAMPLE = 100          # Log one of every REQUEST_LOG_SAMPLE per request records below WARNING.
 
-    def __init__(self, host, port):
-        """ Initialize server. Map request codes to handles. """
-        logging.basicConfig(format='[%(levelname)s - %(asctime)s]: %(message)s', level=logging.INFO, datefmt='%H:%M:%S')
+    def __init__(self, host, port, backlog=MAX_QUEUED_CONN, worker=None, messageStore='sqlite', messageTtl=MESSAGE_TTL):
+        """
+        Initialize server. Map request codes to handles.
+        A worker shares its port with other workers' processes. Each worker dumps its own stats.
+        Messages are stored within the database ('sqlite'), or appended to per recipient logs ('log').
+        Expired data is removed by a single compactor, the first worker's. A messageTtl of 0 keeps data forever.
+        """
+        prefix = '' if worker is None else f'worker {worker} - '
+        logging.basicConfig(format=f'[%(levelname)s - {prefix}%(asctime)s]: %(message)s', level=Server.LOG_LEVEL,
+                            datefmt='%H:%M:%S')
+        requestLog.setLevel(Server.REQUEST_LOG_LEVEL)
+        requestLog.addFilter(metrics.SampledFilter(Server.REQUEST_LOG_SAMPLE))
         self.host = host
         self.port = port
+        self.backlog = backlog
+        self.worker = worker
+        self.stats = Server.STATS if worker is None else f"{os.path.splitext(Server.STATS)[0]}.{worker}.json"
         self.sel = selectors.DefaultSelector()
-        self.database = database.Database(Server.DATABASE)
+        store = storage.LogMessageStore(Server.MESSAGE_LOG) if messageStore == 'log' else None
+        self.database = database.Database(Server.DATABASE, store, worker is not None)
         self.lastErr = ""  # Last Error description.
+        self.metrics = metrics.Metrics()
+        self.compactor = None
+        if messageTtl > 0 and not worker:
+            self.compactor = compactor.Compactor(database.Database(Server.DATABASE, store), messageTtl, Server.UPLOADS)
+            self.metrics.compaction = self.compactor
+        self.verifier = concurrent.futures.ThreadPoolExecutor(Server.VERIFIERS)
+        self.verifierDatabase = database.Database(Server.DATABASE, store, worker is not None)  # requests aren't charged.
+        self.deferred = queue.SimpleQueue()  # (conn, future, respond) of deferred work which is done.
+        self.wakeup = None  # socket pair. Wakes the event loop once deferred work is done.
+        self.listener = None
+        self.accepting = False
+        self.buffered = 0      # bytes waiting to be sent, overall.
+        self.connections = set()
         self.requestHandle = {
             protocol.ERequestCode.REQUEST_REGISTRATION.value: self.handleRegistrationRequest,
             protocol.ERequestCode.REQUEST_USERS.value: self.handleUsersListRequest,
             protocol.ERequestCode.REQUEST_PUBLIC_KEY.value: self.handlePublicKeyRequest,
             protocol.ERequestCode.REQUEST_SEND_MSG.value: self.handleMessageSendRequest,
-            protocol.ERequestCode.REQUEST_PENDING_MSG.value: self.handlePendingMessagesRequest
+            protocol.ERequestCode.REQUEST_PENDING_MSG.value: self.handlePendingMessagesRequest,
+            protocol.ERequestCode.REQUEST_UPLOAD_BLOB.value: self.handleBlobUploadRequest,
+            protocol.ERequestCode.REQUEST_UPLOAD_CHUNK.value: self.handleUploadChunkRequest,
+            protocol.ERequestCode.REQUEST_DOWNLOAD_CHUNK.value: self.handleDownloadChunkRequest,
+            protocol.ERequestCode.REQUEST_SEND_FANOUT.value: self.handleFanoutRequest
         }
 
     def accept(self, sock, mask):
         """ accept a connection from client """
-        conn, address = sock.accept()
-        conn.setblocking(Server.IS_BLOCKING)
-        self.sel.register(conn, selectors.EVENT_READ, self.read)
-
-    def read(self, conn, mask):
-        """ read data from client and parse it"""
-        logging.info("A client has connected.")
-        data = conn.recv(Server.PACKET_SIZE)
-        if data:
-            requestHeader = protocol.RequestHeader()
-            success = False
-            if not requestHeader.unpack(data):
-                logging.error("Failed to parse request header!")
-            else:
-                if requestHeader.code in self.requestHandle.keys():
-                    success = self.requestHandle[requestHeader.code](conn, data)  # invoke corresponding handle.
-            if not success:  # return generic error upon failure.
-                responseHeader = protocol.ResponseHeader(protocol.EResponseCode.RESPONSE_ERROR.value)
-                self.write(conn, responseHeader.pack())
-            self.database.setLastSeen(requestHeader.clientID, str(datetime.now()))
-        self.sel.unregister(conn)
-        conn.close()
-
-    def write(self, conn, data):
-        """ Send a response to client"""
-        size = len(data)
-        sent = 0
-        while sent < size:
-            leftover = size - sent
-            if leftover > Server.PACKET_SIZE:
-                leftover = Server.PACKET_SIZE
-            toSend = data[sent:sent + leftover]
-            if len(toSend) < Server.PACKET_SIZE:
-                toSend += bytearray(Server.PACKET_SIZE - len(toSend))
+        sock, address = sock.accept()
+        sock.setblocking(Server.IS_BLOCKING)
+        conn = connection.Connection(sock)
+        conn.events = selectors.EVENT_READ
+        self.connections.add(conn)
+        self.sel.register(sock, conn.events, lambda fileobj, events: self.serve(conn, events))
+
+    def defer(self, conn, work, respond):
+        """
+        Run work() on a verifier thread, off the event loop. Once done, the event loop invokes respond(result) to queue
+        the response. respond returns False, or work raises, to respond with an error. Connection is kept meanwhile.
+        """
+        conn.pending += 1
+
+        def done(future):
+            self.deferred.put((conn, future, respond))
             try:
-                conn.send(toSend)
-                sent += len(toSend)
-            except:
-                logging.error("Failed to send response to " + conn)
-                return False
-        logging.info("Response sent successfully.")
+                self.wakeup[1].send(b"\0")
+            except (BlockingIOError, InterruptedError):
+                pass  # wakeup is due already.
+        self.verifier.submit(work).add_done_callback(done)
+
+    def completeDeferred(self, sock, mask):
+        """ Queue responses of deferred work which is done. """
+        try:
+            sock.recv(Server.RECV_SIZE)
+        except (BlockingIOError, InterruptedError):
+            pass
+        while True:
+            try:
+                conn, future, respond = self.deferred.get_nowait()
+            except queue.Empty:
+                return
+            conn.pending -= 1
+            try:
+                success = respond(future.result())
+            except Exception as e:
+                logging.exception(f"Deferred request of {conn} failed: {e}")
+                success = False
+            if not success:
+                self.write(conn, protocol.ResponseHeader(protocol.EResponseCode.RESPONSE_ERROR.value).pack())
+            if conn in self.connections:
+                self.flush(conn)
+
+    def serve(self, conn, mask):
+        """ handle selector events of a client connection """
+        try:
+            if mask & selectors.EVENT_WRITE:
+                self.flush(conn)
+            if (mask & selectors.EVENT_READ) and not conn.closing:
+                self.read(conn)
+        except Exception as e:
+            logging.exception(f"Connection {conn} dropped: {e}")
+            self.close(conn)
+
+    def read(self, conn):
+        """
+        Receive available bytes of a request. Never blocks. Request is dispatched once it was received completely.
+        Connection is closed once the response was sent.
+        """
+        if not conn.receive(Server.RECV_SIZE):
+            conn.closing = True  # closed by client.
+        else:
+            data = conn.request()
+            if data is not None:
+                self.dispatch(conn, data)
+            elif conn.payloadSize is not None and conn.payloadSize > protocol.PAYLOAD_MAX_SIZE:
+                logging.warning(f"Request of {conn.payloadSize} bytes from {conn} is too large.")
+                self.write(conn, protocol.ResponseHeader(protocol.EResponseCode.RESPONSE_ERROR.value).pack())
+            else:
+                return  # awaiting the rest of the request.
+            conn.closing = True
+        self.flush(conn)
+
+    def dispatch(self, conn, data):
+        """ parse a complete request and invoke its handle """
+        started = time.perf_counter()
+        self.database.busyTime = 0.0
+        requestHeader = protocol.RequestHeader()
+        code = metrics.UNKNOWN_CODE
+        success = False
+        if not requestHeader.unpack(data):
+            logging.error("Failed to parse request header!")
+        else:
+            code = requestHeader.code
+            if requestHeader.code in self.requestHandle.keys():
+                success = self.requestHandle[requestHeader.code](conn, data)  # invoke corresponding handle.
+        if not success:  # return generic error upon failure.
+            responseHeader = protocol.ResponseHeader(protocol.EResponseCode.RESPONSE_ERROR.value)
+            self.write(conn, responseHeader.pack())
+        self.database.setLastSeen(requestHeader.clientID, str(datetime.now()), requestHeader.version)
+        self.metrics.record(code, success, conn.bytesIn, conn.bytesOut,
+                            time.perf_counter() - started, self.database.busyTime)
+
+    def write(self, conn, data, onSent=None):
+        """
+        Queue a response, padded to whole packets. Sending is driven by the event loop, hence never blocks.
+        onSent(sent) is invoked once the response was sent or dropped. Return False if the connection is broken.
+        """
+        if conn.broken:
+            return False
+        if not data:
+            return True
+        padding = -len(data) % Server.PACKET_SIZE
+        if padding:
+            data += bytes(padding)
+        conn.queue(data, onSent)
+        self.buffered += len(data)
         return True
 
+    def flush(self, conn):
+        """ Send buffered responses of a connection, as much as possible without blocking. """
+        buffered = conn.buffered
+        if conn.flush():
+            if buffered and not conn.buffered:
+                requestLog.debug("Response sent successfully.")
+        else:
+            logging.error(f"Failed to send response to {conn}")
+        self.buffered -= buffered - conn.buffered
+        self.updateEvents(conn)
+
+    def updateEvents(self, conn):
+        """
+        Register connection for the events it awaits. A connection is not read while its buffer is over the limit.
+        Connections are not accepted while overall buffer is over the limit. Done connections are closed, unless
+        their response is pending, in which case they await no events until it is queued.
+        """
+        events = 0
+        if not conn.closing and conn.buffered < Server.CONNECTION_BUFFER_LIMIT:
+            events |= selectors.EVENT_READ
+        if conn.buffered:
+            events |= selectors.EVENT_WRITE
+        if not events and not conn.pending:
+            self.close(conn)
+        elif not events:
+            if conn.events:
+                self.sel.unregister(conn.sock)
+        elif not conn.events:
+            self.sel.register(conn.sock, events, lambda fileobj, mask: self.serve(conn, mask))
+        elif events != conn.events:
+            self.sel.modify(conn.sock, events, self.sel.get_key(conn.sock).data)
+        conn.events = events
+        self.updateAccepting()
+
+    def updateAccepting(self):
+        """ Pause accepting while overall buffer is over the limit. Resume once half of it was sent. """
+        if self.accepting and self.buffered > Server.BUFFER_LIMIT:
+            self.sel.unregister(self.listener)
+            self.accepting = False
+            logging.warning(f"{self.buffered} bytes wait to be sent. Accepting connections is paused.")
+        elif not self.accepting and self.buffered <= Server.BUFFER_LIMIT // 2:
+            self.sel.register(self.listener, selectors.EVENT_READ, self.accept)
+            self.accepting = True
+
+    def close(self, conn):
+        """ Close a connection. Unsent responses are dropped. """
+        self.buffered -= conn.buffered
+        conn.drop()
+        self.connections.discard(conn)
+        try:
+            self.sel.unregister(conn.sock)
+        except (KeyError, ValueError):
+            pass  # not registered.
+        conn.sock.close()
+        self.updateAccepting()
+
+    def dropStalled(self):
+        """ Close connections which made no sending progress within WRITE_TIMEOUT, or receiving within READ_TIMEOUT. """
+        now = time.monotonic()
+        for conn in list(self.connections):
+            idle = now - conn.lastProgress
+            if conn.buffered and idle > Server.WRITE_TIMEOUT:
+                logging.warning(f"Connection {conn} stalled. Dropping {conn.buffered} unsent bytes.")
+                self.close(conn)
+            elif not conn.buffered and not conn.closing and idle > Server.READ_TIMEOUT:
+                logging.warning(f"Connection {conn} stalled. Dropping an incomplete request.")
+                self.close(conn)
+
     def start(self):
         """ Start listen for connections. Contains the main loop. """
         self.database.initialize()
+        self.database.startLastSeenWriter()
+        if self.compactor:
+            self.compactor.start()
+        signal.signal(signal.SIGTERM, lambda signum, frame: exit(0))  # unwind, so pending LastSeen updates are written.
         try:
-            sock = socket.socket()
-            sock.bind((self.host, self.port))
-            sock.listen(Server.MAX_QUEUED_CONN)
-            sock.setblocking(Server.IS_BLOCKING)
-            self.sel.register(sock, selectors.EVENT_READ, self.accept)
+            os.makedirs(Server.UPLOADS, exist_ok=True)
+            self.wakeup = socket.socketpair()
+            for sock in self.wakeup:
+                sock.setblocking(Server.IS_BLOCKING)
+            self.sel.register(self.wakeup[0], selectors.EVENT_READ, self.completeDeferred)
+            self.listener = socket.socket()
+            if self.worker is not None:
+                self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)  # kernel balances workers.
+            self.listener.bind((self.host, self.port))
+            self.listener.listen(self.backlog)
+            self.listener.setblocking(Server.IS_BLOCKING)
+            self.updateAccepting()
         except Exception as e:
             self.lastErr = e
             return False
-        print(f"Server is listening for connections on port {self.port}..")
-        while True:
-            try:
-                events = self.sel.select()
-                for key, mask in events:
-                    callback = key.data
-                    callback(key.fileobj, mask)
-            except Exception as e:
-                logging.exception(f"Server main loop exception: {e}")
+        worker = '' if self.worker is None else f" (worker {self.worker})"
+        print(f"Server is listening for connections on port {self.port}{worker}..")
+        try:
+            nextDump = time.monotonic() + Server.STATS_INTERVAL
+            while True:
+                try:
+                    timeout = nextDump - time.monotonic()
+                    if self.connections:
+                        timeout = min(timeout, 1.0)  # check for stalled connections.
+                    events = self.sel.select(timeout=max(0.0, timeout))
+                    self.metrics.setReadyEvents(len(events))
+                    for key, mask in events:
+                        callback = key.data
+                        callback(key.fileobj, mask)
+                    self.dropStalled()
+                    self.metrics.setConnections(len(self.connections))
+                    self.metrics.setBuffered(self.buffered)
+                    if time.monotonic() >= nextDump:
+                        self.metrics.dump(self.stats)
+                        nextDump = time.monotonic() + Server.STATS_INTERVAL
+                except Exception as e:
+                    logging.exception(f"Server main loop exception: {e}")
+        finally:
+            self.database.flushLastSeen()
 
     def handleRegistrationRequest(self, conn, data):
         """ Register a new user. Save to db. """
@@ -112,20 +337,21 @@ class Server:
             return False
         try:
             if not request.name.isalnum():
-                logging.info(f"Registration Request: Invalid requested username ({request.name}))")
+                requestLog.info(f"Registration Request: Invalid requested username ({request.name}))")
                 return False
             if self.database.clientUsernameExists(request.name):
-                logging.info(f"Registration Request: Username ({request.name}) already exists.")
+                requestLog.info(f"Registration Request: Username ({request.name}) already exists.")
                 return False
         except:
             logging.error("Registration Request: Failed to connect to database.")
             return False
         
-        clnt = database.Client(uuid.uuid4().hex, request.name, request.publicKey, str(datetime.now()))
+        clnt = database.Client(uuid.uuid4().hex, request.name, request.publicKey, str(datetime.now()),
+                               request.header.version)
         if not self.database.storeClient(clnt):
             logging.error(f"Registration Request: Failed to store client {request.name}.")
             return False
-        logging.info(f"Successfully registered client {request.name}.")
+        requestLog.info(f"Successfully registered client {request.name}.")
         response.clientID = clnt.ID
         response.header.payloadSize = protocol.CLIENT_ID_SIZE
         return self.write(conn, response.pack())
@@ -137,21 +363,15 @@ class Server:
             logging.error("Users list Request: Failed to parse request header!")
         try:
             if not self.database.clientIdExists(request.clientID):
-                logging.info(f"Users list Request: clientID ({request.clientID}) does not exists!")
+                requestLog.info(f"Users list Request: clientID ({request.clientID}) does not exists!")
                 return False
         except:
             logging.error("Users list Request:: Failed to connect to database.")
             return False
         response = protocol.ResponseHeader(protocol.EResponseCode.RESPONSE_USERS.value)
-        clients = self.database.getClientsList()
-        payload = b""
-        for user in clients:
-            if user[0] != request.clientID:  # Do not send self. Requirement.
-                payload += user[0]
-                name = user[1] + bytes('\0' * (protocol.NAME_SIZE - len(user[1])), 'utf-8')
-                payload += name
+        payload = self.database.getUsersList(request.clientID)  # Do not send self. Requirement.
         response.payloadSize = len(payload)
-        logging.info(f"Clients list was successfully built for clientID ({request.clientID}).")
+        requestLog.info(f"Clients list was successfully built for clientID ({request.clientID}).")
         return self.write(conn, response.pack() + payload)
 
     def handlePublicKeyRequest(self, conn, data):
@@ -162,19 +382,22 @@ class Server:
             logging.error("PublicKey Request: Failed to parse request header!")
         key = self.database.getClientPublicKey(request.clientID)
         if not key:
-            logging.info(f"PublicKey Request: clientID doesn't exists.")
+            requestLog.info(f"PublicKey Request: clientID doesn't exists.")
             return False
         response.clientID = request.clientID
         response.publicKey = key
         response.header.payloadSize = protocol.CLIENT_ID_SIZE + protocol.PUBLIC_KEY_SIZE
-        logging.info(f"Public Key response was successfully built to clientID ({request.header.clientID}).")
+        if request.header.version >= protocol.VERSION_AEAD:  # let the requester negotiate message encryption.
+            response.clientVersion = self.database.getClientVersion(request.clientID)
+            response.header.payloadSize += protocol.VERSION_SIZE
+        requestLog.info(f"Public Key response was successfully built to clientID ({request.header.clientID}).")
         return self.write(conn, response.pack())
 
     def handleMessageSendRequest(self, conn, data):
         """ store a message from one user to another """
         request = protocol.MessageSendRequest()
         response = protocol.MessageSentResponse()
-        if not request.unpack(conn, data):
+        if not request.unpack(data):
             logging.error("Send Message Request: Failed to parse request header!")
 
         msg = database.Message(request.clientID,
@@ -182,7 +405,12 @@ class Server:
                                request.messageType,
                                request.content)
 
-        msgId = self.database.storeMessage(msg)
+        if request.messageType & protocol.MSG_FLAG_BLOB:
+            # message & its blob reference are stored atomically. Fails if the referenced blob doesn't exist.
+            msgIds = self.database.storeReferences([msg], request.content[:protocol.BLOB_HASH_SIZE])
+            msgId = msgIds[0] if msgIds else None
+        else:
+            msgId = self.database.storeMessage(msg)
         if not msgId:
             logging.error("Send Message Request: Failed to store msg.")
             return False
@@ -190,9 +418,41 @@ class Server:
         response.header.payloadSize = protocol.CLIENT_ID_SIZE + protocol.MSG_ID_SIZE
         response.clientID = request.clientID
         response.messageID = msgId
-        logging.info(f"Message from clientID ({request.header.clientID}) successfully stored.")
+        requestLog.info(f"Message from clientID ({request.header.clientID}) successfully stored.")
         return self.write(conn, response.pack())
 
+    def handleFanoutRequest(self, conn, data):
+        """ store a message to several users. Content is stored once as a blob, which every message references. """
+        request = protocol.FanoutRequest()
+        response = protocol.ResponseHeader(protocol.EResponseCode.RESPONSE_FANOUT_SENT.value)
+        if not request.unpack(data):
+            logging.error("Fan-out Request: Failed to parse request!")
+            return False
+        for clientID, wrappedKey in request.recipients:
+            if not self.database.clientIdExists(clientID):
+                requestLog.info(f"Fan-out Request: clientID ({clientID}) doesn't exist.")
+                return False
+
+        blobHash = hashlib.sha256(request.content).digest()
+        if not self.database.storeBlobContent(blobHash, request.content, str(datetime.now())):
+            logging.error("Fan-out Request: Failed to store content.")
+            return False
+        msgs = [database.Message(clientID, request.header.clientID, request.messageType | protocol.MSG_FLAG_BLOB,
+                                 blobHash + wrappedKey) for clientID, wrappedKey in request.recipients]
+        msgIds = self.database.storeReferences(msgs, blobHash)
+        if not msgIds:
+            logging.error("Fan-out Request: Failed to store messages.")
+            return False
+        payload = b""
+        for (clientID, wrappedKey), msgId in zip(request.recipients, msgIds):
+            sent = protocol.MessageSentResponse()
+            sent.clientID = clientID
+            sent.messageID = msgId
+            payload += sent.pack()[protocol.HEADER_SIZE:]
+        response.payloadSize = len(payload)
+        requestLog.info(f"Message from clientID ({request.header.clientID}) to {len(request.recipients)} clients successfully stored.")
+        return self.write(conn, response.pack() + payload)
+
     def handlePendingMessagesRequest(self, conn, data):
         """ respond with pending messages """
         request = protocol.RequestHeader()
@@ -201,7 +461,7 @@ class Server:
             logging.error("Pending messages request: Failed to parse request header!")
         try:
             if not self.database.clientIdExists(request.clientID):
-                logging.info(f"clientID ({request.clientID}) does not exists!")
+                requestLog.info(f"clientID ({request.clientID}) does not exists!")
                 return False
         except:
             logging.error("Pending messages request: Failed to connect to database.")
@@ -210,19 +470,206 @@ class Server:
         payload = b""
         messages = self.database.getPendingMessages(request.clientID)
         ids = []
+        inlined = []  # (message ID, blob) of blobs delivered along with their references.
+        leased = []   # (message ID, blob) of blobs downloaded by the client.
         for msg in messages:  # id, from, type, content
             pending = protocol.PendingMessage()
             pending.messageID = int(msg[0])
             pending.messageClientID = msg[1]
             pending.messageType = int(msg[2])
             pending.content = msg[3]
-            pending.messageSize = len(msg[3])
+            if pending.messageType & protocol.MSG_FLAG_BLOB:
+                blobHash = msg[3][:protocol.BLOB_HASH_SIZE]
+                blobSize = self.database.getBlobSize(blobHash)
+                if request.version < protocol.VERSION_RESUMABLE or (blobSize is not None and blobSize <= Server.INLINE_BLOB_SIZE):
+                    pending.content += self.database.getBlob(blobHash) or b""
+                    inlined += [(pending.messageID, blobHash)]
+                else:  # leased before sending, as any worker may serve the download.
+                    self.database.leaseBlob(blobHash, request.clientID)
+                    leased += [(pending.messageID, blobHash)]
+            pending.messageSize = len(pending.content)
             ids += [pending.messageID]
             payload += pending.pack()
         response.payloadSize = len(payload)
-        logging.info(f"Pending messages to clientID ({request.clientID}) successfully extracted.")
-        if self.write(conn, response.pack() + payload):
-            for msg_id in ids:
-                self.database.removeMessage(msg_id)
-            return True
+        requestLog.info(f"Pending messages to clientID ({request.clientID}) successfully extracted.")
+
+        def delivered(sent):
+            """
+            messages are removed once sent. A message's blob reference is released by whoever removed the message:
+            inlined blobs at once, leased blobs once client acknowledges the download. A message expired or delivered
+            by another request meanwhile was released by its remover, hence its lease is ended without a release.
+            """
+            removed = set(self.database.removeMessages(request.clientID, ids) or []) if sent else set()
+            for messageID, blobHash in inlined:
+                if messageID in removed:
+                    self.database.releaseBlob(blobHash)
+            for messageID, blobHash in leased:
+                if messageID not in removed:
+                    self.database.endLease(blobHash, request.clientID)
+        return self.write(conn, response.pack() + payload, delivered)
+
+    def handleBlobUploadRequest(self, conn, data):
+        """ store a blob which may be referenced by many messages """
+        request = protocol.BlobUploadRequest()
+        response = protocol.BlobStoredResponse()
+        if not request.unpack(data):
+            logging.error("Blob Upload Request: Failed to parse request!")
+            return False
+        if hashlib.sha256(request.content).digest() != request.blobHash:
+            requestLog.info("Blob Upload Request: Blob doesn't match its hash.")
+            return False
+        if not self.database.storeBlob(request.blobHash, request.content, str(datetime.now())):
+            logging.error("Blob Upload Request: Failed to store blob.")
+            return False
+        response.blobHash = request.blobHash
+        response.header.payloadSize = protocol.BLOB_HASH_SIZE
+        requestLog.info(f"Blob from clientID ({request.header.clientID}) successfully stored.")
+        return self.write(conn, response.pack())
+
+    def handleUploadChunkRequest(self, conn, data):
+        """ append a chunk to a partial blob upload. Store the blob once completed. """
+        request = protocol.UploadChunkRequest()
+        response = protocol.UploadAckResponse()
+        if not request.unpack(data):
+            logging.error("Upload Chunk Request: Failed to parse request!")
+            return False
+        if len(request.content) > protocol.TRANSFER_CHUNK_SIZE:
+            requestLog.info("Upload Chunk Request: Chunk is too large.")
+            return False
+        response.version = request.header.version
+        response.blobHash = request.blobHash
+        response.header.payloadSize = response.size()
+        if self.database.blobExists(request.blobHash):  # already uploaded, probably by another client.
+            response.committed = request.blobSize
+            return self.write(conn, response.pack())
+
+        path = os.path.join(Server.UPLOADS, request.blobHash.hex())
+        try:
+            with open(path, 'ab') as partial:
+                if fcntl:
+                    fcntl.flock(partial.fileno(), fcntl.LOCK_EX)  # released upon close.
+                committed = os.fstat(partial.fileno()).st_size
+                if request.content and request.offset == committed and committed + len(request.content) <= request.blobSize:
+                    partial.write(request.content)
+                    committed += len(request.content)
+        except OSError as e:
+            logging.error(f"Upload Chunk Request: Failed to store chunk: {e}")
+            return False
+
+        response.committed = committed
+        if committed < request.blobSize:
+            return self.write(conn, response.pack())
+
+        def stored(success):
+            """ completion is acknowledged once the blob was verified & stored. """
+            if not success:
+                return False
+            requestLog.info(f"Blob from clientID ({request.header.clientID}) successfully stored.")
+            return self.write(conn, response.pack())
+        self.defer(conn, lambda: self.completeUpload(path, request.blobHash, committed), stored)
+        return True
+
+    def completeUpload(self, path, blobHash, size):
+        """
+        Verify a completed upload and store it as a blob. Runs on a verifier thread, as the whole upload is hashed.
+        An upload which doesn't match its hash is removed, hence it starts over. Large blobs are hashed in chunks and
+        their file is moved, so they are never held in memory.
+        """
+        digest = hashlib.sha256()
+        content = None
+        try:
+            with open(path, 'rb') as partial:
+                if size <= database.Database.BLOB_ROW_SIZE:
+                    content = partial.read()
+                    digest.update(content)
+                else:
+                    for chunk in iter(lambda: partial.read(protocol.TRANSFER_CHUNK_SIZE), b""):
+                        digest.update(chunk)
+            if content is not None or digest.digest() != blobHash:
+                os.remove(path)
+        except FileNotFoundError:  # completed concurrently by another worker.
+            return self.verifierDatabase.blobExists(blobHash)
+        except OSError as e:
+            logging.error(f"Upload Chunk Request: Failed to read upload: {e}")
+            return False
+
+        if digest.digest() != blobHash:
+            requestLog.info("Upload Chunk Request: Blob doesn't match its hash.")
+            return False
+        if content is not None:
+            stored = self.verifierDatabase.storeBlob(blobHash, content, str(datetime.now()))
+        else:
+            stored = self.verifierDatabase.storeBlobFile(blobHash, path, str(datetime.now())) or self.verifierDatabase.blobExists(blobHash)
+        if not stored:
+            logging.error("Upload Chunk Request: Failed to store blob.")
+        return stored
+
+    def handleDownloadChunkRequest(self, conn, data):
+        """ respond with a chunk of a leased blob. A request at blob's end acknowledges the download. """
+        request = protocol.DownloadChunkRequest()
+        response = protocol.DownloadChunkResponse()
+        if not request.unpack(data):
+            logging.error("Download Chunk Request: Failed to parse request!")
+            return False
+        if not self.database.leaseExists(request.blobHash, request.header.clientID):
+            requestLog.info(f"Download Chunk Request: clientID ({request.header.clientID}) holds no such blob.")
+            return False
+        blobSize = self.database.getBlobSize(request.blobHash)
+        if blobSize is None or request.offset > blobSize:
+            requestLog.info("Download Chunk Request: Invalid blob or offset.")
+            return False
+        if request.header.version < protocol.VERSION_LARGE and blobSize > protocol.CSIZE_MAX:
+            requestLog.info(f"Download Chunk Request: Blob is too large for client version {request.header.version}.")
+            return False
+        length = min(request.length, protocol.TRANSFER_CHUNK_SIZE, blobSize - request.offset)
+        if length > 0:
+            response.content = self.database.getBlobChunk(request.blobHash, request.offset, length)
+            if response.content is None:
+                logging.error("Download Chunk Request: Failed to read blob.")
+                return False
+        response.version = request.header.version
+        response.blobHash = request.blobHash
+        response.blobSize = blobSize
+        response.offset = request.offset
+        response.header.payloadSize = response.size()
+
+        def acknowledged(sent):
+            """ blob is released once the acknowledging response was sent. """
+            if not sent:
+                return
+            self.database.endLease(request.blobHash, request.header.clientID)
+            self.database.releaseBlob(request.blobHash)
+        return self.write(conn, response.pack(), acknowledged if request.offset == blobSize else None)
+
+
+def runWorker(host, port, backlog, worker, messageTtl):
+    """ Entry point of a worker process. """
+    svr = Server(host, port, backlog, worker, messageTtl=messageTtl)
+    if not svr.start():
+        logging.error(f"Worker {worker} failed to start: {svr.lastErr}")
+        exit(1)
+
+
+def startWorkers(host, port, workers, backlog, messageTtl=Server.MESSAGE_TTL):
+    """
+    Run worker processes which accept on the same port, and share the database.
+    Requires SO_REUSEPORT. Returns once all workers stopped. Return False if a worker failed.
+    """
+    if not hasattr(socket, 'SO_REUSEPORT'):
+        logging.error("Multiple workers require SO_REUSEPORT, which is not supported by this platform.")
         return False
+    database.Database(Server.DATABASE).initialize()  # once, before workers race for it.
+    processes = []
+    for worker in range(workers):
+        process = multiprocessing.Process(target=runWorker, args=(host, port, backlog, worker, messageTtl), daemon=True)
+        process.start()
+        processes.append(process)
+    signal.signal(signal.SIGTERM, lambda signum, frame: exit(1))  # unwind, so workers are stopped too.
+    try:
+        for process in processes:
+            process.join()
+    finally:
+        for process in processes:
+            if process.is_alive():
+                process.terminate()
+    return all(process.exitcode == 0 for process in processes)
@@ -0,0 +1,368 @@
+"""
+MessageU Server
+storage.py: message queue storage engines. Database stores messages through an engine.
+https://github.com/Romansko/MessageU/blob/main/server/storage.py
+"""
+__author__ = "Roman Koifman"
+
+import logging
+import os
+import struct
+import threading
+import protocol
+from datetime import datetime
+
+
+class MessageStore:
+    """
+    Message queue storage engine interface.
+    A message is identified by a non zero ID. Pending messages are returned in storing order.
+    """
+
+    def initialize(self):
+        """ Prepare storage. Return False on failure. """
+        return True
+
+    def store(self, msg):
+        """ Store a validated database.Message. Return its ID, None on failure. """
+        raise NotImplementedError
+
+    def storeAll(self, msgs, onStored):
+        """
+        Store validated database.Messages, all or none. onStored(cursor) is invoked once they are stored, and may raise
+        to roll them back. cursor is of the database transaction which stored them, None if they aren't stored within
+        the database. Return their IDs, None on failure.
+        """
+        raise NotImplementedError
+
+    def pending(self, client_id):
+        """ Return pending messages of a client as [(ID, FromClient, Type, Content)]. """
+        raise NotImplementedError
+
+    def remove(self, client_id, ids):
+        """
+        Remove delivered messages of a client. ids are the IDs of messages returned by pending().
+        Return IDs of the messages which were removed by this call, None on failure. Messages which
+        were already removed are excluded, hence their blobs are released by whoever removed them.
+        """
+        raise NotImplementedError
+
+    def expire(self, before, limit):
+        """
+        Remove about limit undelivered messages which were stored before a datetime.
+        Return (removed count, [hashes of blobs referenced by messages removed by this call]).
+        """
+        raise NotImplementedError
+
+
+def referencedBlob(mtype, content):
+    """ Hash of the blob which a message references. None if it references none. """
+    if int(mtype) & protocol.MSG_FLAG_BLOB and len(content) >= protocol.BLOB_HASH_SIZE:
+        return bytes(content[:protocol.BLOB_HASH_SIZE])
+    return None
+
+
+class SqliteMessageStore(MessageStore):
+    """ Messages are rows of the database's messages table. """
+
+    def __init__(self, database):
+        self.database = database
+
+    def initialize(self):
+        self.database.executescript(f"""
+            CREATE TABLE {self.database.MESSAGES}(
+              ID INTEGER PRIMARY KEY,
+              ToClient CHAR(16) NOT NULL,
+              FromClient CHAR(16) NOT NULL,
+              Type CHAR(1) NOT NULL,
+              Content BLOB,
+              Created DATE,
+              FOREIGN KEY(ToClient) REFERENCES {self.database.CLIENTS}(ID),
+              FOREIGN KEY(FromClient) REFERENCES {self.database.CLIENTS}(ID)
+            );
+            """)
+
+        # Tables created by server version 2 have no Created column. Their messages expire a TTL after upgrade.
+        self.database.executescript(f"ALTER TABLE {self.database.MESSAGES} ADD COLUMN Created DATE;")
+        self.database.execute(f"UPDATE {self.database.MESSAGES} SET Created = ? WHERE Created IS NULL",
+                              [str(datetime.now())], True)
+        self.database.executescript(f"""
+            CREATE INDEX IF NOT EXISTS {self.database.MESSAGES}_to ON {self.database.MESSAGES}(ToClient);
+            CREATE INDEX IF NOT EXISTS {self.database.MESSAGES}_created ON {self.database.MESSAGES}(Created);
+            """)
+        return True
+
+    def store(self, msg):
+        return self.database.execute(
+            f"INSERT INTO {self.database.MESSAGES}(ToClient, FromClient, Type, Content, Created) VALUES (?, ?, ?, ?, ?)",
+            [msg.ToClient, msg.FromClient, msg.Type, msg.Content, msg.Created], True, True)
+
+    def storeAll(self, msgs, onStored):
+        def store(cur):
+            ids = []
+            for msg in msgs:
+                cur.execute(
+                    f"INSERT INTO {self.database.MESSAGES}(ToClient, FromClient, Type, Content, Created) VALUES (?, ?, ?, ?, ?)",
+                    [msg.ToClient, msg.FromClient, msg.Type, msg.Content, msg.Created])
+                ids += [cur.lastrowid]
+            onStored(cur)
+            return ids
+        return self.database.transaction(store)
+
+    def pending(self, client_id):
+        return self.database.execute(
+            f"SELECT ID, FromClient, Type, Content FROM {self.database.MESSAGES} WHERE ToClient = ? ORDER BY ID",
+            [client_id])
+
+    def remove(self, client_id, ids):
+        if not ids:
+            return []
+        marks = ", ".join("?" * len(ids))
+
+        def delete(cur):
+            """ rows are selected & deleted under the write lock, hence each is reported by a single remover. """
+            cur.execute(f"SELECT ID FROM {self.database.MESSAGES} WHERE ID IN ({marks})", list(ids))
+            removed = [row[0] for row in cur.fetchall()]
+            cur.execute(f"DELETE FROM {self.database.MESSAGES} WHERE ID IN ({marks})", list(ids))
+            return removed
+        return self.database.transaction(delete)
+
+    def expire(self, before, limit):
+        rows = self.database.execute(
+            f"SELECT ID, Type, substr(Content, 1, ?) FROM {self.database.MESSAGES} WHERE Created < ? ORDER BY Created LIMIT ?",
+            [protocol.BLOB_HASH_SIZE, str(before), limit])
+        if not rows:
+            return 0, []
+        removed = set(self.remove(None, [row[0] for row in rows]) or [])
+        blobs = [referencedBlob(row[1], row[2]) for row in rows if row[0] in removed]
+        return len(removed), [blob for blob in blobs if blob]
+
+
+class RecipientLog:
+    """
+    In memory index of a recipient's log: its segments, and the position of its first unacknowledged record.
+    Segment files are named by the ID of their first record. Records are IDs in sequence.
+    """
+
+    def __init__(self, path):
+        self.path = path
+        self.segments = []  # [firstId, size] of segment files, in order.
+        self.nextId = 1     # ID of the next stored record.
+        self.acked = 0      # Records up to this ID were delivered.
+        self.readOffset = 0  # Byte offset of the first unacknowledged record within the first segment.
+
+    def segmentPath(self, firstId):
+        return os.path.join(self.path, f"{firstId:010d}{LogMessageStore.SUFFIX}")
+
+
+class LogMessageStore(MessageStore):
+    """
+    Append only message log per recipient, within its own directory. A log is split into segments.
+    Storing appends to the last segment. Pending messages are read by a sequential scan from the first
+    unacknowledged record. Acknowledging persists an offset; segments of delivered records are deleted at once.
+    Segments expire as a whole, once their last append is older than the expiry time.
+    The index is held by the process, hence the log must not be shared by worker processes.
+    Message IDs are per recipient. Operations are locked, as logs are expired by a background thread.
+    """
+
+    SEGMENT_SIZE = 4 << 20  # A new segment is started once the last one exceeds this size.
+    SUFFIX = '.log'
+    ACK = 'ack'  # Last acknowledged ID of a recipient, 4 bytes.
+    RECORD = struct.Struct(f"<L{protocol.CLIENT_ID_SIZE}sBL")  # ID, FromClient, Type, Content size.
+
+    def __init__(self, directory):
+        self.directory = directory
+        self.logs = {}  # recipient ID -> RecipientLog. Loaded upon first access.
+        self.lock = threading.RLock()
+
+    def initialize(self):
+        try:
+            os.makedirs(self.directory, exist_ok=True)
+            return True
+        except OSError as e:
+            logging.error(f"Failed to create messages directory {self.directory}: {e}")
+            return False
+
+    def scan(self, path, offset=0, untilId=None):
+        """
+        Read records of a segment sequentially from offset. Stop before a record past untilId.
+        Return ([(ID, FromClient, Type, Content)], end offset). A partial record at segment's end is ignored.
+        """
+        records = []
+        with open(path, "rb") as segment:
+            segment.seek(offset)
+            data = segment.read()
+        position = 0
+        while position + LogMessageStore.RECORD.size <= len(data):
+            msgId, fromClient, mtype, size = LogMessageStore.RECORD.unpack_from(data, position)
+            if untilId is not None and msgId > untilId:
+                break
+            end = position + LogMessageStore.RECORD.size + size
+            if end > len(data):
+                break
+            records.append((msgId, fromClient, mtype, data[position + LogMessageStore.RECORD.size:end]))
+            position = end
+        return records, offset + position
+
+    def load(self, client_id):
+        """ Return the index of a recipient's log. Built from its directory upon first access. """
+        log = self.logs.get(client_id)
+        if log is not None:
+            return log
+        log = RecipientLog(os.path.join(self.directory, client_id.hex()))
+        if os.path.isdir(log.path):
+            try:
+                with open(os.path.join(log.path, LogMessageStore.ACK), "rb") as ack:
+                    log.acked = struct.unpack("<L", ack.read(4))[0]
+            except (OSError, struct.error):
+                log.acked = 0
+            names = sorted(name for name in os.listdir(log.path) if name.endswith(LogMessageStore.SUFFIX))
+            log.segments = [[int(name[:-len(LogMessageStore.SUFFIX)]), 0] for name in names]
+            log.nextId = log.acked + 1
+            if log.segments:
+                last = log.segments[-1]
+                records, end = self.scan(log.segmentPath(last[0]))
+                os.truncate(log.segmentPath(last[0]), end)  # drop a record partially written upon a crash.
+                log.nextId = max(log.nextId, last[0] + len(records))
+                for segment in log.segments:
+                    segment[1] = os.path.getsize(log.segmentPath(segment[0]))
+            self.truncate(log)
+        self.logs[client_id] = log
+        return log
+
+    def truncate(self, log):
+        """ Delete segments whose records were all delivered. Locate the first unacknowledged record. """
+        while log.segments:
+            following = log.segments[1][0] if len(log.segments) > 1 else log.nextId
+            if following > log.acked + 1:
+                break
+            os.remove(log.segmentPath(log.segments[0][0]))
+            log.segments.pop(0)
+            log.readOffset = 0
+        if log.segments and log.segments[0][0] <= log.acked:
+            _, log.readOffset = self.scan(log.segmentPath(log.segments[0][0]), log.readOffset, log.acked)
+
+    def acknowledge(self, log, acked):
+        """ Persist the last acknowledged ID of a log, then delete its delivered segments. """
+        with open(os.path.join(log.path, LogMessageStore.ACK), "wb") as ack:
+            ack.write(struct.pack("<L", acked))
+        log.acked = acked
+        self.truncate(log)
+
+    def append(self, msg):
+        """ Append a record to its recipient's log. Return its ID. Raises upon failure. """
+        log = self.load(msg.ToClient)
+        if not log.segments or log.segments[-1][1] >= LogMessageStore.SEGMENT_SIZE:
+            os.makedirs(log.path, exist_ok=True)
+            log.segments.append([log.nextId, 0])
+        record = LogMessageStore.RECORD.pack(log.nextId, msg.FromClient, msg.Type, len(msg.Content))
+        with open(log.segmentPath(log.segments[-1][0]), "ab") as segment:
+            segment.write(record + msg.Content)
+        log.segments[-1][1] += len(record) + len(msg.Content)
+        log.nextId += 1
+        return log.nextId - 1
+
+    def store(self, msg):
+        with self.lock:
+            try:
+                return self.append(msg)
+            except (OSError, struct.error) as e:
+                logging.error(f"Failed to append message of {msg.ToClient.hex()}: {e}")
+                return None
+
+    def storeAll(self, msgs, onStored):
+        """ Records appended to the logs are truncated upon failure, restoring the logs as they were. """
+        with self.lock:
+            saved = {}  # recipient ID -> (log, segments, nextId) before appending.
+            try:
+                ids = []
+                for msg in msgs:
+                    if msg.ToClient not in saved:
+                        log = self.load(msg.ToClient)
+                        saved[msg.ToClient] = (log, [list(segment) for segment in log.segments], log.nextId)
+                    ids += [self.append(msg)]
+                onStored(None)
+                return ids
+            except Exception as e:
+                logging.error(f"Failed to append messages: {e}")
+                for log, segments, nextId in saved.values():
+                    self.restore(log, segments, nextId)
+                return None
+
+    def restore(self, log, segments, nextId):
+        """ Truncate records appended to a log since its segments & nextId were saved. """
+        try:
+            firstIds = [segment[0] for segment in segments]
+            for firstId, size in log.segments:
+                if firstId not in firstIds and os.path.exists(log.segmentPath(firstId)):
+                    os.remove(log.segmentPath(firstId))
+            if segments:
+                os.truncate(log.segmentPath(segments[-1][0]), segments[-1][1])
+        except OSError as e:
+            logging.error(f"Failed to truncate messages of {log.path}: {e}")
+        log.segments = segments
+        log.nextId = nextId
+
+    def pending(self, client_id):
+        with self.lock:
+            try:
+                log = self.load(client_id)
+                messages = []
+                offset = log.readOffset
+                for firstId, size in log.segments:
+                    records, _ = self.scan(log.segmentPath(firstId), offset)
+                    messages += records
+                    offset = 0
+                return messages
+            except OSError as e:
+                logging.error(f"Failed to read messages of {client_id.hex()}: {e}")
+                return None
+
+    def remove(self, client_id, ids):
+        """ Acknowledge messages up to the highest delivered ID. Messages acknowledged before were removed already. """
+        if not ids:
+            return []
+        with self.lock:
+            try:
+                log = self.load(client_id)
+                acked = min(max(ids), log.nextId - 1)
+                removed = [msgId for msgId in ids if log.acked < msgId <= acked]
+                if acked > log.acked:
+                    self.acknowledge(log, acked)
+                return removed
+            except OSError as e:
+                logging.error(f"Failed to acknowledge messages of {client_id.hex()}: {e}")
+                return None
+
+    def expire(self, before, limit):
+        """ Acknowledge whole segments which weren't appended to since before. """
+        removed = 0
+        blobs = []
+        expiry = before.timestamp()
+        with self.lock:
+            try:
+                recipients = os.listdir(self.directory)
+            except OSError as e:
+                logging.error(f"Failed to list messages directory {self.directory}: {e}")
+                return 0, []
+            for recipient in recipients:
+                if removed >= limit:
+                    break
+                try:
+                    log = self.load(bytes.fromhex(recipient))
+                    acked = log.acked
+                    offset = log.readOffset
+                    for i, (firstId, size) in enumerate(log.segments):
+                        path = log.segmentPath(firstId)
+                        if removed >= limit or os.path.getmtime(path) >= expiry:
+                            break
+                        records, _ = self.scan(path, offset)
+                        offset = 0
+                        removed += len(records)
+                        blobs += [blob for blob in (referencedBlob(r[2], r[3]) for r in records) if blob]
+                        acked = log.segments[i + 1][0] - 1 if i + 1 < len(log.segments) else log.nextId - 1
+                    if acked > log.acked:
+                        self.acknowledge(log, acked)
+                except (OSError, ValueError) as e:
+                    logging.error(f"Failed to expire messages of {recipient}: {e}")
+        return removed, blobs